@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Benchmark of the modem poller against the modem simulator: starts the
+# simulator, polls all of its modems several times and prints the OIDs per
+# second, CPU time, peak RSS and cycle time of each run, which are taken from
+# the metrics of the poller (-M).
+#
+# usage: bench/benchmark.sh [-n modems] [-r runs] [-s simulator_options] [-- poller_options]
+#
+# e.g. bench/benchmark.sh -n 20000 -s "-l 20 -j 10 -L 1" -- -x -z -t 4
+#
+# Both programs have to be built (see README.md). The simulated modems listen
+# on port 161 and the poller raises its file limit, so run it as root.
+
+set -e
+cd "$(dirname "$0")/.."
+root=$(pwd)
+modems=10000
+runs=3
+simulator=""
+
+while getopts "n:r:s:" opt; do
+    case $opt in
+    n) modems=$OPTARG ;;
+    r) runs=$OPTARG ;;
+    s) simulator=$OPTARG ;;
+    *) echo "usage: $0 [-n modems] [-r runs] [-s simulator_options] [-- poller_options]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+work=$(mktemp -d)
+sim=""
+trap 'if [ -n "$sim" ]; then kill $sim 2>/dev/null; wait $sim 2>/dev/null || true; fi; rm -rf "$work"' EXIT
+
+# the simulator writes the host list, once its sockets are open
+"$root/src/modemsim-nmsprime" -n "$modems" -f "$work/hosts" $simulator 2>"$work/simulator.log" &
+sim=$!
+while [ ! -f "$work/hosts" ]; do
+    if ! kill -0 $sim 2>/dev/null; then
+        cat "$work/simulator.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+echo "simulator: -n $modems $simulator"
+echo "poller: $*"
+printf "%4s %8s %8s %10s %9s %11s %8s %8s %8s\n" run hosts failed oids cycle_s oids_per_s user_s sys_s rss_mb
+
+for run in $(seq "$runs"); do
+    if ! (cd "$work" && "$root/src/modempoller-nmsprime" -f hosts -M metrics -o results.bin "$@" >poller.log 2>&1); then
+        tail "$work/poller.log" >&2
+        exit 1
+    fi
+
+    sed -n \
+        -e 's/.*"phases_ms":.*"cycle": \([0-9]*\)}.*/cycle \1/p' \
+        -e 's/.*"cpu_ms": {"user": \([0-9]*\), "system": \([0-9]*\)}.*/cpu \1 \2/p' \
+        -e 's/.*"max_rss_kb": \([0-9]*\).*/rss \1/p' \
+        -e 's/.*"hosts": {"polled": \([0-9]*\), "failed": \([0-9]*\).*/hosts \1 \2/p' \
+        -e 's/.*"varbinds": \([0-9]*\).*/oids \1/p' \
+        "$work/metrics.json" |
+    awk -v run="$run" '
+        { value[$1] = $2; second[$1] = $3 }
+        END {
+            seconds = value["cycle"] / 1000
+            printf "%4d %8d %8d %10d %9.2f %11.0f %8.2f %8.2f %8.1f\n", run, value["hosts"], second["hosts"], value["oids"],
+                   seconds, (seconds > 0 ? value["oids"] / seconds : 0), value["cpu"] / 1000, second["cpu"] / 1000, value["rss"] / 1024
+        }'
+done
@@ -11,8 +11,9 @@
  *
  * The requested OIDs are divided into three segments: non-repeaters for system
  * information, downstream and upstream. For each host a separate session will
- * be created. All requests are handled asynchronously and on response the next
- * batch of the current segment is requested.
+ * be created, unless a pool of shared sockets is requested. All requests are
+ * handled asynchronously and on response the next batch of the current segment
+ * is requested.
  *
  * Christian Schramm (@cschra) and Ole Ernst (@olebowle), 2021
  *
@@ -21,15 +22,78 @@
 /********************************** DEFINES **********************************/
 #define _GNU_SOURCE
 #define RETRIES 3
-#define TIMEOUT 5
+#define TIMEOUT 5                                       /* seconds, also the upper bound of the adaptive timeout */
+#define MIN_TIMEOUT 200000                              /* lower bound of the adaptive timeout in microseconds */
+#define PROBE_TIMEOUT 250000                            /* timeout of a host, which did not respond last time */
+#define SOCKET_BUFFER (8 * 1024 * 1024)
+#define MAX_EVENTS 256
+#define MAX_SUFFIX_LEN 8                                /* longest table index, which can be continued */
+#define MTU 1500
+#define RESPONSE_BUDGET (4 * (MTU - 28))                /* response size, the repetitions are limited to */
+#define MAX_VARBINDS 1024                               /* varbinds per response of the built-in decoder */
+#define BATCH_SIZE 32                                   /* packets per sendmmsg / recvmmsg call of the raw transport */
+#define MAX_BATCH_SIZE 256
+#define RECEIVE_BUFFER 65536                            /* size of each receive buffer of the raw transport */
+#define HISTOGRAM_BUCKETS 208                           /* 8 buckets per power of two, up to 2^28 */
+#define SLOT_CHUNK 4096                                 /* request slots allocated at once */
+#define MAX_SLOTS (1 << 24)                             /* the lower bits of a request id are the index of its slot */
+#define ARENA_CHUNK (1024 * 1024)                       /* bytes allocated at once by an arena */
+#define DNS_LOOKUPS 64                                  /* concurrent lookups of the resolver */
+#define DNS_TTL 300                                     /* seconds a resolved address is cached */
+#define DNS_POLL 10                                     /* ms the resolver waits for lookups, before taking new hosts */
+#define STATE_MAGIC 0x4d505354                          /* "MPST" */
+#define STATE_VERSION 2                                 /* format of the state file, 2: full host names and repetition limits */
+#define STATE_NAME_LEN 256                              /* longest host name (253 characters) and its terminator */
+#define COPY_BATCH 256                                  /* hosts copied into the database at once */
+#define COPY_CHUNK (256 * 1024)                         /* bytes passed to libpq at once */
+#define DIRECT_IO_ALIGN 4096                            /* alignment of buffer and length for O_DIRECT */
+#define RESULT_MAGIC 0x4d505252                         /* "MPRR" */
+#define RESULT_VERSION 2                                /* 2: flags, a RESULT_DELTA file only contains the changed values */
+#define RESULT_DELTA 1                                  /* flag of a result file, which only contains the changed values */
+#define RESULT_NO_COLUMN 0xffff                         /* column of varbinds outside of the profile */
+#define ENGINE_ID_LEN 32                                /* longest cached snmpEngineID, RFC 3411 allows 32 bytes */
+#define MIN_PASSPHRASE_LEN 8                            /* shorter USM passphrases are rejected by RFC 3414 */
+#define CACHE_MAGIC 0x4d504343                          /* "MPCC" */
+#define CACHE_SIZE (1 << 20)                            /* entries of a new change cache, it doubles when half full */
+#define SNAPSHOT_CYCLES 12                              /* every n-th cycle outputs all values, despite the change cache */
+#define FNV_OFFSET 0xcbf29ce484222325ULL                /* 64 bit FNV-1a, used for the keys and values of the change cache */
+#define FNV_PRIME 0x100000001b3ULL
+#define NO_SAMPLE INT32_MIN                             /* value of a channel, which the modem did not report */
+#define SUMMARY_BINS 40                                 /* bins of the histograms of the plant summary */
+#define QUERY_TIMEOUT 1                                 /* seconds a client of the query service may take to send its request */
+#define QUERY_BUFFER (1 << 20)                          /* send buffer of a client of the query service, which holds the output of a modem */
+#define QUERY_PAUSE 2000                                /* ms per cycle the query service may pause the bulk poll of a worker */
+#define MAX_SHARDS 4096                                 /* partitions of the modems by modem.id, which are polled by different nodes */
+#define LEASE_INTERVALS 3                               /* intervals a shard stays leased to a node, which does not renew it */
+#define QUERY_POLL 10                                   /* ms the paused bulk poll waits, before it checks for pending queries again */
+#define RESULT_ALIGN(len) (((len) + 7) & ~(size_t)7)    /* records and their values are 8 byte aligned */
+
+#define containerOf(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 
 /********************************* INCLUDES **********************************/
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <libpq-fe.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <net-snmp/net-snmp-config.h>
 #include <net-snmp/net-snmp-includes.h>
 #include <net-snmp/library/large_fd_set.h>
+#include <net-snmp/library/snmp_auth.h>
 
 /****************************** GLOBAL STRUCTURES ****************************/
 /* to keep track which segment is sent */
@@ -46,7 +110,74 @@ typedef enum pass {
     FINISH
 } pass_t;
 
-long repetitions[FINISH] = {0, 9, 9, 5, 5, 3, 3, 9, 5};
+long repetitions[FINISH] = {0, 9, 9, 5, 5, 3, 3, 9, 5};   /* default, if nothing was learned for the host */
+const char *segmentNames[FINISH] = {
+    "non_rep", "downstream30", "downstream30a", "upstream30", "upstream30a", "downstream31", "upstream31", "downsub31", "profile_stats31"
+};
+
+/* capabilities of a modem, a segment is only requested if the modem has all capabilities it requires */
+enum capability {
+    CAP_DOCSIS31 = 1 << 0,
+};
+
+int segmentRequires[FINISH] = {
+    [DOWNSTREAM31] = CAP_DOCSIS31,
+    [UPSTREAM31] = CAP_DOCSIS31,
+    [DOWNSUB31] = CAP_DOCSIS31,
+    [PROFILE_STATS31] = CAP_DOCSIS31,
+};
+
+/* varbinds of the NON_REP segment, which reveal a capability of the modem */
+typedef struct capabilityProbe {
+    int capability;
+    const char *Name;                                   /* prefix of the varbind */
+    long minValue;                                      /* least integer value showing the capability, 0 for any object */
+    oid Oid[MAX_OID_LEN];
+    size_t OidLen;
+} capabilityProbe_t;
+
+capabilityProbe_t capabilityProbes[] = {
+    { CAP_DOCSIS31, "1.3.6.1.2.1.10.127.1.1.5", 5 },          /* docsIfDocsisBaseCapability >= docsis31 */
+    { CAP_DOCSIS31, "1.3.6.1.4.1.4491.2.1.28.1", 0 },         /* any object of the DOCSIS 3.1 MIB */
+    { 0 }
+};
+
+/* columns of the channel tables, which are aggregated per frequency for the plant summary */
+enum channelField {
+    DS_FREQUENCY,
+    DS_POWER,
+    DS_SNR,
+    DS_SNR30,
+    DS_MICROREFLECTIONS,
+    DS_UNERRORED,
+    DS_CORRECTED,
+    DS_UNCORRECTABLE,
+    US_FREQUENCY,
+    US_POWER,
+    CHANNEL_FIELDS
+};
+
+typedef struct channelColumn {
+    const char *Name;                                   /* column, the suffix of a varbind is the ifIndex of the channel */
+    oid Oid[MAX_OID_LEN];
+    size_t OidLen;
+} channelColumn_t;
+
+oid uptimeOid[MAX_OID_LEN];                             /* sysUpTime, which is polled for the plant summary */
+size_t uptimeOidLen = MAX_OID_LEN;
+
+channelColumn_t channelColumns[CHANNEL_FIELDS] = {
+    [DS_FREQUENCY] = { "1.3.6.1.2.1.10.127.1.1.1.1.2" },
+    [DS_POWER] = { "1.3.6.1.2.1.10.127.1.1.1.1.6" },            /* in tenth dBmV */
+    [DS_SNR] = { "1.3.6.1.2.1.10.127.1.1.4.1.5" },              /* in tenth dB */
+    [DS_SNR30] = { "1.3.6.1.4.1.4491.2.1.20.1.24.1.1" },        /* preferred to the SNR of DOCSIS 2.0 */
+    [DS_MICROREFLECTIONS] = { "1.3.6.1.2.1.10.127.1.1.4.1.6" }, /* in -dBc */
+    [DS_UNERRORED] = { "1.3.6.1.2.1.10.127.1.1.4.1.2" },
+    [DS_CORRECTED] = { "1.3.6.1.2.1.10.127.1.1.4.1.3" },
+    [DS_UNCORRECTABLE] = { "1.3.6.1.2.1.10.127.1.1.4.1.4" },
+    [US_FREQUENCY] = { "1.3.6.1.2.1.10.127.1.1.2.1.2" },
+    [US_POWER] = { "1.3.6.1.4.1.4491.2.1.20.1.2.1.1" },         /* in tenth dBmV */
+};
 
 /* a list of variables to query for */
 typedef struct oid_s {
@@ -54,6 +185,8 @@ typedef struct oid_s {
     const char *Name;
     oid Oid[MAX_OID_LEN];
     size_t OidLen;
+    u_char Encoded[MAX_OID_LEN * 5];                    /* contents of the BER encoded oid, for the raw transport */
+    size_t EncodedLen;
 } oid_t;
 
 oid_t oids_single[] = {
@@ -116,38 +249,474 @@ oid_t oids_multiple[] = {
     { FINISH }
 };
 
-oid_t *oids = NULL;
+/* only needed by the plant summary, added to oids_multiple with -P */
+oid_t oids_summary[] = {
+    { NON_REP, "1.3.6.1.2.1.1.3" },                     /* Uptime */
+    { DOWNSTREAM30, "1.3.6.1.2.1.10.127.1.1.1.1.2" },     /* Frequency */
+    { DOWNSTREAM30, "1.3.6.1.2.1.10.127.1.1.4.1.2" },     /* Unerrored */
+    { FINISH }
+};
+
+typedef struct profile {                                /* oids polled from a host and the requests derived from them */
+    oid_t *oids;
+    int itemCount[FINISH];
+    int oidCount;                                       /* number of oids of all segments */
+    int probedCapabilities;                             /* capabilities probed by the NON_REP segment */
+    struct snmp_pdu *requests[FINISH];                  /* first request of each segment, cloned for every host */
+    u_char *templates[FINISH];                          /* encoded varbind list of the first request of each segment */
+    size_t templateLen[FINISH];
+} profile_t;
+
+profile_t bulkProfile = { oids_multiple };
+profile_t singleProfile = { oids_single };              /* single modem analysis, also used by the query service */
+profile_t *polledProfile = &bulkProfile;                /* profile of the polled hosts, the single one with -a */
+
+typedef struct pollTimer {                              /* timer of the epoll event loop */
+    struct timeval expires;                             /* when the timer expires */
+    int index;                                          /* position in the timer heap, -1 if not scheduled */
+    void (*expire)(struct pollTimer *);                 /* called once the timer expired */
+} pollTimer_t;
+
+typedef struct timerHeap {                              /* binary min heap of timers, ordered by expiry */
+    pollTimer_t **timers;
+    int count;
+    int size;
+} timerHeap_t;
+
+typedef struct packetBatch {                            /* packets of a sendmmsg / recvmmsg call */
+    struct mmsghdr *headers;
+    struct iovec *iov;
+    u_char *buffers;                                    /* one buffer per packet */
+    netsnmp_indexed_addr_pair *addresses;               /* destination or source of each packet */
+    int count;                                          /* queued packets to be sent */
+} packetBatch_t;
+
+typedef struct sessionContext {                         /* netsnmp session of a single host or of the socket pool */
+    struct snmp_session *session;                       /* the session itself */
+    void *handle;                                       /* single session API handle, only set for the epoll loop */
+    pollTimer_t timer;                                  /* next retransmission or timeout of a request */
+    struct worker *worker;                              /* worker owning the session */
+    int fd;                                             /* socket of the raw transport, which bypasses netsnmp */
+    packetBatch_t requests;                             /* requests of the raw transport, which are not sent yet */
+} sessionContext_t;
+
+typedef struct columnCursor {                           /* progress of a table column of a host */
+    oid suffix[MAX_SUFFIX_LEN];                         /* index of the last received row */
+    unsigned char suffixLen;
+    unsigned char done;                                 /* the column passed its prefix */
+    unsigned short rows;                                /* number of received rows */
+} columnCursor_t;
+
+typedef struct arenaChunk {                             /* block of memory of an arena */
+    struct arenaChunk *next;                            /* the previous, full chunk */
+    size_t used;
+    size_t size;
+    max_align_t data[];
+} arenaChunk_t;
+
+typedef struct arena {                                  /* allocations, which never move and are freed all at once */
+    arenaChunk_t *head;                                 /* current chunk */
+} arena_t;
+
+typedef struct codewordCounters {                       /* codeword counters of a downstream channel at the last poll */
+    long ifIndex;
+    uint32_t counters[3];                               /* unerrored, corrected and uncorrectable */
+} codewordCounters_t;
+
+typedef struct hostState {                              /* learned state of a host, persisted across runs */
+    char name[STATE_NAME_LEN];                          /* fqdn of the host */
+    long repetitions[FINISH];                           /* learned max-repetitions per segment, 0 if unknown */
+    long repetitionLimit[FINISH];                       /* max-repetitions after a tooBig response, 0 if none */
+    unsigned char capabilities;                         /* capabilities the modem has */
+    unsigned char knownCapabilities;                    /* capabilities, which were probed at all */
+    unsigned char dead;                                 /* the host did not respond last time */
+    long srtt;                                          /* smoothed round trip time in microseconds, 0 if unknown */
+    long rttvar;                                        /* round trip time variation in microseconds */
+    in_addr_t address;                                  /* resolved address of the host name, 0 if unknown */
+    time_t addressExpires;                              /* when the address has to be resolved again */
+    u_char engineID[ENGINE_ID_LEN];                     /* discovered snmpEngineID of an SNMPv3 host */
+    size_t engineIDLen;                                 /* 0 if the engine has to be discovered */
+    u_int engineBoots;                                  /* snmpEngineBoots and snmpEngineTime at engineTimeSaved */
+    u_int engineTime;
+    time_t engineTimeSaved;                             /* 0 if the engine time is unknown */
+    codewordCounters_t *codewords;                      /* counters of the downstream channels, not persisted */
+    int codewordCount;
+    u_long uptime;                                      /* sysUpTime at the poll of the codewords, 0 if unknown */
+} hostState_t;
+
+typedef struct stateTable {                             /* hash table of the host states, open addressing */
+    hostState_t **entries;                              /* NULL for an unused slot */
+    size_t size;                                        /* power of two */
+    size_t count;
+    arena_t arena;                                      /* the states, so that they keep their address, when the table grows */
+} stateTable_t;
+
+typedef struct cacheHeader {                            /* header of the change cache file, the entries follow */
+    uint32_t magic;
+    uint32_t entrySize;                                 /* to detect a file of a different format */
+    uint64_t size;                                      /* number of entries, a power of two */
+    uint64_t count;                                     /* used entries */
+    uint64_t cycle;                                     /* cycles polled with the cache, for the full snapshots */
+} cacheHeader_t;
+
+typedef struct cacheEntry {                             /* last value of a varbind of a host, open addressing */
+    uint64_t key;                                       /* hash of the host name and the oid, 0 for an unused entry */
+    uint64_t value;                                     /* hash of the type and the value */
+} cacheEntry_t;
+
+typedef struct cacheUpdate {                            /* new value of an entry of the change cache, kept until the output is written */
+    cacheEntry_t *entry;
+    uint64_t value;
+} cacheUpdate_t;
+
+/* layout of the binary result file: header, oids of the profile, host blocks of records, index, footer */
+typedef struct resultHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t columns;                                   /* number of oids, each NUL terminated and padded to 8 bytes */
+    uint32_t flags;                                     /* RESULT_DELTA */
+} resultHeader_t;
+
+typedef struct resultHost {                             /* block of the records of a host */
+    uint32_t hostId;                                    /* modem.id */
+    uint32_t status;                                    /* 0 or STAT_TIMEOUT / STAT_ERROR of a failed request */
+    uint32_t records;
+    uint32_t length;                                    /* length of the records */
+} resultHost_t;
+
+typedef struct resultRecord {                           /* a varbind, the value follows the 8 byte aligned suffix */
+    uint32_t length;                                    /* length of the whole record */
+    uint16_t column;                                    /* index of the oid in the profile */
+    uint8_t type;                                       /* ASN type of the value */
+    uint8_t suffixLen;                                  /* sub-identifiers of the row index */
+    uint32_t suffix[];
+} resultRecord_t;
+
+typedef struct resultIndex {                            /* index entry, sorted by host id */
+    uint32_t hostId;
+    uint32_t length;                                    /* length of the block */
+    uint64_t offset;                                    /* offset of the block */
+} resultIndex_t;
+
+typedef struct resultFooter {
+    uint64_t indexOffset;
+    uint32_t hosts;                                     /* number of index entries */
+    uint32_t magic;
+} resultFooter_t;
+
+typedef struct resultBuffer {                           /* records of a host until it is finished */
+    u_char *data;
+    size_t len;
+    size_t size;
+    uint32_t records;
+} resultBuffer_t;
+
+typedef struct outputJob {                              /* text output or records of a finished host */
+    char *path;                                         /* NULL for stdout */
+    uint32_t hostId;                                    /* modem.id */
+    resultBuffer_t text;
+    resultBuffer_t cacheUpdates;                        /* committed to the change cache, once the output is written */
+    struct outputJob *next;
+} outputJob_t;
+
+typedef struct writer {                                 /* thread writing the output of the finished hosts */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                                /* signaled for new outputs and to stop */
+    outputJob_t *head;
+    outputJob_t *tail;
+    int count;                                          /* number of queued outputs */
+    int stop;
+} writer_t;
+
+typedef struct usmCredential {                          /* SNMPv3 user, its keys are derived once for all hosts */
+    char *name;                                         /* security name */
+    char *authPassphrase;
+    char *privPassphrase;                               /* NULL for authNoPriv */
+    u_char authKey[USM_AUTH_KU_LEN];                    /* master keys (Ku), localized per engineID */
+    size_t authKeyLen;
+    u_char privKey[USM_AUTH_KU_LEN];
+    size_t privKeyLen;
+    int level;                                          /* security level */
+    struct usmCredential *next;
+} usmCredential_t;
+
+typedef struct localizedUser {                          /* USM user of an engineID and security name */
+    u_char engineID[ENGINE_ID_LEN];
+    size_t engineIDLen;
+    usmCredential_t *credential;                        /* credential its keys were localized from, NULL for an unused slot */
+} localizedUser_t;
+
+typedef struct userTable {                              /* hash table of the USM users, open addressing */
+    localizedUser_t *entries;
+    size_t size;                                        /* power of two */
+    size_t count;
+} userTable_t;
+
+typedef struct hostGroup {                              /* hosts sharing a limit of outstanding requests, e.g. a CMTS */
+    char *name;                                         /* value of the group column */
+    int inFlight;                                       /* outstanding requests of all hosts of the group */
+    struct hostContext *head;                           /* queue of hosts with segments waiting to be sent */
+    struct hostContext *tail;
+} hostGroup_t;
+
+typedef struct channelRow {                             /* values of a channel of a host, collected for the plant summary */
+    long ifIndex;
+    long values[CHANNEL_FIELDS];
+    unsigned int present;                               /* bit per received field */
+} channelRow_t;
+
+typedef struct channelSamples {                         /* channels of all hosts by frequency, one array per column */
+    int32_t *frequency;                                 /* in Hz */
+    int32_t *power;                                     /* NO_SAMPLE if the modem did not report the value */
+    int32_t *snr;
+    int32_t *microreflections;
+    int64_t *codewords[3];                              /* unerrored, corrected and uncorrectable since the last cycle, -1 if unknown */
+    size_t count;
+    size_t size;
+} channelSamples_t;
 
 typedef struct hostContext {                            /* context structure to keep track of the current request */
-    struct snmp_session *session;                       /* which host is currently processed */
+    struct worker *worker;                              /* worker polling this host */
+    sessionContext_t *session;                          /* session used to send the requests of this host */
+    char *peername;                                     /* which host is currently processed */
+    struct in_addr ip;                                  /* address of the peername */
+    char *community;                                    /* community of the host */
+    usmCredential_t *credential;                        /* SNMPv3 user of the host, NULL for SNMPv2c */
+    netsnmp_indexed_addr_pair *address;                 /* address of the host, if the session is shared */
     long requestIds[FINISH];                            /* the currently valid request id per segment */
-    FILE *outputFile;                                   /* to which file should the response be written to */
+    struct timeval sent[FINISH];                        /* when the current request of the segment was sent */
+    long timeouts[FINISH];                              /* timeout of the current request of the segment */
+    pollTimer_t start;                                  /* when the host is started within the cycle */
+    pollTimer_t deadline;                               /* the host is given up, if it makes no progress until then */
+    int responded;                                      /* the host responded in this run */
+    columnCursor_t *columns;                            /* progress per oid, allocated while the host is polled */
+    hostState_t *state;                                 /* learned state of the host */
+    profile_t *profile;                                 /* oids polled from the host */
+    pass_t nextSegment;                                 /* next segment to be sent, FINISH if all are sent */
+    int finished;                                       /* all segments are complete */
+    int parked;                                         /* waits for the NON_REP response to probe its capabilities */
+    int probed;                                         /* capabilities probed by the NON_REP response of this run */
+    char *groupName;                                    /* value of the group column */
+    hostGroup_t *group;                                 /* group the host belongs to */
+    struct hostContext *next;                           /* next host in the queue of the group or in the inbox of the worker */
+    struct hostContext *nextHost;                       /* next started host of the worker */
+    char *outputPath;                                   /* to which file should the response be written to, NULL for stdout */
+    uint32_t hostId;                                    /* modem.id, for the binary result file */
+    uint64_t cacheSeed;                                 /* hash of the hostname, the keys of its change cache entries start from */
+    uint32_t status;                                    /* status of a failed request, for the binary result file */
+    int queried;                                        /* requested via the query service, the output is streamed to replyFd */
+    int replyFd;                                        /* client of the query service, -1 once the output is complete */
+    resultBuffer_t results;                             /* text output or records for the binary result file */
+    resultBuffer_t cacheUpdates;                        /* cacheUpdate_t of the output, committed once it is written */
+    channelRow_t *channels;                             /* values of the channels for the plant summary */
+    int channelCount;
+    u_long uptime;                                      /* sysUpTime of the modem for the plant summary, 0 if unknown */
 } hostContext_t;
 
+typedef struct resolver {                               /* thread resolving the host names */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                                /* signaled for new hosts and to stop */
+    hostContext_t *head;                                /* hosts waiting to be resolved */
+    hostContext_t *tail;
+    int stop;                                           /* all hosts of the cycle are queued */
+} resolver_t;
+
+typedef struct stubHost {                               /* entry of the hosts file of the stub resolver */
+    char *name;
+    struct in_addr address;
+} stubHost_t;
+
+typedef struct requestSlot {                            /* outstanding request of the raw transport */
+    pollTimer_t timer;                                  /* next retransmission or timeout */
+    hostContext_t *host;                                /* NULL if the slot is free */
+    pass_t segment;
+    long reqid;                                         /* generation and index of the slot */
+    long index;                                         /* position in the slots of the worker */
+    long generation;
+    long maxRepetitions;
+    long timeout;                                       /* timeout of each transmission in microseconds */
+    int retries;                                        /* retransmissions so far */
+    struct requestSlot *next;                           /* next free slot */
+} requestSlot_t;
+
+typedef struct histogram {                              /* log-linear histogram, 8 buckets per power of two */
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+typedef struct metrics {                                /* counters of a worker during a cycle, or their sum */
+    uint64_t requests[FINISH];                          /* requests sent per segment, without retransmissions */
+    uint64_t retransmissions;                           /* of the raw transport, netsnmp retransmits internally */
+    uint64_t responses;
+    uint64_t timeouts;
+    uint64_t unexpected;                                /* responses from an unexpected source */
+    uint64_t tooBig;
+    uint64_t varbinds;
+    uint64_t unchanged;                                 /* varbinds suppressed by the change cache */
+    uint64_t bytesSent;                                 /* by the raw transport */
+    uint64_t bytesReceived;
+    uint64_t sendCalls;                                 /* sendmmsg calls */
+    uint64_t packetsSent;
+    uint64_t sendErrors;                                /* requests the kernel did not take */
+    uint64_t receiveCalls;                              /* recvmmsg calls */
+    uint64_t packetsReceived;
+    uint64_t copyFailures;                              /* hosts, whose results could not be copied into the database */
+    uint64_t hosts;                                     /* started hosts */
+    uint64_t failedHosts;                               /* hosts with a failed request */
+    uint64_t deadlines;                                 /* hosts given up at their deadline */
+    uint64_t wakeups;                                   /* iterations of the event loop */
+    uint64_t events;                                    /* ready sockets handled by the event loop */
+    uint64_t sessionOpen;                               /* microseconds spent opening sessions */
+    uint64_t discoveries;                               /* SNMPv3 engine discoveries */
+    histogram_t rtt[FINISH];                            /* round trip times per segment in microseconds, must be last */
+} metrics_t;
+
+typedef struct phases {                                 /* durations of the phases of a cycle in microseconds */
+    long queryFirstRow;                                 /* until the first host is received */
+    long query;
+    long sessionOpen;                                   /* sum of all workers */
+    long poll;                                          /* until all hosts are complete */
+    long output;                                        /* writing the outputs left when the hosts are complete */
+    long cycle;
+    long userCpu;                                       /* CPU time of the process during the cycle */
+    long systemCpu;
+    long maxRss;                                        /* peak resident set size of the process in kB */
+} phases_t;
+
+typedef struct worker {                                 /* polling thread, which owns a shard of the hosts */
+    pthread_t thread;
+    int service;                                        /* polls the hosts of the query service until shutdown */
+    int activeHosts;                                    /* hosts of the shard with outstanding requests */
+    int epollFd;                                        /* epoll instance, only used for the epoll loop */
+    timerHeap_t timers;                                 /* session timers of the epoll loop and host deadlines */
+    netsnmp_large_fd_set readSet;                       /* passed to netsnmp when reading a single session */
+    int inFlight;                                       /* outstanding requests of the worker */
+    int window;                                         /* maximum of outstanding requests, 0 is unlimited */
+    int groupLimit;                                     /* maximum of outstanding requests per group, 0 is unlimited */
+    double rate;                                        /* requests per second, 0 is unlimited */
+    double tokens;                                      /* token bucket for pacing the requests */
+    struct timeval refilled;                            /* last time the token bucket was refilled */
+    hostGroup_t **groups;                               /* hosts of the shard by group */
+    int groupCount;
+    int nextGroup;                                      /* group to admit the next request from (round robin) */
+    sessionContext_t *sessions;                         /* the socket pool, the hosts have their own session otherwise */
+    requestSlot_t **slots;                              /* outstanding requests of the raw transport, in chunks of SLOT_CHUNK */
+    long slotCount;                                     /* allocated slots */
+    requestSlot_t *freeSlots;
+    netsnmp_variable_list *varbinds;                    /* varbinds of the built-in decoder, reused for each response */
+    packetBatch_t responses;                            /* receive buffers of the raw transport */
+    metrics_t metrics;                                  /* counters of the cycle */
+    channelSamples_t downstream;                        /* channels of the finished hosts for the plant summary */
+    channelSamples_t upstream;
+    pthread_mutex_t inboxLock;
+    hostContext_t *inbox;                               /* hosts handed over by the main thread, which are not started yet */
+    hostContext_t *inboxTail;
+    int fed;                                            /* all hosts are handed over, protected by the inbox lock */
+    int feeding;                                        /* more hosts may follow, copy of fed for the worker */
+    int wakeFd;                                         /* eventfd signaled for new hosts in the inbox */
+    hostContext_t *hosts;                               /* started hosts of the shard */
+    int hostCount;                                      /* number of started hosts */
+    long *shardDone;                                    /* per shard of the modems: microseconds into the cycle, its last host finished, -1 if none */
+    long paused;                                        /* microseconds the query service paused the bulk poll during the cycle */
+    struct timeval pausedSince;                         /* start of the current pause, cleared if not paused */
+} worker_t;
+
+typedef struct queryService {                           /* resident service for the analysis of single modems */
+    pthread_t thread;                                   /* accepts the clients and looks up their modems */
+    int listenFd;                                       /* Unix socket */
+    PGconn *conn;                                       /* own connection, the main thread queries the polled hosts meanwhile */
+    char query[1024];                                   /* lookup of a modem, its hostname is passed as $1 */
+    worker_t worker;                                    /* polls the requested modems, ahead of the bulk poll */
+} queryService_t;
+
 /****************************** GLOBAL VARIABLES *****************************/
-int activeHosts;
-int itemCount[FINISH] = { 0 };
+int poolSize = 0;                                       /* number of shared sockets per worker, 0 means one session per host */
+int useEpoll = 0;                                       /* use the epoll event loop instead of select */
+int rawTransport = 0;                                   /* send pre-encoded requests on the socket pool, bypassing netsnmp */
+int builtinDecoder = 0;                                 /* decode the responses of the raw transport without netsnmp */
+const char *hostList = NULL;                            /* file of hosts to be polled instead of the database query */
+const char *metricsPrefix = NULL;                       /* the metrics are exported to <prefix>.prom and <prefix>.json */
+metrics_t totalMetrics;                                 /* counters of all cycles */
+long cycles = 0;                                        /* completed cycles */
+int batchSize = BATCH_SIZE;                             /* packets per sendmmsg / recvmmsg call of the raw transport */
+FILE *results = NULL;                                   /* binary result file, instead of a text file per host */
+pthread_mutex_t resultLock = PTHREAD_MUTEX_INITIALIZER;
+resultIndex_t *resultIndex = NULL;
+resultBuffer_t resultCacheUpdates = { 0 };              /* cache updates of the hosts in the result file, committed once it is complete */
+size_t resultCount = 0;
+size_t resultSize = 0;
+writer_t writer = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+writer_t sink = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+resolver_t resolver = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+stubHost_t *stubHosts = NULL;                           /* sorted by name, replaces DNS if given */
+size_t stubCount = 0;
+PGconn *copyConn = NULL;                                /* second connection, on which the results are copied */
+const char *copyTable = NULL;                           /* table the results are copied into */
+char *copyTarget = NULL;                                /* copyTable as quoted identifier */
+uint64_t copyFailedHosts = 0;                           /* hosts of the cycle, whose results the COPY sink dropped */
+int recordResults = 0;                                  /* collect typed records instead of text, for -o and -c */
+int directIo = 0;                                       /* write the output files with O_DIRECT */
+int syncOutput = 0;                                     /* fdatasync each output file */
+const char *cachePath = NULL;                           /* change cache, only changed values are output if set */
+cacheHeader_t *cache = NULL;                            /* the mapped change cache */
+int snapshotCycles = SNAPSHOT_CYCLES;                   /* cycles between the full outputs of the change cache */
+int deltaCycle = 0;                                     /* the current cycle only outputs the changed values */
+const char *summaryPath = NULL;                         /* plant summary per channel frequency, written after each cycle */
+const char *servicePath = NULL;                         /* Unix socket of the query service, not started if NULL */
+queryService_t service = { .listenFd = -1 };
+int queriedHosts = 0;                                   /* hosts of the query service being polled, the bulk poll pauses meanwhile */
+int shardCount = 0;                                     /* the modems are partitioned by modem.id modulo shardCount, 0 polls all */
+int shardIndex = -1;                                    /* the only shard polled, -1 if the shards are leased */
+char nodeName[HOST_NAME_MAX + 1];                       /* owner of the leased shards */
+long *shardCompletion = NULL;                           /* per shard: microseconds into the last cycle, its last host finished, -1 if not polled */
+int threadCount = 1;                                    /* number of workers */
+int window = 0;                                         /* maximum of outstanding requests, 0 is unlimited */
+int groupLimit = 0;                                     /* maximum of outstanding requests per group, 0 is unlimited */
+double rate = 0;                                        /* requests per second, 0 is unlimited */
+long responseBudget = RESPONSE_BUDGET;                  /* response size in bytes, the repetitions are limited to */
+const char *stateFile = NULL;                           /* file the host states are persisted to */
+const char *resultPath = NULL;                          /* binary result file, rewritten by each cycle */
+int interval = 0;                                       /* seconds between the starts of the polling cycles, 0 polls once */
+long spread = 0;                                        /* microseconds the starts of the hosts are spread over, 0 starts all at once */
+struct timeval cycleStart;                              /* start of the current polling cycle */
+stateTable_t states = { NULL, 0, 0 };
+pthread_mutex_t sessionLock = PTHREAD_MUTEX_INITIALIZER;
+const char *securityName = NULL;                        /* SNMPv3 user of all hosts, SNMPv2c if not set */
+const char *authPassphrase = NULL;
+const char *privPassphrase = NULL;                      /* authNoPriv if not set */
+usmCredential_t *credentials = NULL;                    /* credential sets, whose master keys are derived */
+userTable_t localizedUsers = { NULL, 0, 0 };            /* the users known to the USM, guarded by usmLock */
+int usmShared = 0;                                      /* the USM users and engine times are used by several workers */
+pthread_mutex_t usmLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;  /* the USM of netsnmp is not thread safe, callbacks send again */
+
+int asyncResponse(int operation, struct snmp_session *sp, int reqid, struct snmp_pdu *responseData, void *magic);
+int discoveryResponse(int operation, struct snmp_session *sp, int reqid, struct snmp_pdu *responseData, void *magic);
 
 /********************************* FUNCTIONS *********************************/
 /*
  * Identify the current segment (passed by reference) using the request id and
  * return the last oid of this segment
  *
+ * profile_t *profile - profile of the host
  * long reqid - the request id found in the modem response
  * long *requestIds - pointer to the array of request ids send to the modem
  * pass_t segment - segment to be identified
  *
  * returns oid_s *
  */
-struct oid_s *getSegmentLastOid(long reqid, long *requestIds, pass_t *segment)
+struct oid_s *getSegmentLastOid(profile_t *profile, long reqid, long *requestIds, pass_t *segment)
 {
     int last = -1;
 
     for ((*segment) = NON_REP; (*segment) < FINISH; (*segment)++) {
-        last += itemCount[*segment];
+        last += profile->itemCount[*segment];
 
         if (reqid == requestIds[*segment]) {
-            return &oids[last];
+            return &profile->oids[last];
         }
     }
 
@@ -156,399 +725,6635 @@ struct oid_s *getSegmentLastOid(long reqid, long *requestIds, pass_t *segment)
 
 /*****************************************************************************/
 /*
- * Due to the list character of netsnmp_variable_list it is not possible to
- * access the last element directly. This loops through all variables and
- * returns the pointer to the last element
+ * Return the first oid of a segment
+ *
+ * profile_t *profile - the profile
+ * pass_t segment - the segment
+ *
+ * returns oid_s *
+ */
+struct oid_s *getSegmentFirstOid(profile_t *profile, pass_t segment)
+{
+    int i, first = 0;
+
+    for (i = NON_REP; i < segment; i++) {
+        first += profile->itemCount[i];
+    }
+
+    return &profile->oids[first];
+}
+
+/*****************************************************************************/
+/*
+ * Allocate zeroed memory from the arena. It is never moved and only freed
+ * with the whole arena. Not thread safe.
  *
- * netsnmp_variable_list varlist
+ * arena_t *arena - the arena
+ * size_t size - number of bytes
  *
- * returns netsnmp_variable_list *
+ * returns void *
  */
-netsnmp_variable_list *getLastVarBinding(netsnmp_variable_list *varlist)
+void *arenaAlloc(arena_t *arena, size_t size)
 {
-    while (varlist) {
-        if (! varlist->next_variable) {
-            return varlist;
+    arenaChunk_t *chunk = arena->head;
+    void *memory;
+
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+    if (! chunk || chunk->used + size > chunk->size) {
+        if (! (chunk = calloc(1, sizeof(arenaChunk_t) + (size > ARENA_CHUNK ? size : ARENA_CHUNK)))) {
+            perror("calloc");
+            exit(1);
         }
-        varlist = varlist->next_variable;
+        chunk->size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk->next = arena->head;
+        arena->head = chunk;
     }
 
-    return NULL;
+    memory = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+
+    return memory;
 }
 
 /*****************************************************************************/
 /*
- * Only called if a table is not fully retrieved. To get the rest of the SNMP
- * Table a new BULK Request is generated with the last number of the last OID.
- * This works only, because the interfaces (segments) have the same indices.
+ * Copy a string into the arena
  *
- * hostContext_t *hostContext - pointer to the current hostcontext structure
- * netsnmp_variable_list *varlist - pointer to last oid of previous answer
- * struct oid_s *oid - pointer to first oid to send for the new request
+ * arena_t *arena - the arena
+ * const char *string - the string
  *
- * returns int
+ * returns char *
  */
-int sendNextBulkRequest(hostContext_t *hostContext, netsnmp_variable_list *varlist, struct oid_s *oid, int prefix)
+char *arenaStrdup(arena_t *arena, const char *string)
 {
-    int i;
-    size_t len;
-    struct snmp_pdu *request;
-    pass_t segment = oid->segment;
+    size_t len = strlen(string) + 1;
 
-    request = snmp_pdu_create(SNMP_MSG_GETBULK);
-    request->non_repeaters = 0;
-    request->max_repetitions = repetitions[segment];
+    return memcpy(arenaAlloc(arena, len), string, len);
+}
 
-    while (oid->segment == segment) {
-        len = oid->OidLen;
-        for (i = prefix; i < varlist->name_length; i++) {
-            oid->Oid[len++] = varlist->name[i];
-        }
-        snmp_add_null_var(request, oid->Oid, len);
+/*****************************************************************************/
+/*
+ * Free all memory of the arena
+ *
+ * arena_t *arena - the arena
+ *
+ * returns void
+ */
+void arenaFree(arena_t *arena)
+{
+    arenaChunk_t *chunk;
 
-        oid++;
+    while ((chunk = arena->head)) {
+        arena->head = chunk->next;
+        free(chunk);
     }
+}
 
-    if (snmp_send(hostContext->session, request)) {
-        hostContext->requestIds[segment] = request->reqid;
-        return 1;
-    } else {
-        snmp_perror("snmp_send");
-        snmp_free_pdu(request);
+/*****************************************************************************/
+/*
+ * Hash of a host name (FNV-1a)
+ *
+ * const char *name - name of the host
+ *
+ * returns size_t
+ */
+size_t hashName(const char *name)
+{
+    size_t hash = 2166136261u;
+
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
     }
 
-    return 0;
+    return hash;
 }
 
 /*****************************************************************************/
 /*
- * Called once a segment of a host is complete. Sets the host request element
- * of the current segment to zero, denoting that the segment is finished.
- * Finally checks if all segments of the current host are finished. If so,
- * decrement the activeHosts, denoting that all requests of the host are
- * complete.
+ * Slot of the state of a host in the table, the empty slot it would be
+ * inserted into, if it does not exist
  *
- * long reqid - the request id found in the modem response
- * long *requestIds - pointer to the array of request ids send to the modem
- * pass_t segment - completed segment
+ * const char *key - name of the host, truncated to the size of the state
  *
- * returns int
+ * returns hostState_t **
  */
-void updateActiveHosts(long reqid, long *requestIds, pass_t segment)
+hostState_t **findState(const char *key)
 {
-    static const long zero[FINISH] = { 0 };
-    requestIds[segment] = 0;
+    size_t i = hashName(key) & (states.size - 1);
 
-    if (! memcmp(zero, requestIds, sizeof(zero))) {
-        activeHosts--;
+    while (states.entries[i] && strcmp(states.entries[i]->name, key)) {
+        i = (i + 1) & (states.size - 1);
     }
+
+    return &states.entries[i];
 }
 
 /*****************************************************************************/
 /*
- * Connect to the nmsprime SQL database
+ * Make room for the given number of additional host states, so that the
+ * table is at most half full afterwards
  *
- * const char *hostname - SQL hostname
- * const char *username - database username
- * const char *password - database password
- * const char *database - SQL database
+ * size_t count - number of states to be inserted
  *
- * returns PGconn*
+ * returns void
  */
-PGconn* connectToSql(const char *hostname, const char *username, const char *password, const char *database)
+void reserveStates(size_t count)
 {
-    const char *keywords[] = {
-        "host",
-        "dbname",
-        "user",
-        "password",
-        NULL
-    };
-    const char *values[] = {
-        hostname ? hostname : "localhost",
-        database ? database : "nmsprime",
-        username ? username : "nmsprime",
-        password ? password : "nmsprime",
-        NULL
-    };
+    size_t i;
+    hostState_t **entries = states.entries;
+    size_t size = states.size;
 
-    PGconn* conn = PQconnectdbParams(keywords, values, 0);
-    if (PQstatus(conn) == CONNECTION_BAD) {
-        fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(conn));
-        PQfinish(conn);
-        exit(1);
+    if (states.size && 2 * (states.count + count) <= states.size) {
+        return;
     }
 
-    return conn;
+    for (states.size = 1024; states.size < 2 * (states.count + count); states.size *= 2);
+    states.entries = calloc(states.size, sizeof(hostState_t *));
+
+    for (i = 0; i < size; i++) {
+        if (entries[i]) {
+            *findState(entries[i]->name) = entries[i];
+        }
+    }
+    free(entries);
 }
 
 /*****************************************************************************/
 /*
- * Print the response into a File inside the current working directory.
+ * Find the state of a host, insert a new one if it does not exist yet. The
+ * states themselves are never moved, so that the hosts can keep a pointer to
+ * it while further hosts are inserted. Only called by the main thread.
  *
- * int status - state of the Response
- * hostContext_t *hostContext - pointer to the current hostcontext structure
- * struct snmp_pdu *responseData
+ * const char *name - name of the host
  *
- * returns int
+ * returns hostState_t *
  */
-int processResult(int status, hostContext_t *hostContext, struct snmp_pdu *responseData)
+hostState_t *getState(const char *name)
 {
-    struct variable_list *currentVariable;
-    int ix;
-
-    switch (status) {
-    case STAT_SUCCESS:
-        currentVariable = responseData->variables;
-        if (responseData->errstat == SNMP_ERR_NOERROR) {
-            while (currentVariable) {
-                fprint_variable(hostContext->outputFile, currentVariable->name, currentVariable->name_length, currentVariable);
-                currentVariable = currentVariable->next_variable;
-            }
-        } else {
-            for (ix = 1; currentVariable && ix != responseData->errindex;
-                 currentVariable = currentVariable->next_variable, ix++);
+    char key[sizeof(((hostState_t *)0)->name)];
+    hostState_t **entry;
 
-            fprintf(hostContext->outputFile, "ERROR: %s: ", hostContext->session->peername);
-            if (currentVariable) {
-                fprint_objid(hostContext->outputFile, currentVariable->name, currentVariable->name_length);
-            }
-            fprintf(hostContext->outputFile, ": %s\n", snmp_errstring(responseData->errstat));
+    snprintf(key, sizeof(key), "%s", name);
+    reserveStates(1);
 
-        }
-        return 1;
-    case STAT_TIMEOUT:
-        fprintf(stdout, "%s: Timeout\n", hostContext->session->peername);
-        return 0;
-    case STAT_ERROR:
-        snmp_perror(hostContext->session->peername);
-        return 0;
+    if (! *(entry = findState(key))) {
+        *entry = arenaAlloc(&states.arena, sizeof(hostState_t));
+        strcpy((*entry)->name, key);
+        states.count++;
     }
 
-    return 0;
+    return *entry;
 }
 
 /*****************************************************************************/
 /*
- * This function sets the prerequisorities for the polling algorithm.
- * It does several things:
- * - Initializes the NET-SNMP library
- * - Set (increase) the limit for opened files (rlimit)
- * - Sets Configuration for NET-SNMP
- * - Decodes OIDs and fills OID structure
- * - Counts the number of OIDs for each segment
+ * Load the persisted host states. A missing file or a file of a different
+ * format (version or record size) is ignored, the states are learned again.
+ *
+ * const char *path - state file
  *
  * returns void
  */
-void initialize()
+void loadStates(const char *path)
 {
-    struct oid_s *currentOid = oids;
-    struct rlimit lim = { 1024 * 1024, 1024 * 1024 };
-    activeHosts = 0;
+    uint32_t header[4];
+    hostState_t state;
+    FILE *file = fopen(path, "r");
 
-    if (setrlimit(RLIMIT_NOFILE, &lim)) {
-        perror("\nsetrlimit");
-        fprintf(stderr, "You need to have superuser privileges to set a new file limit!\n");
-        fprintf(stderr, "This program will most likely fail with more than 1000 Hosts!\n");
-        fprintf(stderr, "Continuing anyway...\n\n");
+    if (! file) {
+        return;
     }
 
-    /* initialize library */
-    init_snmp("asynchapp");
-    netsnmp_ds_set_int(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_OID_OUTPUT_FORMAT, NETSNMP_OID_OUTPUT_NUMERIC);
-    netsnmp_ds_set_boolean(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_QUICK_PRINT, 1);
-    netsnmp_ds_set_boolean(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_NUMERIC_TIMETICKS, 1);
-    netsnmp_ds_set_int(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_HEX_OUTPUT_LENGTH, 0);
-
-    /* parse the oids */
-    while (currentOid->segment < FINISH) {
-        currentOid->OidLen = MAX_OID_LEN;
-        if (! read_objid(currentOid->Name, currentOid->Oid, &currentOid->OidLen)) {
-            snmp_perror("read_objid");
-            printf("Could not Parse OID: %s\n", currentOid->Name);
-            exit(1);
-        }
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != STATE_MAGIC || header[1] != STATE_VERSION ||
+        header[2] != sizeof(hostState_t)) {
+        fprintf(stderr, "Ignoring state file %s of a different format\n", path);
+        fclose(file);
+        return;
+    }
 
-        itemCount[currentOid->segment]++;
-        currentOid++;
+    reserveStates(header[3]);
+    while (fread(&state, sizeof(state), 1, file) == 1) {
+        state.name[sizeof(state.name) - 1] = '\0';
+        state.codewords = NULL;
+        state.codewordCount = 0;
+        state.uptime = 0;
+        *getState(state.name) = state;
     }
+
+    fclose(file);
 }
 
 /*****************************************************************************/
 /*
- * Function that gets called asynchronously each time a new SNMP packet
- * arrives. It checks whether the full table was retrieved and emits a new
- * SNMP request of the next batch of the current segment.
+ * Persist the host states. The file is written to a temporary file first and
+ * renamed afterwards, so that it is never left half written.
  *
- * int operation - state of the received mesasa
- * struct snmp_session *sp - not used as we get session from context data
- * int reqid - request id
- * struct snmp_pdu *responseData - response packet with data from modem
- * void *magic - magic pointer for context data
+ * const char *path - state file
  *
- * returns int
+ * returns void
  */
-int asyncResponse(int operation, struct snmp_session *sp, int reqid, struct snmp_pdu *responseData, void *magic)
+void saveStates(const char *path)
 {
-    int prefix;
-    pass_t segment;
-    struct oid_s *oid;
-    netsnmp_variable_list *varlist;
-    hostContext_t *hostContext = (hostContext_t *)magic;
+    size_t i;
+    char tmp[PATH_MAX];
+    uint32_t header[4] = { STATE_MAGIC, STATE_VERSION, sizeof(hostState_t), states.count };
+    FILE *file;
 
-    if (operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
-        processResult(STAT_TIMEOUT, hostContext, responseData);
-        activeHosts--;
-        return 1;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (! (file = fopen(tmp, "w"))) {
+        perror(tmp);
+        return;
     }
-    if (! processResult(STAT_SUCCESS, hostContext, responseData)) {
-        activeHosts--;
-        return 1;
+
+    fwrite(header, sizeof(header), 1, file);
+    for (i = 0; i < states.size; i++) {
+        if (states.entries[i]) {
+            fwrite(states.entries[i], sizeof(hostState_t), 1, file);
+        }
     }
 
-    oid = getSegmentLastOid(reqid, hostContext->requestIds, &segment);
-    if (segment == NON_REP) {
-        updateActiveHosts(reqid, hostContext->requestIds, segment);
-        return 1;
+    if (fclose(file) || rename(tmp, path)) {
+        perror(path);
     }
+}
 
-    varlist = getLastVarBinding(responseData->variables);
-    prefix = netsnmp_oid_find_prefix(varlist->name, varlist->name_length, oid->Oid, oid->OidLen);
+/*****************************************************************************/
+/*
+ * Continue a 64 bit FNV-1a hash with the given bytes
+ *
+ * uint64_t hash - hash so far, FNV_OFFSET to start a new one
+ * const void *data - the bytes
+ * size_t len - number of bytes
+ *
+ * returns uint64_t
+ */
+uint64_t hashBytes(uint64_t hash, const void *data, size_t len)
+{
+    const u_char *byte = data;
 
-    if (! memcmp(oid->Oid, varlist->name, oid->OidLen * sizeof(oid))) {
-        oid -= itemCount[segment] - 1;
-        sendNextBulkRequest(hostContext, varlist, oid, prefix);
-    } else {
-        updateActiveHosts(reqid, hostContext->requestIds, segment);
+    while (len--) {
+        hash = (hash ^ *byte++) * FNV_PRIME;
     }
 
-    return 1;
+    return hash;
 }
 
 /*****************************************************************************/
 /*
- * Initiates the asynchronous SNMP transfer, starting with the non-repeaters.
- * The asyncResponse function gets called each time a packet is received.
- * while loop handles async behavior.
+ * Length of the change cache file with the given number of entries
  *
- * PGconn *conn - SQL connection
- * char *query - SQL query
+ * uint64_t size - number of entries
+ *
+ * returns size_t
+ */
+size_t cacheLength(uint64_t size)
+{
+    return sizeof(cacheHeader_t) + size * sizeof(cacheEntry_t);
+}
+
+/*****************************************************************************/
+/*
+ * Map the change cache file into memory, the file is created with
+ * CACHE_SIZE entries if it is missing or of a different format. The kernel
+ * writes the modified pages back, so the cache survives a restart.
+ *
+ * const char *path - change cache file
  *
  * returns void
  */
-void asynchronous(PGconn *conn, char *query)
+void openCache(const char *path)
 {
-    int i, j, hostCount;
-    hostContext_t *hostContext;
+    cacheHeader_t header;
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
 
-    struct snmp_pdu *request[FINISH];
-    struct oid_s *currentOid = oids;
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(path);
+        exit(1);
+    }
 
-    for (i = NON_REP; i < FINISH; i++) {
-        if (! itemCount[i]) {
-            request[i] = 0;
-            continue;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CACHE_MAGIC || header.entrySize != sizeof(cacheEntry_t) ||
+        ! header.size || (header.size & (header.size - 1)) || (size_t)st.st_size != cacheLength(header.size)) {
+        if (st.st_size) {
+            fprintf(stderr, "Ignoring change cache %s of a different format\n", path);
         }
 
-        if (i == NON_REP) {
-            request[i] = snmp_pdu_create(SNMP_MSG_GETNEXT);
-        } else {
-            request[i] = snmp_pdu_create(SNMP_MSG_GETBULK);
-            request[i]->non_repeaters = 0;
-            request[i]->max_repetitions = repetitions[i];
+        memset(&header, 0, sizeof(header));
+        header.magic = CACHE_MAGIC;
+        header.entrySize = sizeof(cacheEntry_t);
+        header.size = CACHE_SIZE;
+        if (ftruncate(fd, 0) || ftruncate(fd, cacheLength(header.size)) || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            perror(path);
+            exit(1);
         }
     }
 
-    while (currentOid->segment != FINISH) {
-        snmp_add_null_var(request[currentOid->segment], currentOid->Oid, currentOid->OidLen);
-        currentOid++;
-    }
-
-    /* startup all hosts */
-    PGresult *result = PQexec(conn, query);
-    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "No data retrieved\n");
-        PQclear(result);
+    if ((cache = mmap(NULL, cacheLength(header.size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
         exit(1);
     }
+    close(fd);
+}
 
-    hostCount = PQntuples(result);
-    hostContext_t allHosts[hostCount]; // one hostContext structure per Host in DB
-
-    for (i = 0; i < hostCount; i++) {
-        struct snmp_session session;
-        struct snmp_pdu *newRequest;
-        hostContext = &allHosts[i];
-
-        snmp_sess_init(&session);
+/*****************************************************************************/
+/*
+ * Double the size of the change cache, called between the cycles once it is
+ * half full. The entries are rehashed into a new file, which replaces the
+ * old one.
+ *
+ * const char *path - change cache file
+ *
+ * returns void
+ */
+void growCache(const char *path)
+{
+    char tmp[PATH_MAX];
+    uint64_t i, j, size = cache->size * 2;
+    cacheHeader_t *grown;
+    cacheEntry_t *from = (cacheEntry_t *)(cache + 1), *to;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, cacheLength(size))) {
+        perror(tmp);
+        return;
+    }
+    grown = mmap(NULL, cacheLength(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (grown == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+
+    *grown = *cache;
+    grown->size = size;
+    to = (cacheEntry_t *)(grown + 1);
+    for (i = 0; i < cache->size; i++) {
+        if (from[i].key) {
+            for (j = from[i].key & (size - 1); to[j].key; j = (j + 1) & (size - 1));
+            to[j] = from[i];
+        }
+    }
+
+    if (rename(tmp, path)) {
+        perror(path);
+        munmap(grown, cacheLength(size));
+        return;
+    }
+    munmap(cache, cacheLength(cache->size));
+    cache = grown;
+}
+
+/*****************************************************************************/
+/*
+ * Make room for the given number of additional bytes in a buffer
+ *
+ * resultBuffer_t *buffer - the buffer
+ * size_t len - number of bytes to be appended
+ *
+ * returns void
+ */
+void growBuffer(resultBuffer_t *buffer, size_t len)
+{
+    if (buffer->len + len <= buffer->size) {
+        return;
+    }
+
+    buffer->size = buffer->len + len > 2 * buffer->size ? buffer->len + len : 2 * buffer->size;
+    if (! (buffer->data = realloc(buffer->data, buffer->size))) {
+        fprintf(stderr, "Could not allocate output buffer\n");
+        exit(1);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Compare a varbind with its value of the last cycle in the change cache. The
+ * new value is only kept with the output of the host and committed, once the
+ * output is written - a lost output is sent again in full. Only hashes of the
+ * host, the oid and the value are kept, so an entry takes 16 bytes. Counters
+ * change with every poll, they are neither cached nor suppressed. The workers
+ * share the cache: an unused entry is claimed atomically, the value of an
+ * entry is only written for the host it belongs to. A full cache reports all
+ * new varbinds as changed, until it grows after the cycle.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * netsnmp_variable_list *var - the varbind
+ *
+ * returns int - whether the varbind is output
+ */
+int valueChanged(hostContext_t *hostContext, netsnmp_variable_list *var)
+{
+    uint64_t key, value, found, mask = cache->size - 1;
+    cacheEntry_t *entries = (cacheEntry_t *)(cache + 1), *entry;
+    cacheUpdate_t update;
+
+    if (var->type == ASN_COUNTER || var->type == ASN_COUNTER64 || var->type == ASN_TIMETICKS) {
+        return 1;
+    }
+
+    key = hashBytes(hostContext->cacheSeed, var->name, var->name_length * sizeof(oid));
+    key += ! key;
+    value = hashBytes(hashBytes(FNV_OFFSET, &var->type, sizeof(var->type)), var->val.string, var->val_len);
+
+    for (entry = &entries[key & mask]; ; entry = &entries[(entry - entries + 1) & mask]) {
+        found = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+        if (! found && __atomic_load_n(&cache->count, __ATOMIC_RELAXED) < cache->size / 4 * 3 &&
+            __atomic_compare_exchange_n(&entry->key, &found, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&cache->count, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (! found) {
+            return 1;
+        }
+        if (found == key) {
+            if (__atomic_load_n(&entry->value, __ATOMIC_RELAXED) == value) {
+                return ! deltaCycle;
+            }
+            break;
+        }
+    }
+
+    update.entry = entry;
+    update.value = value;
+    growBuffer(&hostContext->cacheUpdates, sizeof(update));
+    memcpy(hostContext->cacheUpdates.data + hostContext->cacheUpdates.len, &update, sizeof(update));
+    hostContext->cacheUpdates.len += sizeof(update);
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Commit the values of the change cache kept with an output, which was
+ * written, and free them. Called before the cache grows.
+ *
+ * resultBuffer_t *updates - cacheUpdate_t of the output
+ *
+ * returns void
+ */
+void commitCache(resultBuffer_t *updates)
+{
+    size_t offset;
+    cacheUpdate_t *update;
+
+    for (offset = 0; offset < updates->len; offset += sizeof(cacheUpdate_t)) {
+        update = (cacheUpdate_t *)(updates->data + offset);
+        __atomic_store_n(&update->entry->value, update->value, __ATOMIC_RELAXED);
+    }
+
+    free(updates->data);
+    memset(updates, 0, sizeof(resultBuffer_t));
+}
+
+/*****************************************************************************/
+/*
+ * Microseconds passed since the given time
+ *
+ * struct timeval *since - the time
+ *
+ * returns long
+ */
+long usSince(struct timeval *since)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return (now.tv_sec - since->tv_sec) * 1000000L + now.tv_usec - since->tv_usec;
+}
+
+/*****************************************************************************/
+/*
+ * Bucket of a value in a histogram: the values below 8 have a bucket each,
+ * above that each power of two is split into 8 buckets, so that the relative
+ * error is at most 12.5% (like HDR histograms with a single significant
+ * digit)
+ *
+ * uint64_t value - the value
+ *
+ * returns int
+ */
+int histogramBucket(uint64_t value)
+{
+    int shift;
+
+    if (value < 8) {
+        return value;
+    }
+
+    shift = 63 - __builtin_clzll(value) - 3;
+    if (shift >= HISTOGRAM_BUCKETS / 8 - 1) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    return 8 * (shift + 1) + (value >> shift) - 8;
+}
+
+/*****************************************************************************/
+/*
+ * Lower bound of the values of a histogram bucket
+ *
+ * int bucket - the bucket
+ *
+ * returns uint64_t
+ */
+uint64_t histogramLower(int bucket)
+{
+    if (bucket < 8) {
+        return bucket;
+    }
+
+    return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+/*****************************************************************************/
+/*
+ * Add a value to a histogram
+ *
+ * histogram_t *histogram - the histogram
+ * uint64_t value - the value, e.g. a latency in microseconds
+ *
+ * returns void
+ */
+void recordValue(histogram_t *histogram, uint64_t value)
+{
+    histogram->buckets[histogramBucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Approximate quantile of a histogram: the middle of the bucket it falls into
+ *
+ * histogram_t *histogram - the histogram
+ * double quantile - between 0 and 1
+ *
+ * returns uint64_t
+ */
+uint64_t histogramQuantile(histogram_t *histogram, double quantile)
+{
+    int i;
+    uint64_t seen = 0, rank = quantile * histogram->count;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if ((seen += histogram->buckets[i]) > rank) {
+            break;
+        }
+    }
+    if (i >= HISTOGRAM_BUCKETS - 1) {
+        return histogram->max;
+    }
+
+    return (histogramLower(i) + histogramLower(i + 1)) / 2;
+}
+
+/*****************************************************************************/
+/*
+ * Add the counters and histograms of a worker or a cycle to a sum
+ *
+ * metrics_t *sum - the sum
+ * metrics_t *add - the counters to be added
+ *
+ * returns void
+ */
+void addMetrics(metrics_t *sum, metrics_t *add)
+{
+    size_t i;
+    int j;
+    uint64_t *to = (uint64_t *)sum, *from = (uint64_t *)add;
+
+    /* all counters are uint64_t in front of the histograms */
+    for (i = 0; i < offsetof(metrics_t, rtt) / sizeof(uint64_t); i++) {
+        to[i] += from[i];
+    }
+
+    for (i = 0; i < FINISH; i++) {
+        for (j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            sum->rtt[i].buckets[j] += add->rtt[i].buckets[j];
+        }
+        sum->rtt[i].count += add->rtt[i].count;
+        sum->rtt[i].sum += add->rtt[i].sum;
+        if (add->rtt[i].max > sum->rtt[i].max) {
+            sum->rtt[i].max = add->rtt[i].max;
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * The max-repetitions used for a segment of the host: the learned value or
+ * the default of the segment
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - the segment
+ *
+ * returns long
+ */
+long getRepetitions(hostContext_t *hostContext, pass_t segment)
+{
+    if (hostContext->state && hostContext->state->repetitions[segment]) {
+        return hostContext->state->repetitions[segment];
+    }
+
+    return repetitions[segment];
+}
+
+/*****************************************************************************/
+/*
+ * Retransmission timeout of the next request to the host, derived from its
+ * round trip time estimation like TCP does (RFC 6298). Hosts without estimation
+ * use the fixed TIMEOUT, hosts which did not respond last time are probed with
+ * a short timeout, so that they fail fast.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns long - timeout in microseconds
+ */
+long getTimeout(hostContext_t *hostContext)
+{
+    long timeout = TIMEOUT * 1000000L;
+    hostState_t *state = hostContext->state;
+
+    if (state && state->srtt) {
+        timeout = state->srtt + (4 * state->rttvar > MIN_TIMEOUT ? 4 * state->rttvar : MIN_TIMEOUT);
+        timeout = timeout < TIMEOUT * 1000000L ? timeout : TIMEOUT * 1000000L;
+    }
+
+    if (state && state->dead && ! hostContext->responded && timeout > PROBE_TIMEOUT) {
+        timeout = PROBE_TIMEOUT;
+    }
+
+    return timeout;
+}
+
+/*****************************************************************************/
+/*
+ * Update the round trip time estimation of the host with the response of a
+ * segment. As retransmissions use the same request id, a response can only be
+ * attributed to the first transmission, if it arrived before the timeout
+ * (Karn's algorithm) - later responses are not sampled.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment of the response
+ *
+ * returns void
+ */
+void sampleRtt(hostContext_t *hostContext, pass_t segment)
+{
+    long rtt;
+    struct timeval now, delta;
+    hostState_t *state = hostContext->state;
+
+    hostContext->responded = 1;
+    if (! state || segment >= FINISH) {
+        return;
+    }
+    state->dead = 0;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &hostContext->sent[segment], &delta);
+    if ((rtt = delta.tv_sec * 1000000L + delta.tv_usec) >= hostContext->timeouts[segment]) {
+        return;
+    }
+    recordValue(&hostContext->worker->metrics.rtt[segment], rtt > 0 ? rtt : 0);
+
+    if (! state->srtt) {
+        state->srtt = rtt > 0 ? rtt : 1;
+        state->rttvar = rtt / 2;
+    } else {
+        state->rttvar = (3 * state->rttvar + labs(state->srtt - rtt)) / 4;
+        state->srtt = (7 * state->srtt + rtt) / 8;
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Return the column cursors of a segment of the host. The cursors of all
+ * segments are allocated with the first table request and released as soon as
+ * the host is finished, so only the hosts in flight hold them.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment of the columns
+ *
+ * returns columnCursor_t *
+ */
+columnCursor_t *getColumns(hostContext_t *hostContext, pass_t segment)
+{
+    profile_t *profile = hostContext->profile;
+
+    if (! hostContext->columns && ! (hostContext->columns = calloc(profile->oidCount, sizeof(columnCursor_t)))) {
+        fprintf(stderr, "Could not allocate column cursors\n");
+        exit(1);
+    }
+
+    return &hostContext->columns[getSegmentFirstOid(profile, segment) - profile->oids];
+}
+
+/*****************************************************************************/
+/*
+ * Learn the max-repetitions of a segment once all of its columns are
+ * complete: the number of rows plus one, so that the end of the table is
+ * detected within the same round trip. The value is limited by the response
+ * size budget, using an estimation of the encoded size of a row, and by the
+ * max-repetitions the host could still answer after a tooBig response.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - the completed segment
+ *
+ * returns void
+ */
+void learnRepetitions(hostContext_t *hostContext, pass_t segment)
+{
+    int i;
+    long rowSize = 0, rows = 0, max;
+    struct oid_s *oid = getSegmentFirstOid(hostContext->profile, segment);
+    columnCursor_t *column;
+
+    if (! hostContext->state || segment == NON_REP) {
+        return;
+    }
+    column = getColumns(hostContext, segment);
+
+    /* oid, value and the headers of each varbind, most sub-identifiers fit into one byte */
+    for (i = 0; i < hostContext->profile->itemCount[segment]; i++) {
+        /* the rows of a truncated table would shrink the value for the next polls */
+        if (! column[i].done) {
+            return;
+        }
+        rowSize += oid[i].OidLen + MAX_SUFFIX_LEN + 16;
+        if (column[i].rows > rows) {
+            rows = column[i].rows;
+        }
+    }
+
+    max = responseBudget / rowSize > 1 ? responseBudget / rowSize : 1;
+    if (hostContext->state->repetitionLimit[segment] && hostContext->state->repetitionLimit[segment] < max) {
+        max = hostContext->state->repetitionLimit[segment];
+    }
+    hostContext->state->repetitions[segment] = rows + 1 < max ? rows + 1 : max;
+}
+
+/*****************************************************************************/
+/*
+ * The agent could not fit the response into a message: halve the
+ * max-repetitions of the segment for the host. The halved value stays the
+ * upper bound of the learned max-repetitions.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - the segment
+ *
+ * returns int - 0 if the repetitions can not be decreased any further
+ */
+int decreaseRepetitions(hostContext_t *hostContext, pass_t segment)
+{
+    long current = segment < FINISH ? getRepetitions(hostContext, segment) : 0;
+
+    if (! hostContext->state || segment == NON_REP || segment >= FINISH || current <= 1) {
+        return 0;
+    }
+
+    hostContext->state->repetitions[segment] = hostContext->state->repetitionLimit[segment] = current / 2;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Swap two timers of the heap and update their positions
+ *
+ * timerHeap_t *heap - the timer heap
+ * int a, int b - positions of the timers to swap
+ *
+ * returns void
+ */
+void timerSwap(timerHeap_t *heap, int a, int b)
+{
+    pollTimer_t *tmp = heap->timers[a];
+
+    heap->timers[a] = heap->timers[b];
+    heap->timers[b] = tmp;
+    heap->timers[a]->index = a;
+    heap->timers[b]->index = b;
+}
+
+/*****************************************************************************/
+/*
+ * Restore the heap property after the expiry of the timer at the given
+ * position changed, by moving it up or down the heap.
+ *
+ * timerHeap_t *heap - the timer heap
+ * int i - position of the changed timer
+ *
+ * returns void
+ */
+void timerSift(timerHeap_t *heap, int i)
+{
+    int child;
+
+    while (i > 0 && timercmp(&heap->timers[i]->expires, &heap->timers[(i - 1) / 2]->expires, <)) {
+        timerSwap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    while ((child = 2 * i + 1) < heap->count) {
+        if (child + 1 < heap->count && timercmp(&heap->timers[child + 1]->expires, &heap->timers[child]->expires, <)) {
+            child++;
+        }
+        if (! timercmp(&heap->timers[child]->expires, &heap->timers[i]->expires, <)) {
+            break;
+        }
+        timerSwap(heap, i, child);
+        i = child;
+    }
+}
+
+/*****************************************************************************/
+/*
+ * (Re-)schedule a timer to expire at the given time
+ *
+ * timerHeap_t *heap - the timer heap
+ * pollTimer_t *timer - the timer to schedule
+ * struct timeval *expires - absolute expiry time
+ *
+ * returns void
+ */
+void timerSchedule(timerHeap_t *heap, pollTimer_t *timer, struct timeval *expires)
+{
+    timer->expires = *expires;
+
+    if (timer->index < 0) {
+        if (heap->count == heap->size) {
+            heap->size = heap->size ? 2 * heap->size : 1024;
+            heap->timers = realloc(heap->timers, heap->size * sizeof(pollTimer_t *));
+        }
+        timer->index = heap->count++;
+        heap->timers[timer->index] = timer;
+    }
+
+    timerSift(heap, timer->index);
+}
+
+/*****************************************************************************/
+/*
+ * Remove a timer from the heap, if it is scheduled
+ *
+ * timerHeap_t *heap - the timer heap
+ * pollTimer_t *timer - the timer to cancel
+ *
+ * returns void
+ */
+void timerCancel(timerHeap_t *heap, pollTimer_t *timer)
+{
+    int i = timer->index;
+
+    if (i < 0) {
+        return;
+    }
+
+    timerSwap(heap, i, --heap->count);
+    timer->index = -1;
+
+    if (i < heap->count) {
+        timerSift(heap, i);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Calls the expire function of all timers, which expired until now
+ *
+ * timerHeap_t *heap - the timer heap
+ *
+ * returns void
+ */
+void runExpiredTimers(timerHeap_t *heap)
+{
+    pollTimer_t *timer;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    while (heap->count && ! timercmp(&now, &heap->timers[0]->expires, <)) {
+        timer = heap->timers[0];
+        timerCancel(heap, timer);
+        timer->expire(timer);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Milliseconds until the next timer expires, at most the given maximum
+ *
+ * timerHeap_t *heap - the timer heap
+ * int max - upper bound in milliseconds
+ *
+ * returns int
+ */
+int nextTimerMs(timerHeap_t *heap, int max)
+{
+    long ms;
+    struct timeval now, delta;
+
+    if (! heap->count) {
+        return max;
+    }
+
+    gettimeofday(&now, NULL);
+    if (! timercmp(&now, &heap->timers[0]->expires, <)) {
+        return 0;
+    }
+
+    timersub(&heap->timers[0]->expires, &now, &delta);
+    ms = delta.tv_sec * 1000 + (delta.tv_usec + 999) / 1000;
+
+    return ms < max ? ms : max;
+}
+
+/*****************************************************************************/
+/*
+ * Serialize the access to the USM of netsnmp. Its users and the engine times
+ * are global lists, which are read and modified by sending and receiving
+ * SNMPv3 messages. The lock is recursive, as the callbacks invoked while
+ * reading send the next requests.
+ *
+ * returns void
+ */
+void lockUsm()
+{
+    if (usmShared) {
+        pthread_mutex_lock(&usmLock);
+    }
+}
+
+void unlockUsm()
+{
+    if (usmShared) {
+        pthread_mutex_unlock(&usmLock);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Slot of the USM user of an engineID and security name in the table of the
+ * localized users, an unused slot if the user does not exist. The table grows
+ * to stay at most half full, the caller holds the USM lock.
+ *
+ * const u_char *engineID - snmpEngineID of the host
+ * size_t engineIDLen - length of the engineID
+ * const char *name - security name
+ *
+ * returns localizedUser_t *
+ */
+localizedUser_t *getLocalizedUser(const u_char *engineID, size_t engineIDLen, const char *name)
+{
+    size_t i, size = localizedUsers.size;
+    localizedUser_t *entries = localizedUsers.entries, *entry;
+
+    if (2 * (localizedUsers.count + 1) > localizedUsers.size) {
+        localizedUsers.size = size ? 2 * size : 64;
+        localizedUsers.entries = calloc(localizedUsers.size, sizeof(localizedUser_t));
+        localizedUsers.count = 0;
+        for (i = 0; i < size; i++) {
+            if (entries[i].credential) {
+                *getLocalizedUser(entries[i].engineID, entries[i].engineIDLen, entries[i].credential->name) = entries[i];
+                localizedUsers.count++;
+            }
+        }
+        free(entries);
+    }
+
+    i = hashBytes(hashBytes(FNV_OFFSET, engineID, engineIDLen), name, strlen(name)) & (localizedUsers.size - 1);
+    for (entry = &localizedUsers.entries[i]; entry->credential; entry = &localizedUsers.entries[i]) {
+        if (entry->engineIDLen == engineIDLen && ! memcmp(entry->engineID, engineID, engineIDLen) &&
+            ! strcmp(entry->credential->name, name)) {
+            break;
+        }
+        i = (i + 1) & (localizedUsers.size - 1);
+    }
+
+    return entry;
+}
+
+/*****************************************************************************/
+/*
+ * Make the user of the host known to the USM for the discovered engineID of
+ * the host. The keys are localized from the master keys of the credential,
+ * which is cheap compared to deriving them from the passphrases, and only
+ * once per engineID and user. The credential each user was localized from is
+ * recorded, a user localized from another credential - of the same host
+ * before its credentials changed, or of another host sharing the engineID -
+ * is replaced. If the engine time is not known to netsnmp, e.g. after a
+ * restart, it is estimated from the persisted state, which saves the round
+ * trip of a notInTimeWindow report.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void localizeUser(hostContext_t *hostContext)
+{
+    usmCredential_t *credential = hostContext->credential;
+    hostState_t *state = hostContext->state;
+    localizedUser_t *localized;
+    struct usmUser *user;
+    u_int boots, engineTime;
+
+    lockUsm();
+    localized = getLocalizedUser(state->engineID, state->engineIDLen, credential->name);
+    if (localized->credential != credential) {
+        if ((user = usm_get_user(state->engineID, state->engineIDLen, credential->name))) {
+            usm_free_user(usm_remove_user(user));
+        }
+
+        user = usm_create_user();
+        user->engineID = netsnmp_memdup(state->engineID, state->engineIDLen);
+        user->engineIDLen = state->engineIDLen;
+        user->name = strdup(credential->name);
+        user->secName = strdup(credential->name);
+        user->userStorageType = ST_VOLATILE;            /* keep netsnmp from persisting the keys */
+        user->userStatus = RS_ACTIVE;
+
+        SNMP_FREE(user->authProtocol);
+        user->authProtocol = snmp_duplicate_objid(usmHMACSHA1AuthProtocol, USM_AUTH_PROTO_SHA_LEN);
+        user->authProtocolLen = USM_AUTH_PROTO_SHA_LEN;
+        user->authKeyLen = USM_AUTH_KU_LEN;
+        user->authKey = malloc(user->authKeyLen);
+        generate_kul(usmHMACSHA1AuthProtocol, USM_AUTH_PROTO_SHA_LEN, state->engineID, state->engineIDLen,
+                     credential->authKey, credential->authKeyLen, user->authKey, &user->authKeyLen);
+
+        if (credential->privKeyLen) {
+            SNMP_FREE(user->privProtocol);
+            user->privProtocol = snmp_duplicate_objid(usmAESPrivProtocol, USM_PRIV_PROTO_AES_LEN);
+            user->privProtocolLen = USM_PRIV_PROTO_AES_LEN;
+            user->privKeyLen = USM_PRIV_KU_LEN;
+            user->privKey = malloc(user->privKeyLen);
+            generate_kul(usmHMACSHA1AuthProtocol, USM_AUTH_PROTO_SHA_LEN, state->engineID, state->engineIDLen,
+                         credential->privKey, credential->privKeyLen, user->privKey, &user->privKeyLen);
+            /* AES-128 uses the first 16 bytes of the localized key */
+            user->privKeyLen = 16;
+        }
+
+        usm_add_user(user);
+
+        if (! localized->credential) {
+            memcpy(localized->engineID, state->engineID, state->engineIDLen);
+            localized->engineIDLen = state->engineIDLen;
+            localizedUsers.count++;
+        }
+        localized->credential = credential;
+    }
+
+    if (state->engineTimeSaved && get_enginetime(state->engineID, state->engineIDLen, &boots, &engineTime, TRUE) != SNMPERR_SUCCESS) {
+        set_enginetime(state->engineID, state->engineIDLen, state->engineBoots, state->engineTime + (time(NULL) - state->engineTimeSaved), TRUE);
+    }
+    unlockUsm();
+}
+
+/*****************************************************************************/
+/*
+ * Keep the engine time netsnmp synchronized with the host in its state, so
+ * that it survives a restart of the poller
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void saveEngineTime(hostContext_t *hostContext)
+{
+    hostState_t *state = hostContext->state;
+    u_int boots, engineTime;
+
+    lockUsm();
+    if (get_enginetime(state->engineID, state->engineIDLen, &boots, &engineTime, TRUE) == SNMPERR_SUCCESS && (boots || engineTime)) {
+        state->engineBoots = boots;
+        state->engineTime = engineTime;
+        state->engineTimeSaved = time(NULL);
+    }
+    unlockUsm();
+}
+
+/*****************************************************************************/
+/*
+ * Schedule the session timer to the earliest pending request of the
+ * session. netsnmp computes this over the requests of this session only.
+ *
+ * sessionContext_t *sessionContext - the session
+ *
+ * returns void
+ */
+void rescheduleSession(sessionContext_t *sessionContext)
+{
+    int numfds = 0, block = 1;
+    struct timeval now, delta = { 0, 0 };
+
+    worker_t *worker = sessionContext->worker;
+
+    snmp_sess_select_info2(sessionContext->handle, &numfds, &worker->readSet, &delta, &block);
+
+    if (block) {
+        timerCancel(&worker->timers, &sessionContext->timer);
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    timeradd(&now, &delta, &now);
+    timerSchedule(&worker->timers, &sessionContext->timer, &now);
+}
+
+/*****************************************************************************/
+/*
+ * Expire function of the session timer: let netsnmp retransmit or time out
+ * the due requests of this session and schedule the next one.
+ *
+ * pollTimer_t *timer - timer of the session
+ *
+ * returns void
+ */
+void sessionTimeout(pollTimer_t *timer)
+{
+    sessionContext_t *sessionContext = containerOf(timer, sessionContext_t, timer);
+
+    lockUsm();
+    snmp_sess_timeout(sessionContext->handle);
+    unlockUsm();
+    rescheduleSession(sessionContext);
+}
+
+/*****************************************************************************/
+/*
+ * Read all pending packets of a session. As the file descriptor is
+ * registered edge-triggered, the socket needs to be drained completely.
+ *
+ * sessionContext_t *sessionContext - the session, which is ready for reading
+ *
+ * returns void
+ */
+void readSession(sessionContext_t *sessionContext)
+{
+    char c;
+    int fd = snmp_sess_transport(sessionContext->handle)->sock;
+    netsnmp_large_fd_set *readSet = &sessionContext->worker->readSet;
+
+    NETSNMP_LARGE_FD_SET(fd, readSet);
+    while (recv(fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT) >= 0) {
+        lockUsm();
+        snmp_sess_read2(sessionContext->handle, readSet);
+        unlockUsm();
+    }
+    NETSNMP_LARGE_FD_CLR(fd, readSet);
+}
+
+/*****************************************************************************/
+/*
+ * Open a netsnmp session. For the epoll event loop the single session API is
+ * used and the socket is registered once with the epoll instance of the
+ * worker. Opening sessions is serialized between the workers, as netsnmp
+ * shares state between sessions while opening them.
+ *
+ * worker_t *worker - worker owning the session
+ * sessionContext_t *sessionContext - to be filled with the opened session
+ * struct snmp_session *session - session parameters
+ *
+ * returns int
+ */
+int openSession(worker_t *worker, sessionContext_t *sessionContext, struct snmp_session *session)
+{
+    struct epoll_event event;
+
+    sessionContext->worker = worker;
+    sessionContext->timer.index = -1;
+    sessionContext->timer.expire = sessionTimeout;
+
+    pthread_mutex_lock(&sessionLock);
+    if (useEpoll) {
+        sessionContext->handle = snmp_sess_open(session);
+    } else {
+        sessionContext->session = snmp_open(session);
+    }
+    pthread_mutex_unlock(&sessionLock);
+
+    if (! useEpoll) {
+        return sessionContext->session != NULL;
+    }
+
+    if (! sessionContext->handle) {
+        return 0;
+    }
+    sessionContext->session = snmp_sess_session(sessionContext->handle);
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = sessionContext;
+    if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, snmp_sess_transport(sessionContext->handle)->sock, &event)) {
+        perror("epoll_ctl");
+        snmp_sess_close(sessionContext->handle);
+        sessionContext->handle = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Move the deadline of the host: it is given up, if neither a request is sent
+ * nor a response is received for the duration of all retransmissions of a
+ * request and one more timeout. Without outstanding requests there is no
+ * deadline, e.g. while the host waits for the scheduler.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * int outstanding - whether the host has outstanding requests
+ *
+ * returns void
+ */
+void extendDeadline(hostContext_t *hostContext, int outstanding)
+{
+    long timeout = getTimeout(hostContext) * (RETRIES + 2);
+    struct timeval expires;
+
+    if (! outstanding || hostContext->finished) {
+        timerCancel(&hostContext->worker->timers, &hostContext->deadline);
+        return;
+    }
+
+    gettimeofday(&expires, NULL);
+    expires.tv_sec += timeout / 1000000 + (expires.tv_usec + timeout % 1000000) / 1000000;
+    expires.tv_usec = (expires.tv_usec + timeout % 1000000) % 1000000;
+    timerSchedule(&hostContext->worker->timers, &hostContext->deadline, &expires);
+}
+
+/*****************************************************************************/
+/*
+ * Account a request, which was just sent to the host: it occupies a slot in
+ * the windows of the worker and the group, its send time is kept for the
+ * round trip time estimation and the deadline of the host is moved.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment of the request
+ * long timeout - timeout of the request in microseconds
+ *
+ * returns void
+ */
+void requestSent(hostContext_t *hostContext, pass_t segment, long timeout)
+{
+    hostContext->worker->metrics.requests[segment]++;
+    hostContext->worker->inFlight++;
+    hostContext->group->inFlight++;
+
+    gettimeofday(&hostContext->sent[segment], NULL);
+    hostContext->timeouts[segment] = timeout;
+    extendDeadline(hostContext, 1);
+}
+
+/*****************************************************************************/
+/*
+ * Send a PDU to the host. If the host uses a session of the shared socket
+ * pool, the destination address and for SNMPv2c the community are attached
+ * to the PDU, as the session itself is not bound to a single host. The reply
+ * is routed back to the host context by its request id.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * struct snmp_pdu *request - PDU to send, freed by netsnmp
+ * netsnmp_callback callback - called with the response or on timeout
+ * long timeout - timeout of the request in microseconds
+ *
+ * returns long - request id or 0 on failure
+ */
+long sendPdu(hostContext_t *hostContext, struct snmp_pdu *request, netsnmp_callback callback, long timeout)
+{
+    int sent;
+    long defaultTimeout;
+    struct timeval expires;
+    sessionContext_t *sessionContext = hostContext->session;
+
+    if (hostContext->address) {
+        request->transport_data = netsnmp_memdup(hostContext->address, sizeof(netsnmp_indexed_addr_pair));
+        request->transport_data_length = sizeof(netsnmp_indexed_addr_pair);
+        if (! hostContext->credential) {
+            request->community = (u_char *)strdup(hostContext->community);
+            request->community_len = strlen(hostContext->community);
+        }
+    }
+
+    /*
+     * netsnmp copies the timeout of a request from the session, when it is
+     * sent - the per PDU timeout only has whole seconds. The timeout of the
+     * host is therefore lent to the session for this request only.
+     */
+    defaultTimeout = sessionContext->session->timeout;
+    sessionContext->session->timeout = timeout;
+
+    lockUsm();
+    if (! sessionContext->handle) {
+        sent = snmp_async_send(sessionContext->session, request, callback, hostContext);
+    } else {
+        sent = snmp_sess_async_send(sessionContext->handle, request, callback, hostContext);
+    }
+    unlockUsm();
+    sessionContext->session->timeout = defaultTimeout;
+
+    if (! sent) {
+        snmp_perror("snmp_send");
+        snmp_free_pdu(request);
+        return 0;
+    }
+
+    if (sessionContext->handle) {
+        gettimeofday(&expires, NULL);
+        expires.tv_sec += timeout / 1000000;
+        expires.tv_usec += timeout % 1000000;
+        if (expires.tv_usec >= 1000000) {
+            expires.tv_sec++;
+            expires.tv_usec -= 1000000;
+        }
+
+        /* the session timer only needs to move, if this request expires first */
+        if (sessionContext->timer.index < 0 || timercmp(&expires, &sessionContext->timer.expires, <)) {
+            timerSchedule(&sessionContext->worker->timers, &sessionContext->timer, &expires);
+        }
+    }
+
+    return request->reqid;
+}
+
+/*****************************************************************************/
+/*
+ * Send a request of a segment to the host. For SNMPv3 the user and the
+ * discovered engineID of the host are set, so that netsnmp finds the
+ * localized keys without probing the engine.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment of the request
+ * struct snmp_pdu *request - request to send, freed by netsnmp
+ *
+ * returns long - request id or 0 on failure
+ */
+long sendRequest(hostContext_t *hostContext, pass_t segment, struct snmp_pdu *request)
+{
+    long reqid, timeout = getTimeout(hostContext);
+    usmCredential_t *credential = hostContext->credential;
+    hostState_t *state = hostContext->state;
+
+    if (credential) {
+        request->version = SNMP_VERSION_3;
+        request->securityModel = SNMP_SEC_MODEL_USM;
+        request->securityLevel = credential->level;
+        request->securityName = strdup(credential->name);
+        request->securityNameLen = strlen(credential->name);
+        request->securityEngineID = netsnmp_memdup(state->engineID, state->engineIDLen);
+        request->securityEngineIDLen = state->engineIDLen;
+        request->contextEngineID = netsnmp_memdup(state->engineID, state->engineIDLen);
+        request->contextEngineIDLen = state->engineIDLen;
+    }
+
+    if ((reqid = sendPdu(hostContext, request, asyncResponse, timeout))) {
+        requestSent(hostContext, segment, timeout);
+    }
+
+    return reqid;
+}
+
+/*****************************************************************************/
+/*
+ * Discover the engineID of an SNMPv3 host: an unauthenticated request without
+ * varbinds is answered by a report, which carries the engineID and the
+ * engine time. The host waits outside of the admission queue meanwhile.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns int - 0 on failure
+ */
+int discoverEngine(hostContext_t *hostContext)
+{
+    struct snmp_pdu *request = snmp_pdu_create(SNMP_MSG_GET);
+
+    request->version = SNMP_VERSION_3;
+    request->securityModel = SNMP_SEC_MODEL_USM;
+    request->securityLevel = SNMP_SEC_LEVEL_NOAUTH;
+    request->securityName = strdup("");
+    request->securityNameLen = 0;
+
+    if (! sendPdu(hostContext, request, discoveryResponse, getTimeout(hostContext))) {
+        return 0;
+    }
+
+    hostContext->worker->metrics.discoveries++;
+    hostContext->worker->inFlight++;
+    hostContext->group->inFlight++;
+    extendDeadline(hostContext, 1);
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Prepend bytes to a message, which is encoded back to front. Encoding the
+ * message from its end allows to use the shortest form of each length, as the
+ * length of the contents is known when its header is written.
+ *
+ * u_char **pos - current start of the message, moved to the front
+ * u_char *base - start of the buffer
+ * const u_char *data - bytes to prepend
+ * size_t len - number of bytes
+ *
+ * returns int - 0 if the buffer is too small
+ */
+int berPrepend(u_char **pos, u_char *base, const u_char *data, size_t len)
+{
+    if ((size_t)(*pos - base) < len) {
+        return 0;
+    }
+
+    *pos -= len;
+    memcpy(*pos, data, len);
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Prepend the type and length header of an element
+ *
+ * u_char **pos - current start of the message, moved to the front
+ * u_char *base - start of the buffer
+ * u_char type - BER type of the element
+ * size_t len - length of the contents
+ *
+ * returns int - 0 if the buffer is too small
+ */
+int berPrependHeader(u_char **pos, u_char *base, u_char type, size_t len)
+{
+    u_char header[2 + sizeof(size_t)];
+    size_t i = sizeof(header);
+
+    do {
+        header[--i] = len & 0xff;
+        len >>= 8;
+    } while (len);
+
+    /* short form for lengths below 128 */
+    if (i != sizeof(header) - 1 || header[i] & 0x80) {
+        header[i - 1] = 0x80 | (sizeof(header) - i);
+        i--;
+    }
+    header[--i] = type;
+
+    return berPrepend(pos, base, &header[i], sizeof(header) - i);
+}
+
+/*****************************************************************************/
+/*
+ * Prepend an integer in its shortest two's complement form
+ *
+ * u_char **pos - current start of the message, moved to the front
+ * u_char *base - start of the buffer
+ * long value - the integer
+ *
+ * returns int - 0 if the buffer is too small
+ */
+int berPrependInteger(u_char **pos, u_char *base, long value)
+{
+    u_char content[sizeof(long)];
+    size_t i = sizeof(content);
+
+    do {
+        content[--i] = value & 0xff;
+        value >>= 8;
+    } while (i && ! ((value == 0 && ! (content[i] & 0x80)) || (value == -1 && content[i] & 0x80)));
+
+    return berPrepend(pos, base, &content[i], sizeof(content) - i) &&
+           berPrependHeader(pos, base, ASN_INTEGER, sizeof(content) - i);
+}
+
+/*****************************************************************************/
+/*
+ * Encode sub-identifiers of an OID in base 128, the first two sub-identifiers
+ * need to be combined by the caller
+ *
+ * u_char *out - output buffer of at least 5 bytes per sub-identifier
+ * const oid *subids - sub-identifiers
+ * size_t count - number of sub-identifiers
+ *
+ * returns size_t - number of encoded bytes
+ */
+size_t berEncodeSubids(u_char *out, const oid *subids, size_t count)
+{
+    int shift;
+    size_t len = 0;
+    uint32_t value;
+
+    for (; count; count--, subids++) {
+        value = *subids;
+        for (shift = 28; shift && ! (value >> shift); shift -= 7);
+        for (; shift; shift -= 7) {
+            out[len++] = 0x80 | ((value >> shift) & 0x7f);
+        }
+        out[len++] = value & 0x7f;
+    }
+
+    return len;
+}
+
+/*****************************************************************************/
+/*
+ * Prepend the varbind list of a request: all columns of the segment without
+ * suffix, or only the open columns continuing at their cursors.
+ *
+ * u_char **pos - current start of the message, moved to the front
+ * u_char *base - start of the buffer
+ * profile_t *profile - profile of the request
+ * pass_t segment - segment of the request
+ * columnCursor_t *column - cursors of the segment, NULL for the first request
+ *
+ * returns int - number of varbinds, 0 if none, -1 if the buffer is too small
+ */
+int encodeVarbinds(u_char **pos, u_char *base, profile_t *profile, pass_t segment, columnCursor_t *column)
+{
+    int i, count = 0;
+    size_t len;
+    u_char *end = *pos, *varbind, suffix[MAX_SUFFIX_LEN * 5];
+    static const u_char null[] = { ASN_NULL, 0 };
+    struct oid_s *first = getSegmentFirstOid(profile, segment);
+
+    for (i = profile->itemCount[segment] - 1; i >= 0; i--) {
+        if (column && column[i].done) {
+            continue;
+        }
+
+        varbind = *pos;
+        len = column ? berEncodeSubids(suffix, column[i].suffix, column[i].suffixLen) : 0;
+        if (! berPrepend(pos, base, null, sizeof(null)) ||
+            ! berPrepend(pos, base, suffix, len) ||
+            ! berPrepend(pos, base, first[i].Encoded, first[i].EncodedLen) ||
+            ! berPrependHeader(pos, base, ASN_OBJECT_ID, first[i].EncodedLen + len) ||
+            ! berPrependHeader(pos, base, ASN_SEQUENCE | ASN_CONSTRUCTOR, varbind - *pos)) {
+            return -1;
+        }
+        count++;
+    }
+
+    if (! count) {
+        return 0;
+    }
+    if (! berPrependHeader(pos, base, ASN_SEQUENCE | ASN_CONSTRUCTOR, end - *pos)) {
+        return -1;
+    }
+
+    return count;
+}
+
+/*****************************************************************************/
+/*
+ * Pre-encode the OID of each column and the varbind list of the first request
+ * of each segment, so that a request is assembled by copying.
+ *
+ * profile_t *profile - the profile
+ *
+ * returns void
+ */
+void buildTemplates(profile_t *profile)
+{
+    pass_t segment;
+    oid first;
+    u_char buffer[MTU], *pos, *end = buffer + sizeof(buffer);
+    struct oid_s *currentOid;
+
+    for (currentOid = profile->oids; currentOid->segment < FINISH; currentOid++) {
+        first = currentOid->Oid[0] * 40 + currentOid->Oid[1];
+        currentOid->EncodedLen = berEncodeSubids(currentOid->Encoded, &first, 1);
+        currentOid->EncodedLen += berEncodeSubids(&currentOid->Encoded[currentOid->EncodedLen], &currentOid->Oid[2], currentOid->OidLen - 2);
+    }
+
+    for (segment = NON_REP; segment < FINISH; segment++) {
+        if (! profile->itemCount[segment]) {
+            continue;
+        }
+
+        pos = end;
+        if (encodeVarbinds(&pos, buffer, profile, segment, NULL) <= 0) {
+            fprintf(stderr, "Request of segment %d does not fit into a single packet\n", segment);
+            exit(1);
+        }
+
+        profile->templateLen[segment] = end - pos;
+        profile->templates[segment] = malloc(profile->templateLen[segment]);
+        memcpy(profile->templates[segment], pos, profile->templateLen[segment]);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Encode the request of a slot. The varbind list is copied from the template
+ * of the segment, unless columns are continued, the header only needs the
+ * community, request id and max-repetitions of the host.
+ *
+ * requestSlot_t *slot - the request
+ * u_char *buffer - output buffer
+ * size_t size - size of the buffer
+ *
+ * returns ssize_t - length of the encoded message at the end of the buffer, 0 if nothing is to be sent, -1 if it does not fit
+ */
+ssize_t encodeRequest(requestSlot_t *slot, u_char *buffer, size_t size)
+{
+    int count;
+    u_char *end = buffer + size, *pos = end;
+    hostContext_t *hostContext = slot->host;
+    profile_t *profile = hostContext->profile;
+    size_t communityLen = strlen(hostContext->community);
+
+    if (slot->segment == NON_REP || ! hostContext->columns) {
+        if (! berPrepend(&pos, buffer, profile->templates[slot->segment], profile->templateLen[slot->segment])) {
+            return -1;
+        }
+    } else if ((count = encodeVarbinds(&pos, buffer, profile, slot->segment, getColumns(hostContext, slot->segment))) <= 0) {
+        return count;
+    }
+
+    if (! berPrependInteger(&pos, buffer, slot->maxRepetitions) ||
+        ! berPrependInteger(&pos, buffer, 0) ||
+        ! berPrependInteger(&pos, buffer, slot->reqid) ||
+        ! berPrependHeader(&pos, buffer, slot->segment == NON_REP ? SNMP_MSG_GETNEXT : SNMP_MSG_GETBULK, end - pos) ||
+        ! berPrepend(&pos, buffer, (u_char *)hostContext->community, communityLen) ||
+        ! berPrependHeader(&pos, buffer, ASN_OCTET_STR, communityLen) ||
+        ! berPrependInteger(&pos, buffer, SNMP_VERSION_2c) ||
+        ! berPrependHeader(&pos, buffer, ASN_SEQUENCE | ASN_CONSTRUCTOR, end - pos)) {
+        return -1;
+    }
+
+    return end - pos;
+}
+
+/*****************************************************************************/
+/*
+ * Allocate the buffers of a batch of packets and point the headers to them
+ *
+ * packetBatch_t *batch - the batch
+ * size_t bufferSize - size of each buffer
+ *
+ * returns void
+ */
+void allocBatch(packetBatch_t *batch, size_t bufferSize)
+{
+    int i;
+
+    batch->headers = calloc(batchSize, sizeof(struct mmsghdr));
+    batch->iov = calloc(batchSize, sizeof(struct iovec));
+    batch->addresses = calloc(batchSize, sizeof(netsnmp_indexed_addr_pair));
+    if (! batch->headers || ! batch->iov || ! batch->addresses || ! (batch->buffers = malloc(batchSize * bufferSize))) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (i = 0; i < batchSize; i++) {
+        batch->iov[i].iov_base = batch->buffers + i * bufferSize;
+        batch->iov[i].iov_len = bufferSize;
+        batch->headers[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->headers[i].msg_hdr.msg_iovlen = 1;
+        batch->headers[i].msg_hdr.msg_name = &batch->addresses[i].remote_addr;
+        batch->headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Free the buffers of a batch of packets
+ *
+ * packetBatch_t *batch - the batch
+ *
+ * returns void
+ */
+void freeBatch(packetBatch_t *batch)
+{
+    free(batch->headers);
+    free(batch->iov);
+    free(batch->addresses);
+    free(batch->buffers);
+}
+
+/*****************************************************************************/
+/*
+ * Send the queued requests of a socket of the raw transport with as few
+ * sendmmsg calls as possible. A request, which the kernel does not take, is
+ * skipped and the rest of the batch sent - it is retransmitted like a lost
+ * packet. The skipped requests are counted and reported once per batch, as a
+ * full socket buffer refuses many of them.
+ *
+ * sessionContext_t *sessionContext - socket of the pool
+ *
+ * returns void
+ */
+void flushRequests(sessionContext_t *sessionContext)
+{
+    int i, sent, offset = 0, failed = 0, error = 0;
+    packetBatch_t *batch = &sessionContext->requests;
+    worker_t *worker = sessionContext->worker;
+
+    while (offset < batch->count) {
+        worker->metrics.sendCalls++;
+        if ((sent = sendmmsg(sessionContext->fd, batch->headers + offset, batch->count - offset, 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            failed++;
+            offset++;
+            continue;
+        }
+        for (i = offset; i < offset + sent; i++) {
+            worker->metrics.bytesSent += batch->headers[i].msg_len;
+        }
+        offset += sent;
+        worker->metrics.packetsSent += sent;
+    }
+
+    if (failed) {
+        worker->metrics.sendErrors += failed;
+        fprintf(stderr, "sendmmsg: %d of %d requests not sent: %s\n", failed, batch->count, strerror(error));
+    }
+    batch->count = 0;
+}
+
+/*****************************************************************************/
+/*
+ * Send the queued requests of all sockets of the pool, before the worker
+ * waits for events
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void flushPool(worker_t *worker)
+{
+    int i;
+
+    for (i = 0; i < poolSize; i++) {
+        if (worker->sessions[i].requests.count) {
+            flushRequests(&worker->sessions[i]);
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Encode and send the request of a slot to its host
+ *
+ * requestSlot_t *slot - the request
+ *
+ * returns int - 1 if queued for sending, 0 if nothing is to be sent, -1 if the request does not fit into a packet
+ */
+int transmitRequest(requestSlot_t *slot)
+{
+    hostContext_t *hostContext = slot->host;
+    packetBatch_t *batch = &hostContext->session->requests;
+    u_char *buffer;
+    ssize_t len;
+
+    if (batch->count == batchSize) {
+        flushRequests(hostContext->session);
+    }
+
+    /* the request is encoded back to front, so it ends at the end of the buffer */
+    buffer = batch->buffers + (size_t)batch->count * MTU;
+    if ((len = encodeRequest(slot, buffer, MTU)) <= 0) {
+        return len < 0 ? -1 : 0;
+    }
+
+    batch->iov[batch->count].iov_base = buffer + MTU - len;
+    batch->iov[batch->count].iov_len = len;
+    batch->addresses[batch->count].remote_addr.sin = hostContext->address->remote_addr.sin;
+    batch->count++;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Return a request slot to the free list of the worker
+ *
+ * requestSlot_t *slot - the request
+ *
+ * returns void
+ */
+void releaseSlot(requestSlot_t *slot)
+{
+    worker_t *worker = slot->host->worker;
+
+    timerCancel(&worker->timers, &slot->timer);
+    slot->host = NULL;
+    slot->next = worker->freeSlots;
+    worker->freeSlots = slot;
+}
+
+/*****************************************************************************/
+/*
+ * Expire function of a request slot: retransmit the request, until its
+ * retries are used up - then the request timed out. Requests of hosts, which
+ * were given up, are not retransmitted.
+ *
+ * pollTimer_t *timer - timer of the request
+ *
+ * returns void
+ */
+void requestTimeout(pollTimer_t *timer)
+{
+    requestSlot_t *slot = containerOf(timer, requestSlot_t, timer);
+    hostContext_t *hostContext = slot->host;
+    struct timeval expires;
+    long reqid = slot->reqid;
+
+    if (slot->retries++ < RETRIES && ! hostContext->finished && transmitRequest(slot) > 0) {
+        hostContext->worker->metrics.retransmissions++;
+        gettimeofday(&expires, NULL);
+        expires.tv_sec += slot->timeout / 1000000 + (expires.tv_usec + slot->timeout % 1000000) / 1000000;
+        expires.tv_usec = (expires.tv_usec + slot->timeout % 1000000) % 1000000;
+        timerSchedule(&hostContext->worker->timers, &slot->timer, &expires);
+        return;
+    }
+
+    releaseSlot(slot);
+    asyncResponse(NETSNMP_CALLBACK_OP_TIMED_OUT, NULL, reqid, NULL, hostContext);
+}
+
+/*****************************************************************************/
+/*
+ * Allocate another chunk of request slots and add them to the free slots.
+ * The slots are never moved, as their timers are part of the timer heap.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns int - 0 if the request ids cannot tell apart any more slots
+ */
+int growSlots(worker_t *worker)
+{
+    long i;
+    requestSlot_t *chunk;
+
+    if (worker->slotCount + SLOT_CHUNK > MAX_SLOTS) {
+        return 0;
+    }
+
+    worker->slots = realloc(worker->slots, (worker->slotCount / SLOT_CHUNK + 1) * sizeof(requestSlot_t *));
+    chunk = worker->slots[worker->slotCount / SLOT_CHUNK] = calloc(SLOT_CHUNK, sizeof(requestSlot_t));
+    for (i = SLOT_CHUNK - 1; i >= 0; i--) {
+        chunk[i].index = worker->slotCount + i;
+        chunk[i].timer.index = -1;
+        chunk[i].timer.expire = requestTimeout;
+        chunk[i].next = worker->freeSlots;
+        worker->freeSlots = &chunk[i];
+    }
+    worker->slotCount += SLOT_CHUNK;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Send the next request of a segment without netsnmp: the request is encoded
+ * from the templates directly into the packet and tracked in a request slot
+ * of the worker, whose index is part of the request id.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment to be sent
+ *
+ * returns long - request id, 0 if no column is open, -1 on failure
+ */
+long sendRawRequest(hostContext_t *hostContext, pass_t segment)
+{
+    int queued;
+    worker_t *worker = hostContext->worker;
+    requestSlot_t *slot;
+    struct timeval expires;
+
+    if (! worker->freeSlots && ! growSlots(worker)) {
+        fprintf(stderr, "%s: No free request slot\n", hostContext->peername);
+        return -1;
+    }
+    slot = worker->freeSlots;
+    worker->freeSlots = slot->next;
+
+    /* the generation tells apart late responses to a previous use of the slot */
+    slot->generation = (slot->generation + 1) % (INT32_MAX / MAX_SLOTS);
+    slot->reqid = slot->generation * MAX_SLOTS + slot->index + 1;
+    slot->host = hostContext;
+    slot->segment = segment;
+    slot->maxRepetitions = segment == NON_REP ? 0 : getRepetitions(hostContext, segment);
+    slot->timeout = getTimeout(hostContext);
+    slot->retries = 0;
+
+    if ((queued = transmitRequest(slot)) <= 0) {
+        if (queued < 0) {
+            fprintf(stderr, "%s: Request does not fit into a packet\n", hostContext->peername);
+        }
+        releaseSlot(slot);
+        return queued;
+    }
+
+    gettimeofday(&expires, NULL);
+    expires.tv_sec += slot->timeout / 1000000 + (expires.tv_usec + slot->timeout % 1000000) / 1000000;
+    expires.tv_usec = (expires.tv_usec + slot->timeout % 1000000) % 1000000;
+    timerSchedule(&worker->timers, &slot->timer, &expires);
+    requestSent(hostContext, segment, slot->timeout);
+
+    return slot->reqid;
+}
+
+/*****************************************************************************/
+/*
+ * Read the type and length of an element and check, that its contents fit
+ * into the remaining buffer
+ *
+ * u_char **pos - current position, moved to the contents of the element
+ * u_char *end - end of the buffer
+ * u_char *type - type of the element
+ * size_t *len - length of the contents
+ *
+ * returns int - 0 if the element is malformed
+ */
+int berReadHeader(u_char **pos, u_char *end, u_char *type, size_t *len)
+{
+    u_char *p = *pos;
+    size_t count;
+
+    if (end - p < 2) {
+        return 0;
+    }
+
+    *type = *p++;
+    *len = *p++;
+    if (*len & 0x80) {
+        count = *len & 0x7f;
+        if (! count || count > sizeof(size_t) || (size_t)(end - p) < count) {
+            return 0;
+        }
+        for (*len = 0; count; count--) {
+            *len = (*len << 8) | *p++;
+        }
+    }
+
+    if ((size_t)(end - p) < *len) {
+        return 0;
+    }
+    *pos = p;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Read a signed integer element
+ *
+ * u_char **pos - current position, moved behind the element
+ * u_char *end - end of the buffer
+ * long *value - the integer
+ *
+ * returns int - 0 if the element is malformed or not an integer
+ */
+int berReadInteger(u_char **pos, u_char *end, long *value)
+{
+    u_char type;
+    size_t len;
+
+    if (! berReadHeader(pos, end, &type, &len) || type != ASN_INTEGER || ! len || len > sizeof(long)) {
+        return 0;
+    }
+
+    *value = (**pos & 0x80) ? -1 : 0;
+    for (; len; len--) {
+        *value = (unsigned long)*value << 8 | *(*pos)++;
+    }
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Decode the value of a varbind, the value of strings is not copied but
+ * points into the receive buffer. Only the types the modems answer with are
+ * decoded, anything else is left to netsnmp.
+ *
+ * netsnmp_variable_list *var - the varbind
+ * u_char type - type of the value
+ * u_char *pos - contents of the value
+ * size_t len - length of the contents
+ *
+ * returns int - 0 if the value can not be decoded
+ */
+int decodeValue(netsnmp_variable_list *var, u_char type, u_char *pos, size_t len)
+{
+    size_t i;
+    uint64_t value = 0;
+    struct counter64 *counter = (struct counter64 *)var->buf;
+
+    var->type = type;
+    var->val.string = var->buf;
+    var->val_len = 0;
+
+    switch (type) {
+    case ASN_INTEGER:
+        if (! len || len > sizeof(long)) {
+            return 0;
+        }
+        *var->val.integer = (pos[0] & 0x80) ? -1 : 0;
+        for (i = 0; i < len; i++) {
+            *var->val.integer = (unsigned long)*var->val.integer << 8 | pos[i];
+        }
+        var->val_len = sizeof(long);
+        return 1;
+    case ASN_COUNTER:
+    case ASN_GAUGE:
+    case ASN_TIMETICKS:
+    case ASN_COUNTER64:
+        if (! len || len > (type == ASN_COUNTER64 ? 9 : 5) || pos[0] & 0x80 || (len == (type == ASN_COUNTER64 ? 9 : 5) && pos[0])) {
+            return 0;
+        }
+        for (i = 0; i < len; i++) {
+            value = value << 8 | pos[i];
+        }
+        if (type == ASN_COUNTER64) {
+            counter->high = value >> 32;
+            counter->low = value & 0xffffffff;
+            var->val_len = sizeof(struct counter64);
+        } else {
+            *var->val.integer = value;
+            var->val_len = sizeof(long);
+        }
+        return 1;
+    case ASN_IPADDRESS:
+        if (len != 4) {
+            return 0;
+        }
+        /* FALLTHRU */
+    case ASN_OCTET_STR:
+    case ASN_OPAQUE:
+        var->val.string = pos;
+        var->val_len = len;
+        return 1;
+    case ASN_NULL:
+    case SNMP_NOSUCHOBJECT:
+    case SNMP_NOSUCHINSTANCE:
+    case SNMP_ENDOFMIBVIEW:
+        return ! len;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/*
+ * Decode a varbind list into the preallocated varbinds of the worker. As a
+ * response is processed completely before the next one is read, the varbinds
+ * are reused for each response.
+ *
+ * worker_t *worker - the worker owning the varbinds
+ * u_char *pos - contents of the varbind list
+ * u_char *end - end of the varbind list
+ * netsnmp_variable_list **variables - first varbind, NULL for an empty list
+ *
+ * returns int - 0 if the list can not be decoded
+ */
+int decodeVarbinds(worker_t *worker, u_char *pos, u_char *end, netsnmp_variable_list **variables)
+{
+    int count;
+    u_char type, *next, *name;
+    size_t len;
+    uint64_t value;
+    netsnmp_variable_list *var = NULL;
+
+    *variables = NULL;
+    for (count = 0; pos < end; pos = next, count++) {
+        if (count == MAX_VARBINDS || ! berReadHeader(&pos, end, &type, &len) || type != (ASN_SEQUENCE | ASN_CONSTRUCTOR)) {
+            return 0;
+        }
+        next = pos + len;
+
+        if (var) {
+            var->next_variable = &worker->varbinds[count];
+        }
+        var = &worker->varbinds[count];
+        var->next_variable = NULL;
+
+        /* the name, its first byte(s) combine the first two sub-identifiers */
+        if (! berReadHeader(&pos, next, &type, &len) || type != ASN_OBJECT_ID || ! len || pos[len - 1] & 0x80) {
+            return 0;
+        }
+        var->name = var->name_loc;
+        var->name_length = 0;
+        for (name = pos, pos += len, value = 0; name < pos; name++) {
+            if ((value = value << 7 | (*name & 0x7f)) > UINT32_MAX) {
+                return 0;
+            }
+            if (*name & 0x80) {
+                continue;
+            }
+
+            if (! var->name_length) {
+                var->name_loc[0] = value < 80 ? value / 40 : 2;
+                var->name_loc[1] = value - var->name_loc[0] * 40;
+                var->name_length = 2;
+            } else if (var->name_length < MAX_OID_LEN) {
+                var->name_loc[var->name_length++] = value;
+            } else {
+                return 0;
+            }
+            value = 0;
+        }
+
+        if (! berReadHeader(&pos, next, &type, &len) || pos + len != next || ! decodeValue(var, type, pos, len)) {
+            return 0;
+        }
+    }
+
+    *variables = count ? worker->varbinds : NULL;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Decode a response without netsnmp. The PDU and its varbinds are not
+ * allocated, so they must not be freed and are only valid until the next
+ * response is decoded.
+ *
+ * worker_t *worker - the worker owning the varbinds
+ * u_char *packet - the received message
+ * size_t length - length of the message
+ * netsnmp_pdu *response - to be filled with the response
+ *
+ * returns int - 0 if the message needs to be decoded by netsnmp
+ */
+int decodeResponse(worker_t *worker, u_char *packet, size_t length, netsnmp_pdu *response)
+{
+    u_char type, *pos = packet, *end = packet + length;
+    size_t len;
+
+    memset(response, 0, sizeof(*response));
+
+    if (! berReadHeader(&pos, end, &type, &len) || type != (ASN_SEQUENCE | ASN_CONSTRUCTOR)) {
+        return 0;
+    }
+    end = pos + len;
+
+    if (! berReadInteger(&pos, end, &response->version) || response->version != SNMP_VERSION_2c ||
+        ! berReadHeader(&pos, end, &type, &len) || type != ASN_OCTET_STR) {
+        return 0;
+    }
+    response->community = pos;
+    response->community_len = len;
+    pos += len;
+
+    if (! berReadHeader(&pos, end, &type, &len) || type != SNMP_MSG_RESPONSE) {
+        return 0;
+    }
+    response->command = type;
+    end = pos + len;
+
+    if (! berReadInteger(&pos, end, &response->reqid) ||
+        ! berReadInteger(&pos, end, &response->errstat) ||
+        ! berReadInteger(&pos, end, &response->errindex) ||
+        ! berReadHeader(&pos, end, &type, &len) || type != (ASN_SEQUENCE | ASN_CONSTRUCTOR)) {
+        return 0;
+    }
+
+    return decodeVarbinds(worker, pos, pos + len, &response->variables);
+}
+
+/*****************************************************************************/
+/*
+ * Hand a response of the raw transport to the callback of its request. The
+ * request slot is found by the request id.
+ *
+ * worker_t *worker - worker owning the request slots
+ * netsnmp_pdu *response - the response
+ *
+ * returns void
+ */
+void dispatchResponse(worker_t *worker, netsnmp_pdu *response)
+{
+    long reqid = response->reqid;
+    long index = (reqid - 1) % MAX_SLOTS;
+    requestSlot_t *slot;
+    hostContext_t *hostContext;
+
+    /* the slot has to match the request id, not only its index */
+    if (reqid <= 0 || index >= worker->slotCount || ! (slot = &worker->slots[index / SLOT_CHUNK][index % SLOT_CHUNK])->host || slot->reqid != reqid) {
+        return;
+    }
+
+    hostContext = slot->host;
+    releaseSlot(slot);
+    asyncResponse(NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE, NULL, reqid, response, hostContext);
+}
+
+/*****************************************************************************/
+/*
+ * Decode a received packet of the raw transport and pass it to its request.
+ * With the built-in decoder the response is decoded in place, anything it
+ * does not handle and all responses without it are parsed by netsnmp.
+ *
+ * worker_t *worker - the worker
+ * u_char *packet - the packet
+ * size_t received - length of the packet
+ * netsnmp_indexed_addr_pair *source - sender of the packet
+ *
+ * returns void
+ */
+void processPacket(worker_t *worker, u_char *packet, size_t received, netsnmp_indexed_addr_pair *source)
+{
+    u_char community[COMMUNITY_MAX_LEN], *data;
+    size_t length = received, communityLen = sizeof(community);
+    long version;
+    netsnmp_pdu decoded, *response;
+
+    if (worker->varbinds && decodeResponse(worker, packet, received, &decoded)) {
+        decoded.transport_data = source;
+        decoded.transport_data_length = sizeof(*source);
+        dispatchResponse(worker, &decoded);
+        return;
+    }
+
+    if (! (data = snmp_comstr_parse(packet, &length, community, &communityLen, &version))) {
+        return;
+    }
+
+    response = calloc(1, sizeof(netsnmp_pdu));
+    response->version = version;
+    if (! snmp_pdu_parse(response, data, &length) && response->command == SNMP_MSG_RESPONSE) {
+        response->transport_data = netsnmp_memdup(source, sizeof(*source));
+        response->transport_data_length = sizeof(*source);
+        dispatchResponse(worker, response);
+    }
+    snmp_free_pdu(response);
+}
+
+/*****************************************************************************/
+/*
+ * Read all pending responses of a raw socket, up to a batch of them with each
+ * recvmmsg call into the receive buffers of the worker.
+ *
+ * sessionContext_t *sessionContext - socket of the pool, which is ready for reading
+ *
+ * returns void
+ */
+void readRaw(sessionContext_t *sessionContext)
+{
+    worker_t *worker = sessionContext->worker;
+    packetBatch_t *batch = &worker->responses;
+    int i, received;
+
+    do {
+        for (i = 0; i < batchSize; i++) {
+            batch->headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        worker->metrics.receiveCalls++;
+        if ((received = recvmmsg(sessionContext->fd, batch->headers, batchSize, MSG_DONTWAIT, NULL)) < 0) {
+            return;
+        }
+        worker->metrics.packetsReceived += received;
+
+        for (i = 0; i < received; i++) {
+            worker->metrics.bytesReceived += batch->headers[i].msg_len;
+            if (! (batch->headers[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                processPacket(worker, batch->iov[i].iov_base, batch->headers[i].msg_len, &batch->addresses[i]);
+            }
+        }
+    /* a partial batch drained the socket, new packets trigger another edge */
+    } while (received == batchSize);
+}
+
+/*****************************************************************************/
+/*
+ * Open a socket of the pool for the raw transport and register it with the
+ * epoll instance of the worker
+ *
+ * worker_t *worker - worker owning the socket
+ * sessionContext_t *sessionContext - socket of the pool to be filled
+ *
+ * returns int
+ */
+int openRawSocket(worker_t *worker, sessionContext_t *sessionContext)
+{
+    struct epoll_event event;
+
+    sessionContext->worker = worker;
+    if ((sessionContext->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+        return 0;
+    }
+    allocBatch(&sessionContext->requests, MTU);
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = sessionContext;
+    if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sessionContext->fd, &event)) {
+        close(sessionContext->fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Only called if a table is not fully retrieved or the request needs to be
+ * repeated. To get the rest of the SNMP Table a new BULK Request is generated,
+ * which only contains the columns of the segment, which are not complete yet.
+ * Each column continues at the index of its own last received row.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment to be continued
+ *
+ * returns int - 1 if the request was sent, 0 if no column is open, -1 on failure
+ */
+int sendNextBulkRequest(hostContext_t *hostContext, pass_t segment)
+{
+    int open = 0;
+    long reqid;
+    struct snmp_pdu *request;
+    struct oid_s *oid = getSegmentFirstOid(hostContext->profile, segment);
+    struct oid_s cursor;                                /* the shared oids are not modified, as workers poll concurrently */
+    columnCursor_t *column = getColumns(hostContext, segment);
+
+    if (rawTransport) {
+        reqid = sendRawRequest(hostContext, segment);
+        hostContext->requestIds[segment] = reqid > 0 ? reqid : 0;
+        return reqid > 0 ? 1 : (int)reqid;
+    }
+
+    request = snmp_pdu_create(SNMP_MSG_GETBULK);
+    request->non_repeaters = 0;
+    request->max_repetitions = getRepetitions(hostContext, segment);
+
+    for (; oid->segment == segment; oid++, column++) {
+        if (column->done) {
+            continue;
+        }
+
+        memcpy(cursor.Oid, oid->Oid, oid->OidLen * sizeof(cursor.Oid[0]));
+        memcpy(&cursor.Oid[oid->OidLen], column->suffix, column->suffixLen * sizeof(cursor.Oid[0]));
+        snmp_add_null_var(request, cursor.Oid, oid->OidLen + column->suffixLen);
+        open++;
+    }
+
+    if (! open) {
+        snmp_free_pdu(request);
+        hostContext->requestIds[segment] = 0;
+        return 0;
+    }
+
+    if ((hostContext->requestIds[segment] = sendRequest(hostContext, segment, request))) {
+        return 1;
+    }
+
+    return -1;
+}
+
+/*****************************************************************************/
+/*
+ * Append formatted text to the output of a host
+ *
+ * resultBuffer_t *buffer - output of the host
+ * const char *format - printf format
+ *
+ * returns void
+ */
+void appendText(resultBuffer_t *buffer, const char *format, ...)
+{
+    int len;
+    va_list args;
+
+    while (1) {
+        va_start(args, format);
+        len = vsnprintf((char *)buffer->data + buffer->len, buffer->size - buffer->len, format, args);
+        va_end(args);
+
+        if (len < 0) {
+            return;
+        }
+        if ((size_t)len < buffer->size - buffer->len) {
+            buffer->len += len;
+            return;
+        }
+        growBuffer(buffer, len + 1);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Append a varbind or only its oid to the output of a host, formatted like
+ * fprint_variable / fprint_objid do
+ *
+ * resultBuffer_t *buffer - output of the host
+ * netsnmp_variable_list *var - the varbind
+ * int nameOnly - only append the oid
+ *
+ * returns void
+ */
+void appendVariable(resultBuffer_t *buffer, netsnmp_variable_list *var, int nameOnly)
+{
+    int len;
+
+    while (1) {
+        if (nameOnly) {
+            len = snprint_objid((char *)buffer->data + buffer->len, buffer->size - buffer->len, var->name, var->name_length);
+        } else {
+            len = snprint_variable((char *)buffer->data + buffer->len, buffer->size - buffer->len, var->name, var->name_length, var);
+        }
+
+        /* netsnmp does not tell the required size */
+        if (len >= 0 && (size_t)len < buffer->size - buffer->len) {
+            buffer->len += len;
+            break;
+        }
+        growBuffer(buffer, buffer->size - buffer->len + 256);
+    }
+
+    if (! nameOnly) {
+        appendText(buffer, "\n");
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Write a buffer completely to a file descriptor
+ *
+ * int fd - the file descriptor
+ * const u_char *data - the buffer
+ * size_t len - its length
+ *
+ * returns int - 0 on failure
+ */
+int writeAll(int fd, const u_char *data, size_t len)
+{
+    ssize_t written;
+
+    while (len) {
+        if ((written = write(fd, data, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        data += written;
+        len -= written;
+    }
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Write the output of a host into its file with a single write. With direct
+ * I/O the page cache is bypassed, which needs an aligned buffer of whole
+ * blocks - the file is truncated to its real length afterwards.
+ *
+ * outputJob_t *job - output of the host
+ *
+ * returns int - 0 if the output could not be written
+ */
+int writeOutput(outputJob_t *job)
+{
+    int written;
+    int fd = -1, flags = O_WRONLY | O_CREAT | O_TRUNC;
+    size_t len = job->text.len, padded = (len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+    u_char *data = job->text.data, *aligned = NULL;
+
+    if (! job->path) {
+        fflush(stdout);
+        return writeAll(STDOUT_FILENO, data, len);
+    }
+
+    /* not every file system supports direct I/O, fall back to buffered I/O */
+    if (directIo && (fd = open(job->path, flags | O_DIRECT, 0644)) >= 0) {
+        if (posix_memalign((void **)&aligned, DIRECT_IO_ALIGN, padded ? padded : DIRECT_IO_ALIGN)) {
+            close(fd);
+            fd = -1;
+            aligned = NULL;
+        } else {
+            memcpy(aligned, data, len);
+            memset(aligned + len, 0, padded - len);
+            data = aligned;
+            len = padded;
+        }
+    }
+
+    if (fd < 0 && (fd = open(job->path, flags, 0644)) < 0) {
+        perror(job->path);
+        return 0;
+    }
+
+    if (! (written = writeAll(fd, data, len) && ! (aligned && ftruncate(fd, job->text.len)) && ! (syncOutput && fdatasync(fd)))) {
+        perror(job->path);
+    }
+
+    close(fd);
+    free(aligned);
+
+    return written;
+}
+
+/*****************************************************************************/
+/*
+ * Thread function of the writer: takes all queued outputs at once and writes
+ * them, so that the workers never block on the file system and only one file
+ * is open at a time.
+ *
+ * void *arg - not used
+ *
+ * returns void *
+ */
+void *writeOutputs(void *arg)
+{
+    outputJob_t *job, *next;
+
+    while (1) {
+        pthread_mutex_lock(&writer.lock);
+        while (! writer.head && ! writer.stop) {
+            pthread_cond_wait(&writer.wake, &writer.lock);
+        }
+        job = writer.head;
+        writer.head = writer.tail = NULL;
+        writer.count = 0;
+        pthread_mutex_unlock(&writer.lock);
+
+        if (! job) {
+            return NULL;
+        }
+
+        for (; job; job = next) {
+            next = job->next;
+            if (writeOutput(job)) {
+                commitCache(&job->cacheUpdates);
+            }
+            free(job->path);
+            free(job->text.data);
+            free(job->cacheUpdates.data);
+            free(job);
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Start the thread of the writer or the COPY sink for a cycle
+ *
+ * writer_t *queue - the writer or the sink
+ * void *(*run)(void *) - thread function
+ *
+ * returns void
+ */
+void startWriter(writer_t *queue, void *(*run)(void *))
+{
+    queue->stop = 0;
+    if (pthread_create(&queue->thread, NULL, run, NULL)) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Let the writer or the COPY sink finish the queued outputs and wait for it
+ *
+ * writer_t *queue - the writer or the sink
+ *
+ * returns void
+ */
+void stopWriter(writer_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->stop = 1;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_join(queue->thread, NULL);
+}
+
+/*****************************************************************************/
+/*
+ * Hand the output of a finished host over to the writer or the COPY sink
+ *
+ * writer_t *queue - the writer or the sink
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void queueOutput(writer_t *queue, hostContext_t *hostContext)
+{
+    outputJob_t *job = calloc(1, sizeof(outputJob_t));
+
+    job->path = hostContext->outputPath;
+    job->hostId = hostContext->hostId;
+    job->text = hostContext->results;
+    job->cacheUpdates = hostContext->cacheUpdates;
+    hostContext->outputPath = NULL;
+    memset(&hostContext->results, 0, sizeof(hostContext->results));
+    memset(&hostContext->cacheUpdates, 0, sizeof(hostContext->cacheUpdates));
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    queue->count++;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*****************************************************************************/
+/*
+ * Open the binary result file and write its header: the oids of the profile,
+ * so that the column index of a record can be mapped to its oid.
+ *
+ * const char *path - path of the result file
+ *
+ * returns void
+ */
+void openResults(const char *path)
+{
+    struct oid_s *currentOid;
+    resultHeader_t header = { RESULT_MAGIC, RESULT_VERSION, polledProfile->oidCount, deltaCycle ? RESULT_DELTA : 0 };
+    static const char padding[8] = { 0 };
+    size_t len;
+
+    char tmp[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (! (results = fopen(tmp, "w"))) {
+        perror(tmp);
+        exit(1);
+    }
+
+    fwrite(&header, sizeof(header), 1, results);
+    for (currentOid = polledProfile->oids; currentOid->segment < FINISH; currentOid++) {
+        len = strlen(currentOid->Name) + 1;
+        fwrite(currentOid->Name, len, 1, results);
+        fwrite(padding, RESULT_ALIGN(len) - len, 1, results);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Find the column of a varbind, the suffix of its name is the row index.
+ * Varbinds which are not below an oid of the profile, e.g. a GETNEXT beyond
+ * the end of its table, get the column RESULT_NO_COLUMN and their whole name
+ * as index.
+ *
+ * netsnmp_variable_list *var - the varbind
+ * size_t *prefixLen - length of the name of the column
+ *
+ * returns uint16_t - index of the column within the profile
+ */
+uint16_t findColumn(netsnmp_variable_list *var, size_t *prefixLen)
+{
+    struct oid_s *currentOid, *column = NULL;
+
+    for (currentOid = polledProfile->oids; currentOid->segment < FINISH; currentOid++) {
+        if (var->name_length >= currentOid->OidLen && (! column || currentOid->OidLen > column->OidLen) &&
+            ! memcmp(var->name, currentOid->Oid, currentOid->OidLen * sizeof(oid))) {
+            column = currentOid;
+        }
+    }
+
+    *prefixLen = column ? column->OidLen : 0;
+
+    return column ? column - polledProfile->oids : RESULT_NO_COLUMN;
+}
+
+/*****************************************************************************/
+/*
+ * Append a varbind as typed record to the results of the host. Integers of
+ * all types are stored as 64 bit, object ids as 32 bit sub-identifiers and
+ * strings as is.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * netsnmp_variable_list *var - the varbind
+ *
+ * returns void
+ */
+void appendResult(hostContext_t *hostContext, netsnmp_variable_list *var)
+{
+    size_t i, prefixLen, suffixLen, valueLen = 0, len;
+    uint16_t column = findColumn(var, &prefixLen);
+    uint64_t integer;
+    uint32_t objid[MAX_OID_LEN];
+    resultRecord_t *record;
+    resultBuffer_t *buffer = &hostContext->results;
+    const void *value = &integer;
+
+    switch (var->type) {
+    case ASN_INTEGER:
+        integer = *var->val.integer;
+        valueLen = sizeof(integer);
+        break;
+    case ASN_COUNTER:
+    case ASN_GAUGE:
+    case ASN_TIMETICKS:
+        integer = (u_long)*var->val.integer & 0xffffffff;
+        valueLen = sizeof(integer);
+        break;
+    case ASN_COUNTER64:
+        integer = (uint64_t)var->val.counter64->high << 32 | (var->val.counter64->low & 0xffffffff);
+        valueLen = sizeof(integer);
+        break;
+    case ASN_OCTET_STR:
+    case ASN_IPADDRESS:
+    case ASN_OPAQUE:
+        value = var->val.string;
+        valueLen = var->val_len;
+        break;
+    case ASN_OBJECT_ID:
+        for (i = 0; i < var->val_len / sizeof(oid) && i < MAX_OID_LEN; i++) {
+            objid[i] = var->val.objid[i];
+        }
+        value = objid;
+        valueLen = i * sizeof(uint32_t);
+        break;
+    }
+
+    suffixLen = var->name_length - prefixLen > UINT8_MAX ? UINT8_MAX : var->name_length - prefixLen;
+    len = sizeof(resultRecord_t) + RESULT_ALIGN(suffixLen * sizeof(uint32_t)) + RESULT_ALIGN(valueLen);
+
+    growBuffer(buffer, len);
+    record = (resultRecord_t *)(buffer->data + buffer->len);
+    memset(record, 0, len);
+    record->length = len;
+    record->column = column;
+    record->type = var->type;
+    record->suffixLen = suffixLen;
+    for (i = 0; i < suffixLen; i++) {
+        record->suffix[i] = var->name[prefixLen + i];
+    }
+    memcpy((u_char *)record->suffix + RESULT_ALIGN(suffixLen * sizeof(uint32_t)), value, valueLen);
+
+    buffer->len += len;
+    buffer->records++;
+}
+
+/*****************************************************************************/
+/*
+ * Keep the value of a varbind for the plant summary, if it belongs to an
+ * aggregated column of the channel tables. The values are collected per
+ * channel of the host by the ifIndex, which is unique among the downstream
+ * and upstream channels of a modem.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * netsnmp_variable_list *var - the varbind
+ *
+ * returns void
+ */
+void captureChannel(hostContext_t *hostContext, netsnmp_variable_list *var)
+{
+    int field, i;
+    long ifIndex;
+    channelColumn_t *column = NULL;
+    channelRow_t *row;
+
+    /* the uptime tells a reboot from counters, which wrapped */
+    if (var->type == ASN_TIMETICKS) {
+        if (var->name_length == uptimeOidLen + 1 && ! memcmp(var->name, uptimeOid, uptimeOidLen * sizeof(oid)) && ! var->name[uptimeOidLen]) {
+            hostContext->uptime = *var->val.integer;
+        }
+        return;
+    }
+    if (var->type != ASN_INTEGER && var->type != ASN_COUNTER && var->type != ASN_GAUGE) {
+        return;
+    }
+
+    for (field = 0; field < CHANNEL_FIELDS; field++) {
+        column = &channelColumns[field];
+        if (var->name_length == column->OidLen + 1 && ! memcmp(var->name, column->Oid, column->OidLen * sizeof(oid))) {
+            break;
+        }
+    }
+    if (field == CHANNEL_FIELDS) {
+        return;
+    }
+
+    ifIndex = var->name[column->OidLen];
+    for (i = 0; i < hostContext->channelCount && hostContext->channels[i].ifIndex != ifIndex; i++);
+    if (i == hostContext->channelCount) {
+        if (! (i % 16)) {
+            hostContext->channels = realloc(hostContext->channels, (i + 16) * sizeof(channelRow_t));
+        }
+        memset(&hostContext->channels[i], 0, sizeof(channelRow_t));
+        hostContext->channels[i].ifIndex = ifIndex;
+        hostContext->channelCount++;
+    }
+
+    row = &hostContext->channels[i];
+    row->values[field] = var->type == ASN_INTEGER ? *var->val.integer : (long)((u_long)*var->val.integer & 0xffffffff);
+    row->present |= 1 << field;
+}
+
+/*****************************************************************************/
+/*
+ * Value of a field of a channel, NO_SAMPLE if the modem did not report it
+ *
+ * channelRow_t *row - the channel
+ * int field - the field
+ *
+ * returns int32_t
+ */
+int32_t channelValue(channelRow_t *row, int field)
+{
+    return row->present & 1 << field ? row->values[field] : NO_SAMPLE;
+}
+
+/*****************************************************************************/
+/*
+ * Make room for the given number of samples, all columns grow together
+ *
+ * channelSamples_t *samples - the columns
+ * size_t count - number of samples
+ *
+ * returns void
+ */
+void reserveSamples(channelSamples_t *samples, size_t count)
+{
+    int i;
+
+    if (samples->size < count) {
+        while (samples->size < count) {
+            samples->size = samples->size ? samples->size * 2 : 1024;
+        }
+        samples->frequency = realloc(samples->frequency, samples->size * sizeof(int32_t));
+        samples->power = realloc(samples->power, samples->size * sizeof(int32_t));
+        samples->snr = realloc(samples->snr, samples->size * sizeof(int32_t));
+        samples->microreflections = realloc(samples->microreflections, samples->size * sizeof(int32_t));
+        for (i = 0; i < 3; i++) {
+            samples->codewords[i] = realloc(samples->codewords[i], samples->size * sizeof(int64_t));
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Append a sample to the columns
+ *
+ * channelSamples_t *samples - the columns
+ *
+ * returns size_t - row of the new sample
+ */
+size_t appendSample(channelSamples_t *samples)
+{
+    reserveSamples(samples, samples->count + 1);
+
+    return samples->count++;
+}
+
+/*****************************************************************************/
+/*
+ * Free the columns of the samples
+ *
+ * channelSamples_t *samples - the columns
+ *
+ * returns void
+ */
+void freeSamples(channelSamples_t *samples)
+{
+    int i;
+
+    free(samples->frequency);
+    free(samples->power);
+    free(samples->snr);
+    free(samples->microreflections);
+    for (i = 0; i < 3; i++) {
+        free(samples->codewords[i]);
+    }
+    memset(samples, 0, sizeof(channelSamples_t));
+}
+
+/*****************************************************************************/
+/*
+ * The codewords a downstream channel received since the last cycle, the
+ * difference of its counters to the ones kept in the state of the host.
+ * The Counter32 differences are taken modulo 2^32, so that wrapped counters
+ * still yield a sample. Counters reset by a reboot were already forgotten.
+ *
+ * hostState_t *state - state of the host
+ * channelRow_t *row - the channel
+ * int64_t *deltas - unerrored, corrected and uncorrectable codewords, -1 if unknown
+ *
+ * returns void
+ */
+void codewordDeltas(hostState_t *state, channelRow_t *row, int64_t *deltas)
+{
+    int i;
+    uint32_t counters[3];
+    codewordCounters_t *last;
+    unsigned int fields = 1 << DS_UNERRORED | 1 << DS_CORRECTED | 1 << DS_UNCORRECTABLE;
+
+    deltas[0] = deltas[1] = deltas[2] = -1;
+    if ((row->present & fields) != fields) {
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        counters[i] = row->values[DS_UNERRORED + i];
+    }
+
+    for (i = 0; i < state->codewordCount && state->codewords[i].ifIndex != row->ifIndex; i++);
+    if (i == state->codewordCount) {
+        state->codewords = realloc(state->codewords, (i + 1) * sizeof(codewordCounters_t));
+        state->codewords[i].ifIndex = row->ifIndex;
+        memcpy(state->codewords[i].counters, counters, sizeof(counters));
+        state->codewordCount++;
+        return;
+    }
+
+    last = &state->codewords[i];
+    for (i = 0; i < 3; i++) {
+        deltas[i] = (uint32_t)(counters[i] - last->counters[i]);
+    }
+    memcpy(last->counters, counters, sizeof(counters));
+}
+
+/*****************************************************************************/
+/*
+ * Add the channels of a finished host to the columns of its worker, from
+ * which the plant summary is computed at the end of the cycle
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void aggregateHost(hostContext_t *hostContext)
+{
+    int i, j;
+    size_t n;
+    int64_t deltas[3];
+    channelRow_t *row;
+    channelSamples_t *samples;
+    hostState_t *state = hostContext->state;
+
+    /* the uptime went back: the modem rebooted and its counters start over */
+    if (hostContext->uptime && hostContext->uptime < state->uptime) {
+        state->codewordCount = 0;
+    }
+    if (hostContext->uptime) {
+        state->uptime = hostContext->uptime;
+    }
+
+    for (i = 0; i < hostContext->channelCount; i++) {
+        row = &hostContext->channels[i];
+        if (row->present & 1 << DS_FREQUENCY) {
+            samples = &hostContext->worker->downstream;
+            n = appendSample(samples);
+            samples->frequency[n] = row->values[DS_FREQUENCY];
+            samples->power[n] = channelValue(row, DS_POWER);
+            samples->snr[n] = channelValue(row, DS_SNR30) != NO_SAMPLE && row->values[DS_SNR30] ? row->values[DS_SNR30] : channelValue(row, DS_SNR);
+            samples->microreflections[n] = channelValue(row, DS_MICROREFLECTIONS);
+            codewordDeltas(state, row, deltas);
+        } else if (row->present & 1 << US_FREQUENCY) {
+            samples = &hostContext->worker->upstream;
+            n = appendSample(samples);
+            samples->frequency[n] = row->values[US_FREQUENCY];
+            samples->power[n] = channelValue(row, US_POWER);
+            samples->snr[n] = samples->microreflections[n] = NO_SAMPLE;
+            deltas[0] = deltas[1] = deltas[2] = -1;
+        } else {
+            continue;
+        }
+
+        for (j = 0; j < 3; j++) {
+            samples->codewords[j][n] = deltas[j];
+        }
+    }
+
+    free(hostContext->channels);
+    hostContext->channels = NULL;
+    hostContext->channelCount = 0;
+}
+
+/*****************************************************************************/
+/*
+ * Write the results of a finished host as one block and add it to the index.
+ * The workers share the result file, so writing is serialized.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void writeHostResults(hostContext_t *hostContext)
+{
+    resultBuffer_t *buffer = &hostContext->results;
+    resultHost_t block = { hostContext->hostId, hostContext->status, buffer->records, buffer->len };
+
+    pthread_mutex_lock(&resultLock);
+    if (resultCount == resultSize) {
+        resultSize = resultSize ? 2 * resultSize : 1024;
+        resultIndex = realloc(resultIndex, resultSize * sizeof(resultIndex_t));
+    }
+    resultIndex[resultCount].hostId = hostContext->hostId;
+    resultIndex[resultCount].length = sizeof(block) + buffer->len;
+    resultIndex[resultCount].offset = ftello(results);
+    resultCount++;
+
+    fwrite(&block, sizeof(block), 1, results);
+    fwrite(buffer->data, buffer->len, 1, results);
+
+    /* with the COPY sink the cache follows the database */
+    if (! copyConn) {
+        growBuffer(&resultCacheUpdates, hostContext->cacheUpdates.len);
+        memcpy(resultCacheUpdates.data + resultCacheUpdates.len, hostContext->cacheUpdates.data, hostContext->cacheUpdates.len);
+        resultCacheUpdates.len += hostContext->cacheUpdates.len;
+    }
+    pthread_mutex_unlock(&resultLock);
+}
+
+/*****************************************************************************/
+/*
+ * Compare two entries of the result index by host id
+ *
+ * const void *a - first entry
+ * const void *b - second entry
+ *
+ * returns int
+ */
+int compareResultIndex(const void *a, const void *b)
+{
+    uint32_t x = ((const resultIndex_t *)a)->hostId, y = ((const resultIndex_t *)b)->hostId;
+
+    return (x > y) - (x < y);
+}
+
+/*****************************************************************************/
+/*
+ * Finish the result file: the index of the host blocks, sorted by host id,
+ * and a footer pointing to it are appended, so that readers can mmap the
+ * file and search the index from its end. The file is written to a temporary
+ * file and renamed, so that readers never see a half written file.
+ *
+ * const char *path - path of the result file
+ *
+ * returns void
+ */
+void closeResults(const char *path)
+{
+    resultFooter_t footer = { 0, resultCount, RESULT_MAGIC };
+    char tmp[PATH_MAX];
+
+    qsort(resultIndex, resultCount, sizeof(resultIndex_t), compareResultIndex);
+
+    footer.indexOffset = ftello(results);
+    fwrite(resultIndex, sizeof(resultIndex_t), resultCount, results);
+    fwrite(&footer, sizeof(footer), 1, results);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (fclose(results) || rename(tmp, path)) {
+        perror(path);
+    } else {
+        commitCache(&resultCacheUpdates);
+    }
+    free(resultCacheUpdates.data);
+    memset(&resultCacheUpdates, 0, sizeof(resultCacheUpdates));
+    free(resultIndex);
+
+    results = NULL;
+    resultIndex = NULL;
+    resultCount = resultSize = 0;
+}
+
+/*****************************************************************************/
+/*
+ * Append a field of a tuple in the binary COPY format: its length in network
+ * byte order and its contents, a negative length is NULL
+ *
+ * resultBuffer_t *buffer - the COPY data
+ * const void *data - contents of the field
+ * int32_t len - length of the contents, -1 for NULL
+ *
+ * returns void
+ */
+void appendCopyField(resultBuffer_t *buffer, const void *data, int32_t len)
+{
+    uint32_t header = htonl(len);
+
+    growBuffer(buffer, sizeof(header) + (len > 0 ? len : 0));
+    memcpy(buffer->data + buffer->len, &header, sizeof(header));
+    buffer->len += sizeof(header);
+
+    if (len > 0) {
+        memcpy(buffer->data + buffer->len, data, len);
+        buffer->len += len;
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Append a record of a host as tuple (modem_id, oid, type, integer, string).
+ * Counter64 values are stored in the bigint column in two's complement, so
+ * values from 2^63 on are negative.
+ *
+ * resultBuffer_t *buffer - the COPY data
+ * uint32_t hostId - modem.id
+ * resultRecord_t *record - the record
+ *
+ * returns void
+ */
+void appendCopyTuple(resultBuffer_t *buffer, uint32_t hostId, resultRecord_t *record)
+{
+    int i, len = 0;
+    char name[MAX_OID_LEN * 11];
+    u_char *value = (u_char *)record->suffix + RESULT_ALIGN(record->suffixLen * sizeof(uint32_t));
+    int32_t valueLen = (u_char *)record + record->length - value;
+    uint16_t fields = htons(5), type = htons(record->type);
+    uint32_t id = htonl(hostId);
+    uint64_t integer;
+    u_char bigEndian[sizeof(integer)];
+
+    if (record->column != RESULT_NO_COLUMN) {
+        for (i = 0; i < (int)polledProfile->oids[record->column].OidLen; i++) {
+            len += snprintf(name + len, sizeof(name) - len, ".%lu", (u_long)polledProfile->oids[record->column].Oid[i]);
+        }
+    }
+    for (i = 0; i < record->suffixLen; i++) {
+        len += snprintf(name + len, sizeof(name) - len, ".%u", record->suffix[i]);
+    }
+
+    growBuffer(buffer, sizeof(fields));
+    memcpy(buffer->data + buffer->len, &fields, sizeof(fields));
+    buffer->len += sizeof(fields);
+
+    appendCopyField(buffer, &id, sizeof(id));
+    appendCopyField(buffer, name + 1, len - 1);
+    appendCopyField(buffer, &type, sizeof(type));
+
+    switch (record->type) {
+    case ASN_INTEGER:
+    case ASN_COUNTER:
+    case ASN_GAUGE:
+    case ASN_TIMETICKS:
+    case ASN_COUNTER64:
+        memcpy(&integer, value, sizeof(integer));
+        for (i = sizeof(integer) - 1; i >= 0; i--, integer >>= 8) {
+            bigEndian[i] = integer & 0xff;
+        }
+        appendCopyField(buffer, bigEndian, sizeof(bigEndian));
+        appendCopyField(buffer, NULL, -1);
+        break;
+    case ASN_OCTET_STR:
+    case ASN_IPADDRESS:
+    case ASN_OPAQUE:
+    case ASN_OBJECT_ID:
+        appendCopyField(buffer, NULL, -1);
+        appendCopyField(buffer, value, valueLen);
+        break;
+    default:
+        appendCopyField(buffer, NULL, -1);
+        appendCopyField(buffer, NULL, -1);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Stream the records of a batch of finished hosts into the result table with
+ * a single COPY in binary format. The data is sent in chunks while it is
+ * converted, each batch is committed on its own.
+ *
+ * outputJob_t *job - first host of the batch
+ *
+ * returns int - 0 if the batch was not committed
+ */
+int copyBatch(outputJob_t *job)
+{
+    resultRecord_t *record;
+    resultBuffer_t buffer = { 0 };
+    PGresult *result;
+    size_t offset;
+    int started, failed;
+    char query[256];
+    static const u_char header[] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+    static const u_char trailer[] = { 0xff, 0xff };
+
+    snprintf(query, sizeof(query), "COPY %s (modem_id, oid, type, integer, string) FROM STDIN (FORMAT binary)", copyTarget);
+    result = PQexec(copyConn, query);
+    failed = ! (started = PQresultStatus(result) == PGRES_COPY_IN);
+    if (failed) {
+        fprintf(stderr, "COPY failed: %s", PQerrorMessage(copyConn));
+    }
+    PQclear(result);
+
+    growBuffer(&buffer, sizeof(header) - 1);
+    memcpy(buffer.data, header, sizeof(header) - 1);
+    buffer.len = sizeof(header) - 1;
+
+    for (; job; job = job->next) {
+        for (offset = 0; ! failed && offset < job->text.len; offset += record->length) {
+            record = (resultRecord_t *)(job->text.data + offset);
+            appendCopyTuple(&buffer, job->hostId, record);
+
+            if (buffer.len >= COPY_CHUNK) {
+                failed = PQputCopyData(copyConn, (const char *)buffer.data, buffer.len) != 1;
+                buffer.len = 0;
+            }
+        }
+    }
+
+    if (! failed) {
+        growBuffer(&buffer, sizeof(trailer));
+        memcpy(buffer.data + buffer.len, trailer, sizeof(trailer));
+        buffer.len += sizeof(trailer);
+        failed = PQputCopyData(copyConn, (const char *)buffer.data, buffer.len) != 1;
+    }
+
+    /* a failed COPY is aborted, so that the batch is rolled back */
+    if (started && PQputCopyEnd(copyConn, failed ? "sending the results failed" : NULL) != 1) {
+        fprintf(stderr, "COPY failed: %s", PQerrorMessage(copyConn));
+        failed = 1;
+    }
+    while ((result = PQgetResult(copyConn))) {
+        if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+            fprintf(stderr, "COPY failed: %s", PQerrorMessage(copyConn));
+            failed = 1;
+        }
+        PQclear(result);
+    }
+
+    free(buffer.data);
+
+    return ! failed;
+}
+
+/*****************************************************************************/
+/*
+ * Thread function of the COPY sink: waits until a batch of hosts is finished
+ * or a second passed and streams them into the database, while the workers
+ * keep polling. A failed batch is copied once more, on a new connection if
+ * the connection was lost - if it fails again, its hosts are counted as
+ * dropped.
+ *
+ * void *arg - not used
+ *
+ * returns void *
+ */
+void *copyResults(void *arg)
+{
+    int stop, count;
+    outputJob_t *job, *next;
+    struct timespec until;
+
+    while (1) {
+        pthread_mutex_lock(&sink.lock);
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec++;
+        while (sink.count < COPY_BATCH && ! sink.stop && pthread_cond_timedwait(&sink.wake, &sink.lock, &until) != ETIMEDOUT);
+
+        job = sink.head;
+        sink.head = sink.tail = NULL;
+        sink.count = 0;
+        stop = sink.stop;
+        pthread_mutex_unlock(&sink.lock);
+
+        count = 0;
+        if (job && ! copyBatch(job)) {
+            if (PQstatus(copyConn) == CONNECTION_BAD) {
+                PQreset(copyConn);
+                PQclear(PQexec(copyConn, "SET search_path TO nmsprime"));
+            }
+            if (! copyBatch(job)) {
+                for (count = 0, next = job; next; next = next->next, count++);
+                fprintf(stderr, "Dropped the results of %d hosts\n", count);
+                copyFailedHosts += count;
+            }
+        }
+
+        for (; job; job = next) {
+            next = job->next;
+            if (! count) {
+                commitCache(&job->cacheUpdates);
+            }
+            free(job->text.data);
+            free(job->cacheUpdates.data);
+            free(job);
+        }
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Answer a request of the query service, which can not be polled, and close
+ * the connection
+ *
+ * int fd - the client
+ * const char *request - the request
+ * const char *reason - why the request is rejected
+ *
+ * returns void
+ */
+void rejectQuery(int fd, const char *request, const char *reason)
+{
+    char message[4352];
+    int len = snprintf(message, sizeof(message), "ERROR: %s: %s\n", request, reason);
+
+    if (send(fd, message, len < (int)sizeof(message) ? len : (int)sizeof(message) - 1, MSG_NOSIGNAL) < 0) {
+        perror("send");
+    }
+    close(fd);
+}
+
+/*****************************************************************************/
+/*
+ * Stream the output of a host of the query service to its client, each time
+ * a segment completes. The socket does not block the worker: its send buffer
+ * of QUERY_BUFFER holds the output of a modem, so a client, which went away
+ * or does not read, is dropped once it is full and the rest of the output is
+ * discarded.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void streamQuery(hostContext_t *hostContext)
+{
+    ssize_t sent;
+    size_t pos = 0;
+
+    while (hostContext->replyFd >= 0 && pos < hostContext->results.len) {
+        if ((sent = send(hostContext->replyFd, hostContext->results.data + pos, hostContext->results.len - pos, MSG_NOSIGNAL | MSG_DONTWAIT)) >= 0) {
+            pos += sent;
+        } else if (errno != EINTR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                fprintf(stderr, "%s: Client of the query service does not read, dropped\n", hostContext->peername);
+            }
+            close(hostContext->replyFd);
+            hostContext->replyFd = -1;
+        }
+    }
+
+    hostContext->results.len = 0;
+}
+
+/*****************************************************************************/
+/*
+ * Complete a host of the query service: the rest of its output is streamed
+ * and the connection closed, which tells the client the end of the output.
+ * The bulk poll continues, once no more modems are queried.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void finishQuery(hostContext_t *hostContext)
+{
+    if (hostContext->status == STAT_TIMEOUT) {
+        appendText(&hostContext->results, "%s: Timeout\n", hostContext->peername);
+    }
+    streamQuery(hostContext);
+
+    if (hostContext->replyFd >= 0) {
+        close(hostContext->replyFd);
+        hostContext->replyFd = -1;
+    }
+    free(hostContext->results.data);
+    memset(&hostContext->results, 0, sizeof(hostContext->results));
+    __atomic_fetch_sub(&queriedHosts, 1, __ATOMIC_RELAXED);
+}
+
+/*****************************************************************************/
+/*
+ * Free a host of the query service, once none of its requests is outstanding
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void freeQuery(hostContext_t *hostContext)
+{
+    if (hostContext->replyFd >= 0) {
+        close(hostContext->replyFd);
+    }
+    if (! poolSize) {
+        free(hostContext->session);
+    }
+    free(hostContext->peername);
+    free(hostContext->community);
+    free(hostContext->groupName);
+    free(hostContext->state);
+    free(hostContext->results.data);
+    free(hostContext);
+}
+
+/*****************************************************************************/
+/*
+ * Called once a segment of a host is complete. Sets the host request element
+ * of the current segment to zero, denoting that the segment is finished.
+ * Finally checks if all segments of the current host are finished. If so,
+ * decrement the activeHosts of the worker, denoting that all requests of the
+ * host are complete.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - completed segment
+ *
+ * returns void
+ */
+void updateActiveHosts(hostContext_t *hostContext, pass_t segment)
+{
+    int shard;
+    static const long zero[FINISH] = { 0 };
+
+    if (segment < FINISH) {
+        hostContext->requestIds[segment] = 0;
+    }
+    if (hostContext->queried) {
+        streamQuery(hostContext);
+    }
+
+    if (! hostContext->finished && hostContext->nextSegment == FINISH && ! memcmp(zero, hostContext->requestIds, sizeof(zero))) {
+        hostContext->finished = 1;
+        hostContext->worker->activeHosts--;
+        if (hostContext->credential && hostContext->state->engineIDLen) {
+            saveEngineTime(hostContext);
+        }
+        if (hostContext->status) {
+            hostContext->worker->metrics.failedHosts++;
+        }
+        timerCancel(&hostContext->worker->timers, &hostContext->deadline);
+        free(hostContext->columns);
+        hostContext->columns = NULL;
+        if (hostContext->queried) {
+            finishQuery(hostContext);
+            return;
+        }
+        if (shardCount) {
+            shard = hostContext->hostId % shardCount;
+            hostContext->worker->shardDone[shard] = usSince(&cycleStart);
+        }
+        if (summaryPath) {
+            aggregateHost(hostContext);
+        }
+        if (results) {
+            writeHostResults(hostContext);
+        }
+        if (copyConn) {
+            queueOutput(&sink, hostContext);
+        } else if (! recordResults) {
+            queueOutput(&writer, hostContext);
+        }
+        free(hostContext->results.data);
+        free(hostContext->cacheUpdates.data);
+        memset(&hostContext->results, 0, sizeof(hostContext->results));
+        memset(&hostContext->cacheUpdates, 0, sizeof(hostContext->cacheUpdates));
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Called if a request of a host failed (timeout, error or unexpected source).
+ * The segment of the request is complete and the segments of the host, which
+ * were not sent yet, are skipped.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment of the failed request
+ *
+ * returns void
+ */
+void failSegment(hostContext_t *hostContext, pass_t segment)
+{
+    hostContext->nextSegment = FINISH;
+    updateActiveHosts(hostContext, segment);
+}
+
+/*****************************************************************************/
+/*
+ * Called for every completed request (response or timeout), which frees its
+ * slot in the window of the worker and of the group of the host.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void completeRequest(hostContext_t *hostContext)
+{
+    hostContext->worker->inFlight--;
+    hostContext->group->inFlight--;
+}
+
+/*****************************************************************************/
+/*
+ * Cancel the outstanding requests of a host. Requests of the raw transport are
+ * released from their slots. netsnmp cannot cancel a single request, so they
+ * stay outstanding, until they are answered or time out - their callback
+ * ignores them, as the host is finished, and the worker waits for them.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void cancelRequests(hostContext_t *hostContext)
+{
+    long index;
+    pass_t segment;
+    requestSlot_t *slot;
+    worker_t *worker = hostContext->worker;
+
+    for (segment = NON_REP; rawTransport && segment < FINISH; segment++) {
+        if (hostContext->requestIds[segment] <= 0 || (index = (hostContext->requestIds[segment] - 1) % MAX_SLOTS) >= worker->slotCount) {
+            continue;
+        }
+        slot = &worker->slots[index / SLOT_CHUNK][index % SLOT_CHUNK];
+        if (slot->host == hostContext && slot->reqid == hostContext->requestIds[segment]) {
+            releaseSlot(slot);
+            completeRequest(hostContext);
+        }
+    }
+
+    memset(hostContext->requestIds, 0, sizeof(hostContext->requestIds));
+}
+
+/*****************************************************************************/
+/*
+ * Give up a host, which did not make progress until its deadline. Its
+ * outstanding requests are cancelled and its remaining segments skipped.
+ *
+ * pollTimer_t *timer - deadline of the host
+ *
+ * returns void
+ */
+void hostDeadline(pollTimer_t *timer)
+{
+    hostContext_t *hostContext = containerOf(timer, hostContext_t, deadline);
+
+    fprintf(stdout, "%s: Deadline exceeded\n", hostContext->peername);
+    hostContext->worker->metrics.deadlines++;
+    hostContext->status = STAT_TIMEOUT;
+    if (hostContext->state && ! hostContext->responded) {
+        hostContext->state->dead = 1;
+    }
+
+    cancelRequests(hostContext);
+    hostContext->parked = 0;
+    failSegment(hostContext, FINISH);
+}
+
+/*****************************************************************************/
+/*
+ * Returns the first segment starting at the given one, which has OIDs to be
+ * requested
+ *
+ * profile_t *profile - profile of the host
+ * pass_t segment - first segment to check
+ *
+ * returns pass_t
+ */
+pass_t nextRequestedSegment(profile_t *profile, pass_t segment)
+{
+    while (segment < FINISH && ! profile->requests[segment]) {
+        segment++;
+    }
+
+    return segment;
+}
+
+/*****************************************************************************/
+/*
+ * Learn the capabilities of the modem from the response of the NON_REP
+ * segment. A capability is known, once the response contains one of its
+ * probes, and is present, if any probe shows it - a probe answered with an
+ * exception only makes it known. The result is kept in the
+ * state of the host, so that profiles without the probes benefit as well.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * netsnmp_variable_list *varlist - varbinds of the response
+ *
+ * returns void
+ */
+void learnCapabilities(hostContext_t *hostContext, netsnmp_variable_list *varlist)
+{
+    int known = 0, present = 0;
+    capabilityProbe_t *probe;
+
+    hostContext->probed = hostContext->profile->probedCapabilities;
+    if (! hostContext->state) {
+        return;
+    }
+
+    for (; varlist; varlist = varlist->next_variable) {
+        for (probe = capabilityProbes; probe->capability; probe++) {
+            if (varlist->name_length < probe->OidLen || memcmp(varlist->name, probe->Oid, probe->OidLen * sizeof(oid))) {
+                continue;
+            }
+
+            /* a modem without the object answers an exception with the requested oid */
+            if (varlist->type == SNMP_ENDOFMIBVIEW || varlist->type == SNMP_NOSUCHOBJECT || varlist->type == SNMP_NOSUCHINSTANCE) {
+                known |= probe->capability;
+            } else if (! probe->minValue) {
+                known |= probe->capability;
+                present |= probe->capability;
+            } else if (varlist->type == ASN_INTEGER) {
+                known |= probe->capability;
+                present |= *varlist->val.integer >= probe->minValue ? probe->capability : 0;
+            }
+        }
+    }
+
+    hostContext->state->knownCapabilities |= known;
+    hostContext->state->capabilities = (hostContext->state->capabilities & ~known) | present;
+}
+
+/*****************************************************************************/
+/*
+ * Decide whether a segment of the host is sent, skipped or has to wait for the
+ * NON_REP response. A host, which did not respond last time, is only probed by
+ * the NON_REP segment, until it responds. Segments without requirements are
+ * always sent. If the NON_REP segment probes a required capability, the
+ * response of this run decides, otherwise the capabilities known from previous
+ * runs. Segments of modems with unknown capabilities are sent.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment to be sent
+ *
+ * returns int - 1 to send, 0 to skip, -1 to wait
+ */
+int admitSegment(hostContext_t *hostContext, pass_t segment)
+{
+    int required = segmentRequires[segment];
+    hostState_t *state = hostContext->state;
+
+    /* wait, unless sending the NON_REP segment failed */
+    if (segment != NON_REP && state && state->dead && ! hostContext->responded && hostContext->requestIds[NON_REP]) {
+        return -1;
+    }
+
+    if (! required) {
+        return 1;
+    }
+
+    if (required & hostContext->profile->probedCapabilities & ~hostContext->probed && hostContext->requestIds[NON_REP]) {
+        return -1;
+    }
+
+    if (state && (state->knownCapabilities & required) == required) {
+        return (state->capabilities & required) == required;
+    }
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Remove the first host from the admission queue of the group
+ *
+ * hostGroup_t *group - the group
+ *
+ * returns void
+ */
+void dequeueHost(hostGroup_t *group)
+{
+    if (! (group->head = group->head->next)) {
+        group->tail = NULL;
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Append the host to the admission queue of its group
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void enqueueHost(hostContext_t *hostContext)
+{
+    hostGroup_t *group = hostContext->group;
+
+    hostContext->next = NULL;
+    if (group->tail) {
+        group->tail->next = hostContext;
+    } else {
+        group->head = hostContext;
+    }
+    group->tail = hostContext;
+}
+
+/*****************************************************************************/
+/*
+ * Append the host to the admission queue of its group, all its segments are
+ * sent by the scheduler.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void queueHost(hostContext_t *hostContext)
+{
+    hostContext->nextSegment = nextRequestedSegment(hostContext->profile, NON_REP);
+    enqueueHost(hostContext);
+}
+
+/*****************************************************************************/
+/*
+ * Expire function of the start of a host, whose start is spread across the
+ * interval of the daemon mode
+ *
+ * pollTimer_t *timer - start timer of the host
+ *
+ * returns void
+ */
+void hostStart(pollTimer_t *timer)
+{
+    queueHost(containerOf(timer, hostContext_t, start));
+}
+
+/*****************************************************************************/
+/*
+ * Requeue a host, which waited for the response of its NON_REP segment
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void resumeHost(hostContext_t *hostContext)
+{
+    if (hostContext->parked) {
+        hostContext->parked = 0;
+        enqueueHost(hostContext);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Refill the token bucket according to the elapsed time. At most a burst of
+ * 50ms worth of requests is accumulated, so that the requests are paced.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void refillTokens(worker_t *worker)
+{
+    struct timeval now, delta;
+    double burst = worker->rate / 20 + 1;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &worker->refilled, &delta);
+    worker->refilled = now;
+
+    worker->tokens += (delta.tv_sec + delta.tv_usec / 1e6) * worker->rate;
+    if (worker->tokens > burst) {
+        worker->tokens = burst;
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Whether the bulk poll of the worker is paused, because the query service
+ * polls a modem. The pauses of a cycle are limited to QUERY_PAUSE, so that a
+ * stream of queries can not stall the bulk poll.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns int
+ */
+int pausedByService(worker_t *worker)
+{
+    int queried = ! worker->service && __atomic_load_n(&queriedHosts, __ATOMIC_RELAXED);
+
+    if (queried && ! timerisset(&worker->pausedSince)) {
+        gettimeofday(&worker->pausedSince, NULL);
+    } else if (! queried && timerisset(&worker->pausedSince)) {
+        worker->paused += usSince(&worker->pausedSince);
+        timerclear(&worker->pausedSince);
+    }
+
+    return queried && worker->paused + usSince(&worker->pausedSince) < QUERY_PAUSE * 1000L;
+}
+
+/*****************************************************************************/
+/*
+ * Milliseconds until the token bucket allows to send the next request, at
+ * most the given maximum. Returns the maximum if the rate is not limited or
+ * there are no hosts waiting. A worker paused by the query service checks
+ * again after QUERY_POLL.
+ *
+ * worker_t *worker - the worker
+ * int max - upper bound in milliseconds
+ *
+ * returns int
+ */
+int nextAdmissionMs(worker_t *worker, int max)
+{
+    int i, ms;
+
+    if (pausedByService(worker)) {
+        return max < QUERY_POLL ? max : QUERY_POLL;
+    }
+
+    if (! worker->rate || worker->tokens >= 1) {
+        return max;
+    }
+
+    for (i = 0; i < worker->groupCount; i++) {
+        if (worker->groups[i]->head) {
+            ms = (1 - worker->tokens) / worker->rate * 1000 + 1;
+            return ms < max ? ms : max;
+        }
+    }
+
+    return max;
+}
+
+/*****************************************************************************/
+/*
+ * The scheduler: sends the queued segments of the hosts, as long as the
+ * window of outstanding requests, the limit of the group and the token bucket
+ * allow. Groups are served round robin, within a group hosts are served in
+ * order, so that the segments of a host are sent together. Segments the
+ * modem lacks the capabilities for are skipped, a host waiting for its
+ * capabilities leaves the queue until the NON_REP response, an SNMPv3 host
+ * until its engine is discovered. While the query service polls a modem,
+ * the bulk poll sends no new segments and only continues its tables, for at
+ * most QUERY_PAUSE per cycle. Called on startup, each time a request
+ * completed and whenever the event loop wakes up.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void admitRequests(worker_t *worker)
+{
+    int i, admit;
+    long reqid = 0;
+    pass_t segment;
+    hostGroup_t *group = NULL;
+    hostContext_t *hostContext;
+    struct snmp_pdu *request;
+
+    if (pausedByService(worker)) {
+        return;
+    }
+
+    if (worker->rate) {
+        refillTokens(worker);
+    }
+
+    while (! worker->window || worker->inFlight < worker->window) {
+        if (worker->rate && worker->tokens < 1) {
+            return;
+        }
+
+        for (i = 0; i < worker->groupCount; i++) {
+            group = worker->groups[(worker->nextGroup + i) % worker->groupCount];
+            if (group->head && (! worker->groupLimit || group->inFlight < worker->groupLimit)) {
+                break;
+            }
+        }
+        if (i == worker->groupCount) {
+            return;
+        }
+        worker->nextGroup = (worker->nextGroup + i + 1) % worker->groupCount;
+
+        hostContext = group->head;
+
+        /* an SNMPv3 host leaves the queue until its engine is discovered */
+        if (hostContext->credential && ! hostContext->state->engineIDLen) {
+            dequeueHost(group);
+            if (discoverEngine(hostContext)) {
+                hostContext->parked = 1;
+            } else {
+                hostContext->status = STAT_ERROR;
+                failSegment(hostContext, FINISH);
+            }
+            worker->tokens--;
+            continue;
+        }
+
+        if ((segment = hostContext->nextSegment) < FINISH) {
+            if ((admit = admitSegment(hostContext, segment)) < 0) {
+                dequeueHost(group);
+                hostContext->parked = 1;
+                continue;
+            }
+
+            hostContext->nextSegment = nextRequestedSegment(hostContext->profile, segment + 1);
+            if (admit && rawTransport) {
+                reqid = sendRawRequest(hostContext, segment);
+                worker->tokens--;
+            } else if (admit) {
+                request = snmp_clone_pdu(hostContext->profile->requests[segment]);
+                if (segment != NON_REP) {
+                    request->max_repetitions = getRepetitions(hostContext, segment);
+                }
+                reqid = sendRequest(hostContext, segment, request);
+                worker->tokens--;
+            }
+
+            /* a segment, which could not be sent, fails the host instead of missing in its output */
+            if (admit && reqid <= 0) {
+                dequeueHost(group);
+                hostContext->status = STAT_ERROR;
+                failSegment(hostContext, segment);
+                continue;
+            }
+            if (admit) {
+                hostContext->requestIds[segment] = reqid;
+            }
+        }
+
+        /* all segments of the host are sent */
+        if (hostContext->nextSegment == FINISH) {
+            dequeueHost(group);
+            updateActiveHosts(hostContext, FINISH);
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Find the group of the given name within the worker, create it if needed
+ *
+ * worker_t *worker - the worker
+ * const char *name - value of the group column
+ *
+ * returns hostGroup_t *
+ */
+hostGroup_t *getGroup(worker_t *worker, const char *name)
+{
+    int i;
+
+    for (i = 0; i < worker->groupCount; i++) {
+        if (! strcmp(worker->groups[i]->name, name)) {
+            return worker->groups[i];
+        }
+    }
+
+    worker->groups = realloc(worker->groups, (worker->groupCount + 1) * sizeof(hostGroup_t *));
+    worker->groups[worker->groupCount] = calloc(1, sizeof(hostGroup_t));
+    worker->groups[worker->groupCount]->name = strdup(name);
+
+    return worker->groups[worker->groupCount++];
+}
+
+/*****************************************************************************/
+/*
+ * Replies on a shared socket are matched to the host by their request id.
+ * Additionally make sure the response was sent by the host the request was
+ * addressed to.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * struct snmp_pdu *responseData - response packet with data from modem
+ *
+ * returns int
+ */
+int isExpectedSource(hostContext_t *hostContext, struct snmp_pdu *responseData)
+{
+    netsnmp_indexed_addr_pair *source = responseData->transport_data;
+
+    if (! hostContext->address) {
+        return 1;
+    }
+
+    if (! source || responseData->transport_data_length < (int)sizeof(struct sockaddr_in)) {
+        return 0;
+    }
+
+    return source->remote_addr.sin.sin_addr.s_addr == hostContext->address->remote_addr.sin.sin_addr.s_addr &&
+           source->remote_addr.sin.sin_port == hostContext->address->remote_addr.sin.sin_port;
+}
+
+/*****************************************************************************/
+/*
+ * Configure a session for SNMPv3. The engine is not probed when the session
+ * is opened, as this would block for a round trip - the engine of each host
+ * is discovered asynchronously and cached instead. The user and the engineID
+ * are set per PDU.
+ *
+ * struct snmp_session *session - session parameters
+ * char *name - security name
+ * int level - security level
+ *
+ * returns void
+ */
+void setSessionSecurity(struct snmp_session *session, char *name, int level)
+{
+    session->version = SNMP_VERSION_3;
+    session->securityModel = SNMP_SEC_MODEL_USM;
+    session->securityName = name;
+    session->securityNameLen = strlen(name);
+    session->securityLevel = level;
+    session->flags |= SNMP_FLAGS_DONT_PROBE;
+}
+
+/*****************************************************************************/
+/*
+ * Open the pool of shared sockets. Each socket is a netsnmp session, which is
+ * not bound to a host - the destination is attached to each PDU instead. As
+ * the replies of thousands of hosts arrive on few sockets, the receive buffer
+ * is increased.
+ *
+ * worker_t *worker - worker owning the pool
+ * sessionContext_t *pool - array of poolSize sessions to be filled
+ *
+ * returns void
+ */
+void openSocketPool(worker_t *worker, sessionContext_t *pool)
+{
+    int i, size = SOCKET_BUFFER;
+    struct snmp_session session;
+    netsnmp_transport *transport;
+
+    for (i = 0; i < poolSize; i++) {
+        if (rawTransport) {
+            if (! openRawSocket(worker, &pool[i])) {
+                perror("socket");
+                exit(1);
+            }
+            if (setsockopt(pool[i].fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) {
+                perror("setsockopt");
+            }
+            continue;
+        }
+
+        snmp_sess_init(&session);
+        session.version = SNMP_VERSION_2c;
+        session.retries = RETRIES;
+        session.timeout = TIMEOUT * 1000000;
+        session.peername = "0.0.0.0";
+        session.community = (u_char *)"public";
+        session.community_len = strlen("public");
+        session.callback = asyncResponse;
+        if (securityName) {
+            setSessionSecurity(&session, (char *)securityName, SNMP_SEC_LEVEL_NOAUTH);
+        }
+
+        if (! openSession(worker, &pool[i], &session)) {
+            snmp_perror("snmp_open");
+            exit(1);
+        }
+
+        transport = snmp_sess_transport(pool[i].handle ? pool[i].handle : snmp_sess_pointer(pool[i].session));
+        if (setsockopt(transport->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) {
+            perror("setsockopt");
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Connect to the nmsprime SQL database
+ *
+ * const char *hostname - SQL hostname
+ * const char *username - database username
+ * const char *password - database password
+ * const char *database - SQL database
+ *
+ * returns PGconn*
+ */
+PGconn* connectToSql(const char *hostname, const char *username, const char *password, const char *database)
+{
+    const char *keywords[] = {
+        "host",
+        "dbname",
+        "user",
+        "password",
+        NULL
+    };
+    const char *values[] = {
+        hostname ? hostname : "localhost",
+        database ? database : "nmsprime",
+        username ? username : "nmsprime",
+        password ? password : "nmsprime",
+        NULL
+    };
+
+    PGconn* conn = PQconnectdbParams(keywords, values, 0);
+    if (PQstatus(conn) == CONNECTION_BAD) {
+        fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(conn));
+        PQfinish(conn);
+        exit(1);
+    }
+
+    return conn;
+}
+
+/*****************************************************************************/
+/*
+ * Quote an optionally schema qualified name as identifier for a query, each
+ * part on its own, so that it can not inject SQL
+ *
+ * PGconn *conn - SQL connection, its encoding is used
+ * const char *name - the name, e.g. schema.table
+ *
+ * returns char * - the quoted name, to be freed
+ */
+char *quoteIdentifier(PGconn *conn, const char *name)
+{
+    const char *dot = strchr(name, '.');
+    char *schema, *identifier, *quoted;
+
+    if (! dot) {
+        if (! (identifier = PQescapeIdentifier(conn, name, strlen(name)))) {
+            fprintf(stderr, "Invalid identifier %s: %s", name, PQerrorMessage(conn));
+            exit(1);
+        }
+        quoted = strdup(identifier);
+        PQfreemem(identifier);
+        return quoted;
+    }
+
+    schema = PQescapeIdentifier(conn, name, dot - name);
+    if (! schema || ! (identifier = PQescapeIdentifier(conn, dot + 1, strlen(dot + 1)))) {
+        fprintf(stderr, "Invalid identifier %s: %s", name, PQerrorMessage(conn));
+        exit(1);
+    }
+    quoted = malloc(strlen(schema) + strlen(identifier) + 2);
+    sprintf(quoted, "%s.%s", schema, identifier);
+    PQfreemem(schema);
+    PQfreemem(identifier);
+
+    return quoted;
+}
+
+/*****************************************************************************/
+/*
+ * Whether a name is a plain column, optionally qualified by its table and
+ * schema, which can be put into a query as is
+ *
+ * const char *name - the name, e.g. netelement.id
+ *
+ * returns int
+ */
+int isColumnName(const char *name)
+{
+    int parts;
+
+    for (parts = 1; parts <= 3; parts++, name++) {
+        if (! isalpha((unsigned char)*name) && *name != '_') {
+            return 0;
+        }
+        for (name++; isalnum((unsigned char)*name) || *name == '_'; name++);
+        if (*name != '.') {
+            return ! *name;
+        }
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/*
+ * Parse the argument of -k: shard_index/shard_count polls a fixed shard of
+ * the modems, shard_count alone leases the shards through the database. The
+ * shard of a modem is its modem.id modulo shard_count.
+ *
+ * const char *arg - the argument
+ *
+ * returns void
+ */
+void parseShards(const char *arg)
+{
+    int i;
+    const char *slash = strchr(arg, '/');
+
+    shardCount = atoi(slash ? slash + 1 : arg);
+    shardIndex = slash ? atoi(arg) : -1;
+
+    if (shardCount < 1 || shardCount > MAX_SHARDS || (slash && (shardIndex < 0 || shardIndex >= shardCount))) {
+        fprintf(stderr, "Invalid shards %s, expected shard_index/shard_count or shard_count up to %d.\n", arg, MAX_SHARDS);
+        exit(1);
+    }
+
+    /* the node is named after the host, it is part of the SQL statements */
+    if (! slash && (gethostname(nodeName, sizeof(nodeName)) ||
+                    strspn(nodeName, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_") != strlen(nodeName))) {
+        fprintf(stderr, "The host name is not usable as name of the node: %s\n", nodeName);
+        exit(1);
+    }
+    shardCompletion = malloc(shardCount * sizeof(long));
+    for (i = 0; i < shardCount; i++) {
+        shardCompletion[i] = -1;
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Create the tables of the nodes and the leases of the shards, unless they
+ * exist
+ *
+ * PGconn *conn - SQL connection
+ *
+ * returns void
+ */
+void initLeases(PGconn *conn)
+{
+    PGresult *result = PQexec(conn, "CREATE TABLE IF NOT EXISTS modempoller_node (node text PRIMARY KEY, expires timestamptz NOT NULL);"
+                              "CREATE TABLE IF NOT EXISTS modempoller_lease (shard integer PRIMARY KEY, node text, expires timestamptz, completed real, completed_at timestamptz);");
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Could not create the lease tables: %s", PQerrorMessage(conn));
+        exit(1);
+    }
+    PQclear(result);
+}
+
+/*****************************************************************************/
+/*
+ * Renew the leases of the node before each cycle and rebalance the shards:
+ * each live node owns its fair share of them. A node, which owns more, releases
+ * its highest shards, a node, which owns less, takes the free and expired ones.
+ * Nodes joining or leaving are noticed this way - a node, which left, is no
+ * longer live and its leases expire after LEASE_INTERVALS intervals. The host
+ * query only selects the modems of the shards leased to the node.
+ *
+ * PGconn *conn - SQL connection
+ *
+ * returns void
+ */
+void leaseShards(PGconn *conn)
+{
+    char sql[4096], fairShare[256];
+    PGresult *result;
+
+    snprintf(fairShare, sizeof(fairShare), "(SELECT (%d + count(*) - 1) / count(*) FROM modempoller_node WHERE expires > now())", shardCount);
+    snprintf(sql, sizeof(sql),
+             "INSERT INTO modempoller_lease (shard) SELECT generate_series(0, %d) ON CONFLICT DO NOTHING;"
+             "INSERT INTO modempoller_node VALUES ('%s', now() + interval '%d seconds') ON CONFLICT (node) DO UPDATE SET expires = EXCLUDED.expires;"
+             "UPDATE modempoller_lease SET node = NULL, expires = NULL WHERE shard IN "
+             "(SELECT shard FROM modempoller_lease WHERE node = '%s' ORDER BY shard OFFSET %s);"
+             "UPDATE modempoller_lease SET node = '%s', expires = now() + interval '%d seconds' WHERE shard IN "
+             "(SELECT shard FROM modempoller_lease WHERE node = '%s' OR node IS NULL OR expires < now() "
+             "ORDER BY node IS NOT DISTINCT FROM '%s' DESC, shard LIMIT %s FOR UPDATE SKIP LOCKED);",
+             shardCount - 1, nodeName, LEASE_INTERVALS * interval, nodeName, fairShare,
+             nodeName, LEASE_INTERVALS * interval, nodeName, nodeName, fairShare);
+
+    /* on failure the leases, which did not expire yet, are polled */
+    result = PQexec(conn, sql);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Could not lease the shards: %s", PQerrorMessage(conn));
+    }
+    PQclear(result);
+}
+
+/*****************************************************************************/
+/*
+ * Report the completion time of each leased shard of the last cycle in the
+ * lease table, so that the load of the nodes can be compared.
+ *
+ * PGconn *conn - SQL connection
+ *
+ * returns void
+ */
+void reportShards(PGconn *conn)
+{
+    int i, count = 0;
+    resultBuffer_t sql = { NULL };
+    PGresult *result;
+
+    appendText(&sql, "UPDATE modempoller_lease AS lease SET completed = done.seconds, completed_at = now() FROM (VALUES ");
+    for (i = 0; i < shardCount; i++) {
+        if (shardCompletion[i] >= 0) {
+            appendText(&sql, "%s(%d, %.3f)", count++ ? ", " : "", i, shardCompletion[i] / 1e6);
+        }
+    }
+    appendText(&sql, ") AS done (shard, seconds) WHERE lease.shard = done.shard AND lease.node = '%s';", nodeName);
+
+    if (count) {
+        result = PQexec(conn, (char *)sql.data);
+        if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+            fprintf(stderr, "Could not report the shards: %s", PQerrorMessage(conn));
+        }
+        PQclear(result);
+    }
+    free(sql.data);
+}
+
+/*****************************************************************************/
+/*
+ * Append the response to the text output of the host, which is written into
+ * a file inside the current working directory once the host is finished, or
+ * append its varbinds to the records of the host for the binary result file.
+ *
+ * int status - state of the Response
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * struct snmp_pdu *responseData
+ *
+ * returns int
+ */
+int processResult(int status, hostContext_t *hostContext, struct snmp_pdu *responseData)
+{
+    struct variable_list *currentVariable;
+    int ix;
+
+    if (status != STAT_SUCCESS) {
+        hostContext->status = status;
+    } else if (responseData->errstat != SNMP_ERR_NOERROR) {
+        hostContext->status = STAT_ERROR;
+    }
+
+    if (recordResults && ! hostContext->queried && status == STAT_SUCCESS) {
+        for (currentVariable = responseData->variables; currentVariable; currentVariable = currentVariable->next_variable) {
+            hostContext->worker->metrics.varbinds++;
+            if (summaryPath) {
+                captureChannel(hostContext, currentVariable);
+            }
+            if (cache && ! valueChanged(hostContext, currentVariable)) {
+                hostContext->worker->metrics.unchanged++;
+                continue;
+            }
+            appendResult(hostContext, currentVariable);
+        }
+        return 1;
+    }
+
+    switch (status) {
+    case STAT_SUCCESS:
+        currentVariable = responseData->variables;
+        if (responseData->errstat == SNMP_ERR_NOERROR) {
+            for (; currentVariable; currentVariable = currentVariable->next_variable) {
+                hostContext->worker->metrics.varbinds++;
+                if (hostContext->queried) {
+                    appendVariable(&hostContext->results, currentVariable, 0);
+                    continue;
+                }
+                if (summaryPath) {
+                    captureChannel(hostContext, currentVariable);
+                }
+                if (cache && ! valueChanged(hostContext, currentVariable)) {
+                    hostContext->worker->metrics.unchanged++;
+                    continue;
+                }
+                appendVariable(&hostContext->results, currentVariable, 0);
+            }
+        } else {
+            for (ix = 1; currentVariable && ix != responseData->errindex;
+                 currentVariable = currentVariable->next_variable, ix++);
+
+            appendText(&hostContext->results, "ERROR: %s: ", hostContext->peername);
+            if (currentVariable) {
+                appendVariable(&hostContext->results, currentVariable, 1);
+            }
+            appendText(&hostContext->results, ": %s\n", snmp_errstring(responseData->errstat));
+
+        }
+        return 1;
+    case STAT_TIMEOUT:
+        fprintf(stdout, "%s: Timeout\n", hostContext->peername);
+        return 0;
+    case STAT_ERROR:
+        snmp_perror(hostContext->peername);
+        return 0;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/*
+ * Decode the OIDs of a profile, count them per segment and create the first
+ * request of each segment, which is cloned for every host. The capability
+ * probes have to be decoded before.
+ *
+ * profile_t *profile - the profile
+ *
+ * returns void
+ */
+void initProfile(profile_t *profile)
+{
+    int i;
+    struct oid_s *currentOid;
+    capabilityProbe_t *probe;
+
+    for (currentOid = profile->oids; currentOid->segment < FINISH; currentOid++) {
+        currentOid->OidLen = MAX_OID_LEN;
+        if (! read_objid(currentOid->Name, currentOid->Oid, &currentOid->OidLen)) {
+            snmp_perror("read_objid");
+            printf("Could not Parse OID: %s\n", currentOid->Name);
+            exit(1);
+        }
+
+        profile->itemCount[currentOid->segment]++;
+        profile->oidCount++;
+    }
+
+    /* the probe is part of the response, if the NON_REP segment requests the object or one below it */
+    for (probe = capabilityProbes; probe->capability; probe++) {
+        for (currentOid = profile->oids; currentOid->segment == NON_REP; currentOid++) {
+            if (currentOid->OidLen >= probe->OidLen && ! memcmp(currentOid->Oid, probe->Oid, probe->OidLen * sizeof(oid))) {
+                profile->probedCapabilities |= probe->capability;
+            }
+        }
+    }
+
+    for (i = NON_REP; i < FINISH; i++) {
+        if (! profile->itemCount[i]) {
+            profile->requests[i] = 0;
+            continue;
+        }
+
+        if (i == NON_REP) {
+            profile->requests[i] = snmp_pdu_create(SNMP_MSG_GETNEXT);
+        } else {
+            profile->requests[i] = snmp_pdu_create(SNMP_MSG_GETBULK);
+            profile->requests[i]->non_repeaters = 0;
+            profile->requests[i]->max_repetitions = repetitions[i];
+        }
+    }
+
+    for (currentOid = profile->oids; currentOid->segment != FINISH; currentOid++) {
+        snmp_add_null_var(profile->requests[currentOid->segment], currentOid->Oid, currentOid->OidLen);
+    }
+
+    if (rawTransport) {
+        buildTemplates(profile);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Release the requests and templates of a profile
+ *
+ * profile_t *profile - the profile
+ *
+ * returns void
+ */
+void freeProfile(profile_t *profile)
+{
+    int i;
+
+    for (i = NON_REP; i < FINISH; i++) {
+        snmp_free_pdu(profile->requests[i]);
+        free(profile->templates[i]);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Merge two lists of oids, both ordered by segment, into a new list. The oids
+ * of the second list follow the ones of the same segment of the first list.
+ *
+ * oid_t *oids - the first list
+ * oid_t *extra - the second list
+ *
+ * returns oid_t * - the merged list, which is never freed
+ */
+oid_t *mergeOids(oid_t *oids, oid_t *extra)
+{
+    int count = 0, i = 0;
+    oid_t *merged;
+
+    for (; oids[count].segment != FINISH; count++);
+    for (; extra[i].segment != FINISH; i++);
+    merged = calloc(count + i + 1, sizeof(oid_t));
+
+    for (i = 0; oids->segment != FINISH || extra->segment != FINISH; i++) {
+        merged[i] = oids->segment <= extra->segment ? *oids++ : *extra++;
+    }
+    merged[i].segment = FINISH;
+
+    return merged;
+}
+
+/*****************************************************************************/
+/*
+ * This function sets the prerequisorities for the polling algorithm.
+ * It does several things:
+ * - Initializes the NET-SNMP library
+ * - Set (increase) the limit for opened files (rlimit)
+ * - Sets Configuration for NET-SNMP
+ * - Decodes OIDs and fills OID structure
+ * - Counts the number of OIDs for each segment
+ * - Adds the columns of the plant summary to the polled oids
+ * - Decodes the profile of the query service once, instead of per request
+ *
+ * returns void
+ */
+void initialize()
+{
+    int i;
+    capabilityProbe_t *probe;
+    struct rlimit lim = { 1024 * 1024, 1024 * 1024 };
+
+    if (setrlimit(RLIMIT_NOFILE, &lim)) {
+        perror("\nsetrlimit");
+        fprintf(stderr, "You need to have superuser privileges to set a new file limit!\n");
+        fprintf(stderr, "This program will most likely fail with more than 1000 Hosts!\n");
+        fprintf(stderr, "Continuing anyway...\n\n");
+    }
+
+    /* initialize library */
+    init_snmp("asynchapp");
+    netsnmp_ds_set_int(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_OID_OUTPUT_FORMAT, NETSNMP_OID_OUTPUT_NUMERIC);
+    netsnmp_ds_set_boolean(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_QUICK_PRINT, 1);
+    netsnmp_ds_set_boolean(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_NUMERIC_TIMETICKS, 1);
+    netsnmp_ds_set_int(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_HEX_OUTPUT_LENGTH, 0);
+
+    for (i = 0; summaryPath && i < CHANNEL_FIELDS; i++) {
+        channelColumns[i].OidLen = MAX_OID_LEN;
+        if (! read_objid(channelColumns[i].Name, channelColumns[i].Oid, &channelColumns[i].OidLen)) {
+            snmp_perror("read_objid");
+            printf("Could not Parse OID: %s\n", channelColumns[i].Name);
+            exit(1);
+        }
+    }
+    if (summaryPath && ! read_objid(oids_summary[0].Name, uptimeOid, &uptimeOidLen)) {
+        snmp_perror("read_objid");
+        printf("Could not Parse OID: %s\n", oids_summary[0].Name);
+        exit(1);
+    }
+    if (summaryPath) {
+        bulkProfile.oids = mergeOids(oids_multiple, oids_summary);
+    }
+
+    for (probe = capabilityProbes; probe->capability; probe++) {
+        probe->OidLen = MAX_OID_LEN;
+        if (! read_objid(probe->Name, probe->Oid, &probe->OidLen)) {
+            snmp_perror("read_objid");
+            printf("Could not Parse OID: %s\n", probe->Name);
+            exit(1);
+        }
+    }
+
+    /* parse the oids */
+    initProfile(polledProfile);
+    if (servicePath && polledProfile != &singleProfile) {
+        initProfile(&singleProfile);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Handles the response of a table segment. The varbinds of a GETBULK response
+ * are ordered by row, each row contains one varbind per requested column -
+ * the columns of the segment, which were not complete at the time of the
+ * request. Each varbind advances the cursor of its column, or completes the
+ * column if it passed its prefix. Once all columns are complete, so is the
+ * segment and its max-repetitions are learned. Otherwise the next batch of the
+ * open columns is requested.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * pass_t segment - segment of the response
+ * netsnmp_variable_list *varlist - varbinds of the response
+ *
+ * returns void
+ */
+void processTable(hostContext_t *hostContext, pass_t segment, netsnmp_variable_list *varlist)
+{
+    int i, open = 0, k, sent;
+    size_t suffixLen;
+    struct oid_s *first = getSegmentFirstOid(hostContext->profile, segment), *oid;
+    columnCursor_t *column;
+    int requested[hostContext->profile->itemCount[segment]];  /* column index of each requested oid */
+
+    column = getColumns(hostContext, segment);
+
+    for (i = 0; i < hostContext->profile->itemCount[segment]; i++) {
+        if (! column[i].done) {
+            requested[open++] = i;
+        }
+    }
+
+    for (k = 0; varlist && open; varlist = varlist->next_variable, k++) {
+        i = requested[k % open];
+        oid = &first[i];
+        if (column[i].done) {
+            continue;
+        }
+
+        if (varlist->type == SNMP_ENDOFMIBVIEW || varlist->name_length <= oid->OidLen ||
+            memcmp(oid->Oid, varlist->name, oid->OidLen * sizeof(oid->Oid[0]))) {
+            column[i].done = 1;
+            continue;
+        }
+
+        if ((suffixLen = varlist->name_length - oid->OidLen) > MAX_SUFFIX_LEN) {
+            fprintf(stderr, "%s: Table index too long, column %s incomplete\n", hostContext->peername, oid->Name);
+            column[i].done = 1;
+            continue;
+        }
+
+        memcpy(column[i].suffix, &varlist->name[oid->OidLen], suffixLen * sizeof(oid->Oid[0]));
+        column[i].suffixLen = suffixLen;
+        column[i].rows++;
+    }
+
+    /* an empty response does not advance any column */
+    if (! k) {
+        for (i = 0; i < hostContext->profile->itemCount[segment]; i++) {
+            column[i].done = 1;
+        }
+    }
+
+    /* a table, whose next batch cannot be requested, is incomplete */
+    if ((sent = sendNextBulkRequest(hostContext, segment)) < 0) {
+        hostContext->status = STAT_ERROR;
+        failSegment(hostContext, segment);
+    } else if (! sent) {
+        learnRepetitions(hostContext, segment);
+        updateActiveHosts(hostContext, segment);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Function that gets called asynchronously each time a new SNMP packet
+ * arrives. It checks whether the full table was retrieved and emits a new
+ * SNMP request of the next batch of the current segment. If the response was
+ * too big for the agent, the request is repeated with less repetitions. Each
+ * response updates the round trip time estimation and the deadline of the
+ * host.
+ *
+ * int operation - state of the received mesasa
+ * struct snmp_session *sp - not used as we get session from context data
+ * int reqid - request id
+ * struct snmp_pdu *responseData - response packet with data from modem
+ * void *magic - magic pointer for context data
+ *
+ * returns int
+ */
+int asyncResponse(int operation, struct snmp_session *sp, int reqid, struct snmp_pdu *responseData, void *magic)
+{
+    int expected, reportType, sent;
+    pass_t segment;
+    hostContext_t *hostContext = (hostContext_t *)magic;
+    metrics_t *metrics = &hostContext->worker->metrics;
+
+    completeRequest(hostContext);
+    if (operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
+        metrics->responses++;
+    } else {
+        metrics->timeouts++;
+    }
+
+    /* a late response of a host, which was given up */
+    if (hostContext->finished) {
+        admitRequests(hostContext->worker);
+        return 1;
+    }
+    getSegmentLastOid(hostContext->profile, reqid, hostContext->requestIds, &segment);
+
+    if ((expected = operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE && isExpectedSource(hostContext, responseData))) {
+        sampleRtt(hostContext, segment);
+    }
+
+    if (operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
+        processResult(STAT_TIMEOUT, hostContext, responseData);
+        if (hostContext->state && ! hostContext->responded) {
+            hostContext->state->dead = 1;
+        }
+        failSegment(hostContext, segment);
+    } else if (! expected) {
+        metrics->unexpected++;
+        fprintf(stdout, "%s: Response from unexpected source\n", hostContext->peername);
+        failSegment(hostContext, segment);
+    } else if (responseData->command == SNMP_MSG_REPORT) {
+        reportType = snmpv3_get_report_type(responseData);
+        fprintf(stdout, "%s: %s\n", hostContext->peername, snmp_api_errstring(reportType));
+        /* the modem was replaced or reset its engineID, it is discovered again next cycle */
+        if (reportType == SNMPERR_UNKNOWN_ENG_ID) {
+            hostContext->state->engineIDLen = 0;
+        }
+        hostContext->status = STAT_ERROR;
+        failSegment(hostContext, segment);
+    } else if (responseData->errstat == SNMP_ERR_TOOBIG && (metrics->tooBig++, decreaseRepetitions(hostContext, segment))) {
+        if ((sent = sendNextBulkRequest(hostContext, segment)) < 0) {
+            hostContext->status = STAT_ERROR;
+            failSegment(hostContext, segment);
+        } else if (! sent) {
+            updateActiveHosts(hostContext, segment);
+        }
+    } else if (! processResult(STAT_SUCCESS, hostContext, responseData)) {
+        failSegment(hostContext, segment);
+    } else if (segment != NON_REP && segment < FINISH) {
+        processTable(hostContext, segment, responseData->variables);
+    } else {
+        if (segment == NON_REP) {
+            learnCapabilities(hostContext, responseData->variables);
+            resumeHost(hostContext);
+        }
+        updateActiveHosts(hostContext, segment);
+    }
+
+    for (segment = NON_REP; segment < FINISH && ! hostContext->requestIds[segment]; segment++);
+    extendDeadline(hostContext, segment < FINISH);
+
+    admitRequests(hostContext->worker);
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Callback of the engine discovery of an SNMPv3 host. The engineID of the
+ * report is kept in the state of the host, its user is localized for it and
+ * the host is queued for its segments. netsnmp remembers the engineID of a
+ * report in the session, which is removed again, as a session of the socket
+ * pool is shared by many hosts.
+ *
+ * int operation - state of the received message
+ * struct snmp_session *sp - session the report was received on
+ * int reqid - request id
+ * struct snmp_pdu *responseData - report of the modem
+ * void *magic - magic pointer for context data
+ *
+ * returns int
+ */
+int discoveryResponse(int operation, struct snmp_session *sp, int reqid, struct snmp_pdu *responseData, void *magic)
+{
+    hostContext_t *hostContext = (hostContext_t *)magic;
+    hostState_t *state = hostContext->state;
+
+    completeRequest(hostContext);
+    if (hostContext->address) {
+        SNMP_FREE(sp->securityEngineID);
+        sp->securityEngineIDLen = 0;
+        SNMP_FREE(sp->contextEngineID);
+        sp->contextEngineIDLen = 0;
+    }
+
+    /* a late report of a host, which was given up */
+    if (hostContext->finished) {
+        admitRequests(hostContext->worker);
+        return 1;
+    }
+
+    if (operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE && isExpectedSource(hostContext, responseData) &&
+        responseData->securityEngineIDLen && responseData->securityEngineIDLen <= sizeof(state->engineID)) {
+        hostContext->worker->metrics.responses++;
+        memcpy(state->engineID, responseData->securityEngineID, responseData->securityEngineIDLen);
+        state->engineIDLen = responseData->securityEngineIDLen;
+        state->engineTimeSaved = 0;
+        state->dead = 0;
+        hostContext->responded = 1;
+        localizeUser(hostContext);
+        extendDeadline(hostContext, 0);
+        resumeHost(hostContext);
+    } else {
+        fprintf(stdout, "%s: SNMPv3 engine discovery failed\n", hostContext->peername);
+        hostContext->status = STAT_TIMEOUT;
+        if (operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
+            hostContext->worker->metrics.timeouts++;
+            state->dead = 1;
+        }
+        hostContext->parked = 0;
+        failSegment(hostContext, FINISH);
+    }
+
+    admitRequests(hostContext->worker);
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Fail a host, which can not be polled - because it could not be resolved or
+ * its session not be opened - at once. Like a host without response it is
+ * accounted and its output written, the client of a queried host receives
+ * the reason.
+ *
+ * worker_t *worker - the worker
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * const char *reason - why the host can not be polled
+ *
+ * returns void
+ */
+void failHost(worker_t *worker, hostContext_t *hostContext, const char *reason)
+{
+    hostContext->status = STAT_ERROR;
+    if (! recordResults || hostContext->queried) {
+        appendText(&hostContext->results, "ipv4:%s\n", hostContext->peername);
+    }
+    if (hostContext->queried) {
+        appendText(&hostContext->results, "ERROR: %s: %s\n", hostContext->peername, reason);
+        __atomic_fetch_add(&queriedHosts, 1, __ATOMIC_RELAXED);
+    }
+    hostContext->group = getGroup(worker, hostContext->groupName);
+    hostContext->nextSegment = FINISH;
+    worker->activeHosts++;
+    updateActiveHosts(hostContext, FINISH);
+}
+
+/*****************************************************************************/
+/*
+ * Opens the session of a host handed over to the worker and queues it for
+ * the scheduler, which sends the first request of each segment, starting with
+ * the non-repeaters. A host, which could not be resolved or has invalid
+ * SNMPv3 credentials, is failed without a session.
+ *
+ * worker_t *worker - worker owning the host
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void startHost(worker_t *worker, hostContext_t *hostContext)
+{
+    struct snmp_session session;
+    struct timeval expires, opened;
+    long offset;
+    char address[INET_ADDRSTRLEN];
+
+    worker->metrics.hosts++;
+    hostContext->nextHost = worker->hosts;
+    worker->hosts = hostContext;
+    hostContext->start.index = -1;
+    hostContext->start.expire = hostStart;
+    hostContext->deadline.index = -1;
+    hostContext->deadline.expire = hostDeadline;
+
+    if (hostContext->status) {
+        failHost(worker, hostContext, securityName && ! hostContext->credential ? "Invalid SNMPv3 credentials" : "Could not resolve host");
+        return;
+    }
+
+    if (poolSize) {
+        hostContext->address = calloc(1, sizeof(netsnmp_indexed_addr_pair));
+        hostContext->address->remote_addr.sin.sin_family = AF_INET;
+        hostContext->address->remote_addr.sin.sin_port = htons(SNMP_PORT);
+        hostContext->address->remote_addr.sin.sin_addr = hostContext->ip;
+        hostContext->session = &worker->sessions[worker->hostCount++ % poolSize];
+    } else {
+        snmp_sess_init(&session);
         session.version = SNMP_VERSION_2c;
         session.retries = RETRIES;
         session.timeout = TIMEOUT * 1000000;
-        session.peername = PQgetvalue(result, i, 0);
-        session.community = (u_char *)PQgetvalue(result, i, 1);
-        session.community_len = strlen((const char *)session.community);
+        session.peername = (char *)inet_ntop(AF_INET, &hostContext->ip, address, sizeof(address));
+        session.community = (u_char *)hostContext->community;
+        session.community_len = strlen(hostContext->community);
         session.callback = asyncResponse;
         session.callback_magic = hostContext;
+        if (hostContext->credential) {
+            setSessionSecurity(&session, hostContext->credential->name, hostContext->credential->level);
+        }
+
+        gettimeofday(&opened, NULL);
+        if (! openSession(worker, hostContext->session, &session)) {
+            snmp_perror("snmp_open");
+            failHost(worker, hostContext, "Could not open session");
+            return;
+        }
+        worker->metrics.sessionOpen += usSince(&opened);
+        worker->hostCount++;
+    }
+    if (! recordResults || hostContext->queried) {
+        appendText(&hostContext->results, "ipv4:%s\n", hostContext->peername);
+        if (deltaCycle && ! hostContext->queried) {
+            appendText(&hostContext->results, "delta\n");
+        }
+    }
+    hostContext->cacheSeed = hashBytes(FNV_OFFSET, hostContext->state->name, strlen(hostContext->state->name));
+    if (hostContext->credential && hostContext->state->engineIDLen) {
+        localizeUser(hostContext);
+    }
+
+    hostContext->group = getGroup(worker, hostContext->groupName);
+    worker->activeHosts++;
+    if (hostContext->queried) {
+        __atomic_fetch_add(&queriedHosts, 1, __ATOMIC_RELAXED);
+    }
+    if (! spread || hostContext->queried) {
+        queueHost(hostContext);
+        return;
+    }
+
+    /* the offset depends on the host only, so that it is polled at the same point of each cycle */
+    offset = hashName(hostContext->peername) % spread;
+    expires.tv_sec = cycleStart.tv_sec + (cycleStart.tv_usec + offset) / 1000000;
+    expires.tv_usec = (cycleStart.tv_usec + offset) % 1000000;
+    timerSchedule(&worker->timers, &hostContext->start, &expires);
+}
+
+/*****************************************************************************/
+/*
+ * Start all hosts, which the main thread put into the inbox of the worker
+ * since the last call. Called whenever the worker is woken by its eventfd.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void acceptHosts(worker_t *worker)
+{
+    uint64_t count;
+    hostContext_t *hostContext, *next;
+
+    if (read(worker->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read");
+    }
+
+    pthread_mutex_lock(&worker->inboxLock);
+    hostContext = worker->inbox;
+    worker->inbox = worker->inboxTail = NULL;
+    worker->feeding = ! worker->fed;
+    pthread_mutex_unlock(&worker->inboxLock);
+
+    for (; hostContext; hostContext = next) {
+        next = hostContext->next;
+        startHost(worker, hostContext);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Whether the event loop of the worker has to keep running: while any hosts
+ * are active or more hosts may be handed over. The abandoned requests of
+ * given up hosts have to complete as well, as netsnmp calls them back with
+ * the hosts, which are freed at the end of the cycle.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns int
+ */
+int workerBusy(worker_t *worker)
+{
+    return worker->activeHosts > 0 || worker->feeding || worker->inFlight > 0;
+}
+
+/*****************************************************************************/
+/*
+ * Close a session of the worker
+ *
+ * sessionContext_t *sessionContext - the session
+ *
+ * returns void
+ */
+void closeSession(sessionContext_t *sessionContext)
+{
+    if (sessionContext->handle) {
+        snmp_sess_close(sessionContext->handle);
+    }
+    if (sessionContext->fd) {
+        close(sessionContext->fd);
+    }
+    freeBatch(&sessionContext->requests);
+}
+
+/*****************************************************************************/
+/*
+ * Close the sessions of the started hosts of the worker and forget them. The
+ * host contexts of the cycle are freed with its arena, those of the query
+ * service one by one.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void releaseHosts(worker_t *worker)
+{
+    hostContext_t *hostContext, *next;
+
+    for (hostContext = worker->hosts; hostContext; hostContext = next) {
+        next = hostContext->nextHost;
+        if (! poolSize) {
+            closeSession(hostContext->session);
+        }
+        free(hostContext->address);
+        if (hostContext->queried) {
+            freeQuery(hostContext);
+        }
+    }
+    worker->hosts = NULL;
+}
+
+/*****************************************************************************/
+/*
+ * Event loop based on select, which rebuilds the set of file descriptors of
+ * all sessions on each pass. Loops while the worker is busy, the deadlines of
+ * the hosts are kept in the timer heap. Only usable with a single worker, as
+ * it handles all sessions of netsnmp.
+ *
+ * worker_t *worker - the only worker
+ *
+ * returns void
+ */
+void selectLoop(worker_t *worker)
+{
+    int numfds, block, ms;
+    struct timeval timeout;
+    netsnmp_large_fd_set fdset;
+    netsnmp_large_fd_set_init(&fdset, FD_SETSIZE);
+
+    while (workerBusy(worker)) {
+        numfds = 0;
+        NETSNMP_LARGE_FD_ZERO(&fdset);
+        ms = nextTimerMs(&worker->timers, nextAdmissionMs(worker, 1000));
+        timeout.tv_sec = ms / 1000;
+        timeout.tv_usec = ms % 1000 * 1000;
+        block = 0;
+
+        snmp_sess_select_info2(NULL, &numfds, &fdset, &timeout, &block);
+        NETSNMP_LARGE_FD_SET(worker->wakeFd, &fdset);
+        numfds = numfds > worker->wakeFd ? numfds : worker->wakeFd + 1;
+        numfds = netsnmp_large_fd_set_select(numfds, &fdset, NULL, NULL, &timeout);
+
+        if (numfds < 0) {
+            perror("select failed");
+            exit(1);
+        }
+        worker->metrics.wakeups++;
+        worker->metrics.events += numfds;
+
+        if (numfds && NETSNMP_LARGE_FD_ISSET(worker->wakeFd, &fdset)) {
+            acceptHosts(worker);
+            numfds--;
+        }
+
+        if (numfds) {
+            snmp_read2(&fdset);
+        } else {
+            snmp_timeout();
+        }
+
+        runExpiredTimers(&worker->timers);
+        admitRequests(worker);
+    }
+
+    netsnmp_large_fd_set_cleanup(&fdset);
+}
+
+/*****************************************************************************/
+/*
+ * Event loop based on epoll. Each session is registered once, only sessions
+ * with pending replies are read and retransmissions are driven by the timer
+ * heap instead of sweeping all sessions. Loops while the worker is busy, each
+ * host is bounded by its own deadline.
+ *
+ * worker_t *worker - worker running the loop
+ *
+ * returns void
+ */
+void epollLoop(worker_t *worker)
+{
+    int i, numEvents;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (workerBusy(worker)) {
+        if (rawTransport) {
+            flushPool(worker);
+        }
+        numEvents = epoll_wait(worker->epollFd, events, MAX_EVENTS, nextTimerMs(&worker->timers, nextAdmissionMs(worker, 1000)));
+
+        if (numEvents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(1);
+        }
+        worker->metrics.wakeups++;
+        worker->metrics.events += numEvents;
+
+        for (i = 0; i < numEvents; i++) {
+            if (events[i].data.ptr == worker) {
+                acceptHosts(worker);
+            } else if (rawTransport) {
+                readRaw(events[i].data.ptr);
+            } else {
+                readSession(events[i].data.ptr);
+            }
+        }
+
+        runExpiredTimers(&worker->timers);
+        admitRequests(worker);
+
+        /* the query service never ends its cycle, its hosts are released once nothing refers to them */
+        if (worker->service && ! worker->activeHosts && ! worker->inFlight) {
+            releaseHosts(worker);
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Set up a worker: its event loop, the socket pool and the buffers, which are
+ * kept for all cycles of the daemon mode.
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void openWorker(worker_t *worker)
+{
+    struct epoll_event event;
+
+    memset(worker, 0, sizeof(worker_t));
+    pthread_mutex_init(&worker->inboxLock, NULL);
+    if ((worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    /* the limits of the scheduler are split between the workers */
+    worker->window = window ? (window + threadCount - 1) / threadCount : 0;
+    worker->groupLimit = groupLimit ? (groupLimit + threadCount - 1) / threadCount : 0;
+    worker->rate = rate / threadCount;
+    gettimeofday(&worker->refilled, NULL);
+
+    if (useEpoll) {
+        netsnmp_large_fd_set_init(&worker->readSet, FD_SETSIZE);
+        if ((worker->epollFd = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = worker;
+        if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &event)) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    /* the shared sockets of the pool, the sessions of the hosts are opened when they are started */
+    if (poolSize) {
+        worker->sessions = calloc(poolSize, sizeof(sessionContext_t));
+        openSocketPool(worker, worker->sessions);
+    }
+    if (builtinDecoder) {
+        worker->varbinds = calloc(MAX_VARBINDS, sizeof(netsnmp_variable_list));
+    }
+    if (rawTransport) {
+        allocBatch(&worker->responses, RECEIVE_BUFFER);
+    }
+    if (shardCount) {
+        worker->shardDone = calloc(shardCount, sizeof(long));
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Thread function of a worker, run for each cycle: polls the hosts handed
+ * over by the main thread, until all hosts are handed over and complete.
+ * The sessions of the hosts are closed afterwards, the socket pool is kept.
+ *
+ * void *arg - the worker
+ *
+ * returns void *
+ */
+void *pollShard(void *arg)
+{
+    worker_t *worker = arg;
+
+    worker->paused = 0;
+    timerclear(&worker->pausedSince);
+    acceptHosts(worker);
+    admitRequests(worker);
+
+    /* async event loop - loops while any active hosts or more hosts may follow */
+    if (useEpoll) {
+        epollLoop(worker);
+    } else {
+        selectLoop(worker);
+    }
+    releaseHosts(worker);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/*
+ * Release all resources of a worker after the last cycle
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void closeWorker(worker_t *worker)
+{
+    int i;
+
+    for (i = 0; i < poolSize; i++) {
+        closeSession(&worker->sessions[i]);
+    }
+    free(worker->sessions);
+    for (i = 0; i < worker->slotCount / SLOT_CHUNK; i++) {
+        free(worker->slots[i]);
+    }
+    free(worker->slots);
+    free(worker->varbinds);
+    freeBatch(&worker->responses);
+    freeSamples(&worker->downstream);
+    freeSamples(&worker->upstream);
+    free(worker->shardDone);
+    for (i = 0; i < worker->groupCount; i++) {
+        free(worker->groups[i]->name);
+        free(worker->groups[i]);
+    }
+    free(worker->groups);
+    free(worker->timers.timers);
+    if (useEpoll) {
+        close(worker->epollFd);
+        netsnmp_large_fd_set_cleanup(&worker->readSet);
+    }
+    close(worker->wakeFd);
+    pthread_mutex_destroy(&worker->inboxLock);
+}
+
+/*****************************************************************************/
+/*
+ * Put a host into the inbox of its worker, which opens its session and starts
+ * polling it. Called by the main thread and by the resolver.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void handOver(hostContext_t *hostContext)
+{
+    int empty;
+    uint64_t one = 1;
+    worker_t *worker = hostContext->worker;
+
+    hostContext->next = NULL;
+    pthread_mutex_lock(&worker->inboxLock);
+    empty = ! worker->inbox;
+    if (worker->inboxTail) {
+        worker->inboxTail->next = hostContext;
+    } else {
+        worker->inbox = hostContext;
+    }
+    worker->inboxTail = hostContext;
+    pthread_mutex_unlock(&worker->inboxLock);
+
+    /* the worker takes the whole inbox at once, it only needs to be woken for the first host */
+    if (empty && write(worker->wakeFd, &one, sizeof(one)) < 0) {
+        perror("write");
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Compare two entries of the stub resolver by name
+ *
+ * const void *a - first entry
+ * const void *b - second entry
+ *
+ * returns int
+ */
+int compareStubHosts(const void *a, const void *b)
+{
+    return strcmp(((const stubHost_t *)a)->name, ((const stubHost_t *)b)->name);
+}
+
+/*****************************************************************************/
+/*
+ * Load the hosts file of the stub resolver (format of /etc/hosts, IPv4 only),
+ * which replaces DNS, e.g. for tests against simulated modems
+ *
+ * const char *path - the hosts file
+ *
+ * returns void
+ */
+void loadStubHosts(const char *path)
+{
+    char line[1024], *name, *save;
+    struct in_addr address;
+    size_t size = 0;
+    FILE *file = fopen(path, "r");
+
+    if (! file) {
+        perror(path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "#")] = '\0';
+        if (! (name = strtok_r(line, " \t\n", &save)) || inet_pton(AF_INET, name, &address) != 1) {
+            continue;
+        }
+
+        while ((name = strtok_r(NULL, " \t\n", &save))) {
+            if (stubCount == size) {
+                size = size ? 2 * size : 1024;
+                stubHosts = realloc(stubHosts, size * sizeof(stubHost_t));
+            }
+            stubHosts[stubCount].name = strdup(name);
+            stubHosts[stubCount++].address = address;
+        }
+    }
+    fclose(file);
+
+    qsort(stubHosts, stubCount, sizeof(stubHost_t), compareStubHosts);
+}
+
+/*****************************************************************************/
+/*
+ * Queue a host, whose peername is not an address, for the resolver
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void queueLookup(hostContext_t *hostContext)
+{
+    hostContext->next = NULL;
+
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.tail) {
+        resolver.tail->next = hostContext;
+    } else {
+        resolver.head = hostContext;
+    }
+    resolver.tail = hostContext;
+    pthread_cond_signal(&resolver.wake);
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+/*****************************************************************************/
+/*
+ * Hand a host, which could not be resolved, over to its worker anyway. It is
+ * not polled, but failed like a host without response, so that it is
+ * accounted and its output written.
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ *
+ * returns void
+ */
+void failLookup(hostContext_t *hostContext)
+{
+    hostContext->status = STAT_ERROR;
+    handOver(hostContext);
+}
+
+/*****************************************************************************/
+/*
+ * Resolve a host from the stub resolver or the cached address in its state,
+ * without a DNS lookup
+ *
+ * hostContext_t *hostContext - pointer to the current hostcontext structure
+ * time_t now - current time
+ *
+ * returns int - 0 if the host has to be looked up
+ */
+int resolveLocal(hostContext_t *hostContext, time_t now)
+{
+    stubHost_t key = { hostContext->peername }, *stub;
+    hostState_t *state = hostContext->state;
+
+    if (stubHosts) {
+        if (! (stub = bsearch(&key, stubHosts, stubCount, sizeof(stubHost_t), compareStubHosts))) {
+            fprintf(stderr, "%s: Could not resolve host\n", hostContext->peername);
+            failLookup(hostContext);
+            return 1;
+        }
+        hostContext->ip = stub->address;
+        handOver(hostContext);
+        return 1;
+    }
+
+    if (state && state->address && state->addressExpires > now) {
+        hostContext->ip.s_addr = state->address;
+        handOver(hostContext);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/*
+ * Thread function of the resolver, run for each cycle: the host names are
+ * resolved with getaddrinfo_a, keeping up to DNS_LOOKUPS lookups running at a
+ * time, and each host is handed over to its worker, as soon as its address is
+ * known - so that the DNS latency overlaps with polling the other hosts. The
+ * addresses are cached in the host states for DNS_TTL seconds, as
+ * getaddrinfo does not tell the TTL of the record. Failed lookups are not
+ * cached.
+ *
+ * void *arg - not used
+ *
+ * returns void *
+ */
+void *resolveHosts(void *arg)
+{
+    int i, j, error, count, active = 0, stop = 0;
+    hostContext_t *hostContext, *next, *backlog = NULL, *backlogTail = NULL, *hosts[DNS_LOOKUPS];
+    struct gaicb lookups[DNS_LOOKUPS], *pending[DNS_LOOKUPS] = { NULL }, *submit[DNS_LOOKUPS];
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct timespec poll = { 0, DNS_POLL * 1000000L };
+    time_t now;
+
+    while (! stop || backlog || active) {
+        /* take the newly queued hosts, wait for them if there is nothing else to do */
+        pthread_mutex_lock(&resolver.lock);
+        while (! resolver.head && ! resolver.stop && ! backlog && ! active) {
+            pthread_cond_wait(&resolver.wake, &resolver.lock);
+        }
+        hostContext = resolver.head;
+        resolver.head = resolver.tail = NULL;
+        stop = resolver.stop;
+        pthread_mutex_unlock(&resolver.lock);
+
+        for (now = time(NULL); hostContext; hostContext = next) {
+            next = hostContext->next;
+            if (resolveLocal(hostContext, now)) {
+                continue;
+            }
+
+            hostContext->next = NULL;
+            if (backlogTail) {
+                backlogTail->next = hostContext;
+            } else {
+                backlog = hostContext;
+            }
+            backlogTail = hostContext;
+        }
+
+        /* start lookups for the free slots */
+        for (i = count = 0; i < DNS_LOOKUPS && backlog; i++) {
+            if (pending[i]) {
+                continue;
+            }
+
+            hosts[i] = backlog;
+            if (! (backlog = backlog->next)) {
+                backlogTail = NULL;
+            }
+            memset(&lookups[i], 0, sizeof(struct gaicb));
+            lookups[i].ar_name = hosts[i]->peername;
+            lookups[i].ar_request = &hints;
+            pending[i] = submit[count++] = &lookups[i];
+        }
+        /* on failure some lookups may be queued, the others are neither running nor resolved */
+        if (count && (error = getaddrinfo_a(GAI_NOWAIT, submit, count, NULL))) {
+            fprintf(stderr, "getaddrinfo_a: %s\n", gai_strerror(error));
+            for (j = 0; j < count; j++) {
+                i = submit[j] - lookups;
+                if (gai_error(&lookups[i]) != EAI_INPROGRESS && ! lookups[i].ar_result) {
+                    pending[i] = NULL;
+                    failLookup(hosts[i]);
+                    active--;
+                }
+            }
+        }
+        active += count;
+
+        if (! active) {
+            continue;
+        }
+        gai_suspend((const struct gaicb * const *)pending, DNS_LOOKUPS, &poll);
+
+        for (i = 0, now = time(NULL); i < DNS_LOOKUPS; i++) {
+            if (! pending[i] || (error = gai_error(pending[i])) == EAI_INPROGRESS) {
+                continue;
+            }
+
+            if (error || ! lookups[i].ar_result) {
+                fprintf(stderr, "%s: Could not resolve host: %s\n", hosts[i]->peername, gai_strerror(error));
+                failLookup(hosts[i]);
+            } else {
+                hosts[i]->ip = ((struct sockaddr_in *)lookups[i].ar_result->ai_addr)->sin_addr;
+                if (hosts[i]->state) {
+                    hosts[i]->state->address = hosts[i]->ip.s_addr;
+                    hosts[i]->state->addressExpires = now + DNS_TTL;
+                }
+                handOver(hosts[i]);
+            }
+
+            if (lookups[i].ar_result) {
+                freeaddrinfo(lookups[i].ar_result);
+            }
+            pending[i] = NULL;
+            active--;
+        }
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/*
+ * Find the credential set, derive its master keys if it is new. Deriving a
+ * key from a passphrase hashes a megabyte, so this is done once per credential
+ * set instead of once per host.
+ *
+ * const char *name - security name
+ * const char *auth - authentication passphrase
+ * const char *priv - privacy passphrase, NULL for authNoPriv
+ *
+ * returns usmCredential_t * - NULL if the passphrases are invalid
+ */
+usmCredential_t *getCredential(const char *name, const char *auth, const char *priv)
+{
+    usmCredential_t *credential;
+
+    for (credential = credentials; credential; credential = credential->next) {
+        if (! strcmp(credential->name, name) && ! strcmp(credential->authPassphrase, auth) &&
+            (priv ? credential->privPassphrase && ! strcmp(credential->privPassphrase, priv) : ! credential->privPassphrase)) {
+            return credential;
+        }
+    }
+
+    if (strlen(auth) < MIN_PASSPHRASE_LEN || (priv && strlen(priv) < MIN_PASSPHRASE_LEN)) {
+        fprintf(stderr, "%s: SNMPv3 passphrases need at least %d characters\n", name, MIN_PASSPHRASE_LEN);
+        return NULL;
+    }
+
+    credential = calloc(1, sizeof(usmCredential_t));
+    credential->authKeyLen = sizeof(credential->authKey);
+    if (generate_Ku(usmHMACSHA1AuthProtocol, USM_AUTH_PROTO_SHA_LEN, (const u_char *)auth, strlen(auth),
+                    credential->authKey, &credential->authKeyLen) != SNMPERR_SUCCESS) {
+        snmp_perror("generate_Ku");
+        free(credential);
+        return NULL;
+    }
+    if (priv) {
+        credential->privKeyLen = sizeof(credential->privKey);
+        if (generate_Ku(usmHMACSHA1AuthProtocol, USM_AUTH_PROTO_SHA_LEN, (const u_char *)priv, strlen(priv),
+                        credential->privKey, &credential->privKeyLen) != SNMPERR_SUCCESS) {
+            snmp_perror("generate_Ku");
+            free(credential);
+            return NULL;
+        }
+    }
+
+    credential->name = strdup(name);
+    credential->authPassphrase = strdup(auth);
+    credential->privPassphrase = priv ? strdup(priv) : NULL;
+    credential->level = priv ? SNMP_SEC_LEVEL_AUTHPRIV : SNMP_SEC_LEVEL_AUTHNOPRIV;
+    credential->next = credentials;
+    credentials = credential;
+
+    return credential;
+}
+
+/*****************************************************************************/
+/*
+ * The SNMPv3 credential set of a host: a community of the form
+ * name:auth_passphrase[:priv_passphrase] overrides the user given on the
+ * command line.
+ *
+ * const char *community - community column of the host
+ *
+ * returns usmCredential_t * - NULL if the passphrases are invalid
+ */
+usmCredential_t *hostCredential(const char *community)
+{
+    char buffer[COMMUNITY_MAX_LEN], *auth, *priv = NULL;
+    usmCredential_t *credential;
+
+    snprintf(buffer, sizeof(buffer), "%s", community);
+    if ((auth = strchr(buffer, ':'))) {
+        *auth++ = '\0';
+        if ((priv = strchr(auth, ':'))) {
+            *priv++ = '\0';
+        }
+    }
+
+    /* the query service looks up credentials, while the main thread feeds the polled hosts */
+    lockUsm();
+    credential = auth ? getCredential(buffer, auth, priv) : getCredential(securityName, authPassphrase, privPassphrase);
+    unlockUsm();
+
+    return credential;
+}
+
+/*****************************************************************************/
+/*
+ * Prepare the USM for SNMPv3: the master keys of the user given on the
+ * command line are derived up front and the user without a name, which the
+ * reports of the engine discoveries are addressed to, is created once instead
+ * of per host.
+ *
+ * returns void
+ */
+void initUsm()
+{
+    struct usmUser *user;
+
+    if (! getCredential(securityName, authPassphrase, privPassphrase)) {
+        exit(1);
+    }
+
+    if (! usm_get_user(NULL, 0, "")) {
+        user = usm_create_user();
+        user->name = strdup("");
+        user->userStorageType = ST_VOLATILE;
+        usm_add_user(user);
+    }
+
+    usmShared = threadCount > 1 || servicePath;
+}
+
+/*****************************************************************************/
+/*
+ * Create the context of a host from a row of the query or a line of the host
+ * list. Hosts with an address are handed over to their worker at once, host
+ * names are resolved by the resolver first. Called by the main thread for
+ * each row, while the workers poll the previous hosts.
+ *
+ * worker_t *worker - the worker the host is assigned to
+ * arena_t *arena - memory of the host contexts
+ * char **fields - address or host name, community, hostname, group and modem.id
+ *
+ * returns void
+ */
+void feedHost(worker_t *worker, arena_t *arena, char **fields)
+{
+    hostContext_t *hostContext = arenaAlloc(arena, sizeof(hostContext_t));
+
+    hostContext->worker = worker;
+    hostContext->peername = arenaStrdup(arena, fields[0]);
+    hostContext->community = arenaStrdup(arena, fields[1]);
+    hostContext->groupName = arenaStrdup(arena, fields[3]);
+    hostContext->hostId = strtoul(fields[4], NULL, 10);
+    hostContext->state = getState(fields[2]);
+    hostContext->profile = polledProfile;
+    if (! recordResults && polledProfile != &singleProfile) {
+        hostContext->outputPath = strdup(fields[2]);
+    }
+    if (! poolSize) {
+        hostContext->session = arenaAlloc(arena, sizeof(sessionContext_t));
+    }
+
+    /* the host is not polled, but failed by its worker, so that it is accounted */
+    if (securityName && ! (hostContext->credential = hostCredential(fields[1]))) {
+        fprintf(stderr, "%s: Invalid SNMPv3 credentials\n", fields[2]);
+        hostContext->status = STAT_ERROR;
+        handOver(hostContext);
+    } else if (inet_pton(AF_INET, hostContext->peername, &hostContext->ip) == 1) {
+        handOver(hostContext);
+    } else {
+        queueLookup(hostContext);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Split a line of the host list into the fields of a host: address or host
+ * name, community and hostname are required, group and modem.id optional.
+ * Empty lines and comments starting with # are skipped.
+ *
+ * char *line - the line, which is modified
+ * char **fields - the fields
+ *
+ * returns int - 0 if the line does not contain a host
+ */
+int parseHostLine(char *line, char **fields)
+{
+    int count;
+    char *save;
+
+    for (count = 0; count < 5 && (fields[count] = strtok_r(count ? NULL : line, " \t\r\n", &save)); count++) {
+        if (fields[count][0] == '#') {
+            break;
+        }
+    }
+
+    if (count > 0 && count < 3) {
+        fprintf(stderr, "Skipping incomplete host %s\n", fields[0]);
+    }
+    fields[3] = count > 3 ? fields[3] : "";
+    fields[4] = count > 4 ? fields[4] : "0";
+
+    return count >= 3;
+}
+
+/*****************************************************************************/
+/*
+ * Tell the worker, that all hosts are handed over
+ *
+ * worker_t *worker - the worker
+ *
+ * returns void
+ */
+void closeFeed(worker_t *worker)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&worker->inboxLock);
+    worker->fed = 1;
+    pthread_mutex_unlock(&worker->inboxLock);
+
+    if (write(worker->wakeFd, &one, sizeof(one)) < 0) {
+        perror("write");
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Read the request of a client of the query service: a single line
+ *
+ * int fd - the client
+ * char *line - buffer of the line, without the line break
+ * size_t size - size of the buffer
+ *
+ * returns int - 0 if the client sent nothing
+ */
+int readQuery(int fd, char *line, size_t size)
+{
+    size_t len = 0;
+    ssize_t received;
+
+    while (len < size - 1 && (received = read(fd, line + len, size - 1 - len)) != 0) {
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len += received;
+        if (memchr(line + len - received, '\n', received)) {
+            break;
+        }
+    }
+
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    return line[0] != '\0';
+}
+
+/*****************************************************************************/
+/*
+ * Resolve a host of the query service: an address, the stub resolver or a
+ * blocking lookup, which only delays the thread accepting the queries
+ *
+ * const char *name - address or host name
+ * struct in_addr *ip - the resolved address
+ *
+ * returns int - 0 if the host could not be resolved
+ */
+int resolveQuery(const char *name, struct in_addr *ip)
+{
+    stubHost_t key = { (char *)name }, *stub;
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM }, *result;
+
+    if (inet_pton(AF_INET, name, ip) == 1) {
+        return 1;
+    }
+
+    if (stubHosts) {
+        if (! (stub = bsearch(&key, stubHosts, stubCount, sizeof(stubHost_t), compareStubHosts))) {
+            return 0;
+        }
+        *ip = stub->address;
+        return 1;
+    }
+
+    if (getaddrinfo(name, NULL, &hints, &result)) {
+        return 0;
+    }
+    *ip = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Start a request of the query service: a modem id is looked up like with -m,
+ * any other line is a host of the form of the host list. The host is polled
+ * with the profile of the single modem analysis by the worker of the service,
+ * which is never queued behind the bulk poll. The host has its own state, as
+ * the states of the polled hosts belong to the main thread during a cycle -
+ * so an SNMPv3 engine is discovered for each request.
+ *
+ * int fd - the client
+ *
+ * returns void
+ */
+void startQuery(int fd)
+{
+    int i;
+    char line[4096], *fields[5], hostname[32];
+    const char *params[1] = { hostname };
+    int buffer = QUERY_BUFFER;
+    struct timeval timeout = { QUERY_TIMEOUT, 0 };
+    struct in_addr ip;
+    PGresult *result = NULL;
+    usmCredential_t *credential = NULL;
+    hostContext_t *hostContext;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    if (! readQuery(fd, line, sizeof(line))) {
+        close(fd);
+        return;
+    }
+
+    if (strspn(line, "0123456789") == strlen(line)) {
+        if (! service.conn) {
+            rejectQuery(fd, line, "Modem ids need the database");
+            return;
+        }
+        snprintf(hostname, sizeof(hostname), "cm-%lu", strtoul(line, NULL, 10));
+        result = PQexecParams(service.conn, service.query, 1, NULL, params, NULL, NULL, 0);
+        if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) != 1) {
+            rejectQuery(fd, line, PQresultStatus(result) == PGRES_TUPLES_OK ? "Unknown modem" : PQerrorMessage(service.conn));
+            PQclear(result);
+            /* try again with a new connection for the next request */
+            if (PQstatus(service.conn) == CONNECTION_BAD) {
+                PQreset(service.conn);
+                PQclear(PQexec(service.conn, "SET search_path TO nmsprime"));
+            }
+            return;
+        }
+        for (i = 0; i < 5; i++) {
+            fields[i] = PQgetvalue(result, 0, i);
+        }
+    } else if (service.conn) {
+        /* with the database, only its modems can be polled */
+        rejectQuery(fd, line, "Only modem ids are accepted");
+        return;
+    } else if (! parseHostLine(line, fields)) {
+        rejectQuery(fd, line, "Invalid request");
+        return;
+    }
+
+    if (! resolveQuery(fields[0], &ip)) {
+        rejectQuery(fd, fields[2], "Could not resolve host");
+    } else if (securityName && ! (credential = hostCredential(fields[1]))) {
+        rejectQuery(fd, fields[2], "Invalid SNMPv3 credentials");
+    } else {
+        hostContext = calloc(1, sizeof(hostContext_t));
+        hostContext->worker = &service.worker;
+        hostContext->peername = strdup(fields[0]);
+        hostContext->ip = ip;
+        hostContext->community = strdup(fields[1]);
+        hostContext->credential = credential;
+        hostContext->groupName = strdup(fields[3]);
+        hostContext->hostId = strtoul(fields[4], NULL, 10);
+        hostContext->state = calloc(1, sizeof(hostState_t));
+        snprintf(hostContext->state->name, sizeof(hostContext->state->name), "%s", fields[2]);
+        hostContext->profile = &singleProfile;
+        hostContext->queried = 1;
+        hostContext->replyFd = fd;
+        if (! poolSize) {
+            hostContext->session = calloc(1, sizeof(sessionContext_t));
+        }
+        handOver(hostContext);
+    }
+
+    PQclear(result);
+}
+
+/*****************************************************************************/
+/*
+ * Thread function of the query service: accepts the clients one after the
+ * other, until the socket is shut down
+ *
+ * void *arg - not used
+ *
+ * returns void *
+ */
+void *acceptQueries(void *arg)
+{
+    int fd;
+
+    while ((fd = accept4(service.listenFd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        if (fd >= 0) {
+            startQuery(fd);
+        }
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/*
+ * Start the query service: listen on its Unix socket and start its worker,
+ * which keeps running across the cycles, so that a modem is polled as soon
+ * as it is requested. The profile of the single modem analysis was already
+ * parsed on startup.
+ *
+ * returns void
+ */
+void startService()
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+    if (strlen(servicePath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Path of the query service is too long: %s\n", servicePath);
+        exit(1);
+    }
+    strcpy(address.sun_path, servicePath);
+    unlink(servicePath);
+
+    /* only the owner and its group may poll modems */
+    if ((service.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(service.listenFd, (struct sockaddr *)&address, sizeof(address)) || chmod(servicePath, 0660) ||
+        listen(service.listenFd, SOMAXCONN)) {
+        perror(servicePath);
+        exit(1);
+    }
+
+    /* a single modem is polled without the limits of the bulk poll */
+    openWorker(&service.worker);
+    service.worker.service = 1;
+    service.worker.feeding = 1;
+    service.worker.window = 0;
+    service.worker.groupLimit = 0;
+    service.worker.rate = 0;
+
+    if (pthread_create(&service.worker.thread, NULL, pollShard, &service.worker) ||
+        pthread_create(&service.thread, NULL, acceptQueries, NULL)) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Stop the query service: no more clients are accepted, the modems being
+ * polled are completed
+ *
+ * returns void
+ */
+void stopService()
+{
+    shutdown(service.listenFd, SHUT_RDWR);
+    pthread_join(service.thread, NULL);
+    close(service.listenFd);
+    unlink(servicePath);
+
+    closeFeed(&service.worker);
+    pthread_join(service.worker.thread, NULL);
+    closeWorker(&service.worker);
+}
+
+/*****************************************************************************/
+/*
+ * Write the counters of all cycles in the Prometheus text format, e.g. for
+ * the textfile collector of the node exporter
+ *
+ * FILE *file - the file
+ * metrics_t *metrics - the counters of all cycles
+ * phases_t *phases - durations of the last cycle
+ *
+ * returns void
+ */
+void writePrometheus(FILE *file, metrics_t *metrics, phases_t *phases)
+{
+    int i, j, k;
+    uint64_t cumulative;
+    static const struct { const char *name, *help; size_t offset; } counters[] = {
+        { "retransmissions", "Retransmitted requests of the raw transport", offsetof(metrics_t, retransmissions) },
+        { "responses", "Received responses", offsetof(metrics_t, responses) },
+        { "timeouts", "Requests without a response", offsetof(metrics_t, timeouts) },
+        { "unexpected_responses", "Responses from an unexpected source", offsetof(metrics_t, unexpected) },
+        { "too_big_responses", "tooBig responses", offsetof(metrics_t, tooBig) },
+        { "varbinds", "Received varbinds", offsetof(metrics_t, varbinds) },
+        { "unchanged_varbinds", "Varbinds suppressed by the change cache", offsetof(metrics_t, unchanged) },
+        { "sent_bytes", "Bytes sent by the raw transport", offsetof(metrics_t, bytesSent) },
+        { "received_bytes", "Bytes received by the raw transport", offsetof(metrics_t, bytesReceived) },
+        { "sendmmsg_calls", "sendmmsg calls of the raw transport", offsetof(metrics_t, sendCalls) },
+        { "recvmmsg_calls", "recvmmsg calls of the raw transport", offsetof(metrics_t, receiveCalls) },
+        { "sent_packets", "Packets sent by the raw transport", offsetof(metrics_t, packetsSent) },
+        { "received_packets", "Packets received by the raw transport", offsetof(metrics_t, packetsReceived) },
+        { "send_errors", "Requests of the raw transport the kernel did not take", offsetof(metrics_t, sendErrors) },
+        { "copy_failed_hosts", "Hosts, whose results could not be copied into the database", offsetof(metrics_t, copyFailures) },
+        { "hosts", "Polled hosts", offsetof(metrics_t, hosts) },
+        { "failed_hosts", "Hosts with a failed request", offsetof(metrics_t, failedHosts) },
+        { "deadline_hosts", "Hosts given up at their deadline", offsetof(metrics_t, deadlines) },
+        { "engine_discoveries", "SNMPv3 engine discoveries", offsetof(metrics_t, discoveries) },
+        { "event_loop_wakeups", "Iterations of the event loops", offsetof(metrics_t, wakeups) },
+        { "event_loop_events", "Ready sockets handled by the event loops", offsetof(metrics_t, events) },
+    };
+
+    fprintf(file, "# HELP modempoller_cycles_total Completed polling cycles\n# TYPE modempoller_cycles_total counter\nmodempoller_cycles_total %ld\n", cycles);
+
+    fprintf(file, "# HELP modempoller_requests_total Requests sent, without retransmissions\n# TYPE modempoller_requests_total counter\n");
+    for (i = 0; i < FINISH; i++) {
+        fprintf(file, "modempoller_requests_total{segment=\"%s\"} %lu\n", segmentNames[i], (u_long)metrics->requests[i]);
+    }
+
+    for (i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++) {
+        fprintf(file, "# HELP modempoller_%s_total %s\n# TYPE modempoller_%s_total counter\nmodempoller_%s_total %lu\n",
+                counters[i].name, counters[i].help, counters[i].name, counters[i].name,
+                (u_long)*(uint64_t *)((char *)metrics + counters[i].offset));
+    }
+
+    /*
+     * the buckets of the histogram are exact at powers of two, which are exported from 128us to 16s - as
+     * the round trip times are whole microseconds, the bucket below 2^j us includes all up to 2^j - 1 us
+     */
+    fprintf(file, "# HELP modempoller_rtt_seconds Round trip time of the requests\n# TYPE modempoller_rtt_seconds histogram\n");
+    for (i = 0; i < FINISH; i++) {
+        for (j = 7, k = cumulative = 0; j <= 24; j++) {
+            for (; k < histogramBucket(1UL << j); k++) {
+                cumulative += metrics->rtt[i].buckets[k];
+            }
+            fprintf(file, "modempoller_rtt_seconds_bucket{segment=\"%s\",le=\"%.6f\"} %lu\n", segmentNames[i], ((1UL << j) - 1) / 1e6, (u_long)cumulative);
+        }
+        fprintf(file, "modempoller_rtt_seconds_bucket{segment=\"%s\",le=\"+Inf\"} %lu\n", segmentNames[i], (u_long)metrics->rtt[i].count);
+        fprintf(file, "modempoller_rtt_seconds_sum{segment=\"%s\"} %g\n", segmentNames[i], metrics->rtt[i].sum / 1e6);
+        fprintf(file, "modempoller_rtt_seconds_count{segment=\"%s\"} %lu\n", segmentNames[i], (u_long)metrics->rtt[i].count);
+    }
+
+    fprintf(file, "# HELP modempoller_phase_seconds Duration of the phases of the last cycle\n# TYPE modempoller_phase_seconds gauge\n");
+    fprintf(file, "modempoller_phase_seconds{phase=\"query_first_row\"} %g\n", phases->queryFirstRow / 1e6);
+    fprintf(file, "modempoller_phase_seconds{phase=\"query\"} %g\n", phases->query / 1e6);
+    fprintf(file, "modempoller_phase_seconds{phase=\"session_open\"} %g\n", phases->sessionOpen / 1e6);
+    fprintf(file, "modempoller_phase_seconds{phase=\"poll\"} %g\n", phases->poll / 1e6);
+    fprintf(file, "modempoller_phase_seconds{phase=\"output\"} %g\n", phases->output / 1e6);
+    fprintf(file, "modempoller_phase_seconds{phase=\"cycle\"} %g\n", phases->cycle / 1e6);
+
+    fprintf(file, "# HELP modempoller_cpu_seconds CPU time of the last cycle\n# TYPE modempoller_cpu_seconds gauge\n");
+    fprintf(file, "modempoller_cpu_seconds{mode=\"user\"} %g\nmodempoller_cpu_seconds{mode=\"system\"} %g\n", phases->userCpu / 1e6, phases->systemCpu / 1e6);
+    fprintf(file, "# HELP modempoller_max_rss_bytes Peak resident set size\n# TYPE modempoller_max_rss_bytes gauge\nmodempoller_max_rss_bytes %ld\n", phases->maxRss * 1024);
+
+    if (shardCount) {
+        fprintf(file, "# HELP modempoller_shard_completion_seconds Time into the last cycle, when the last modem of the shard finished\n# TYPE modempoller_shard_completion_seconds gauge\n");
+    }
+    for (i = 0; i < shardCount; i++) {
+        if (shardCompletion[i] >= 0) {
+            fprintf(file, "modempoller_shard_completion_seconds{shard=\"%d\"} %g\n", i, shardCompletion[i] / 1e6);
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Write the summary of a cycle as JSON
+ *
+ * FILE *file - the file
+ * metrics_t *metrics - the counters of the cycle
+ * phases_t *phases - durations of the cycle
+ *
+ * returns void
+ */
+void writeJson(FILE *file, metrics_t *metrics, phases_t *phases)
+{
+    int i, j;
+    histogram_t *rtt;
+
+    fprintf(file, "{\n  \"cycle\": %ld,\n  \"start\": %ld,\n", cycles, (long)cycleStart.tv_sec);
+    fprintf(file, "  \"phases_ms\": {\"query_first_row\": %ld, \"query\": %ld, \"session_open\": %ld, \"poll\": %ld, \"output\": %ld, \"cycle\": %ld},\n",
+            phases->queryFirstRow / 1000, phases->query / 1000, phases->sessionOpen / 1000, phases->poll / 1000, phases->output / 1000, phases->cycle / 1000);
+    fprintf(file, "  \"cpu_ms\": {\"user\": %ld, \"system\": %ld},\n  \"max_rss_kb\": %ld,\n", phases->userCpu / 1000, phases->systemCpu / 1000, phases->maxRss);
+    fprintf(file, "  \"hosts\": {\"polled\": %lu, \"failed\": %lu, \"deadline\": %lu, \"engine_discoveries\": %lu},\n",
+            (u_long)metrics->hosts, (u_long)metrics->failedHosts, (u_long)metrics->deadlines, (u_long)metrics->discoveries);
+
+    fprintf(file, "  \"requests\": {");
+    for (i = 0; i < FINISH; i++) {
+        fprintf(file, "%s\"%s\": %lu", i ? ", " : "", segmentNames[i], (u_long)metrics->requests[i]);
+    }
+    fprintf(file, "},\n");
+
+    fprintf(file, "  \"retransmissions\": %lu,\n  \"responses\": %lu,\n  \"timeouts\": %lu,\n  \"unexpected_responses\": %lu,\n  \"too_big_responses\": %lu,\n  \"varbinds\": %lu,\n  \"unchanged_varbinds\": %lu,\n",
+            (u_long)metrics->retransmissions, (u_long)metrics->responses, (u_long)metrics->timeouts,
+            (u_long)metrics->unexpected, (u_long)metrics->tooBig, (u_long)metrics->varbinds, (u_long)metrics->unchanged);
+    fprintf(file, "  \"bytes\": {\"sent\": %lu, \"received\": %lu},\n", (u_long)metrics->bytesSent, (u_long)metrics->bytesReceived);
+    fprintf(file, "  \"syscalls\": {\"sendmmsg\": %lu, \"packets_sent\": %lu, \"send_errors\": %lu, \"recvmmsg\": %lu, \"packets_received\": %lu, \"saved\": %ld},\n",
+            (u_long)metrics->sendCalls, (u_long)metrics->packetsSent, (u_long)metrics->sendErrors, (u_long)metrics->receiveCalls, (u_long)metrics->packetsReceived,
+            (long)(metrics->packetsSent - metrics->sendCalls + metrics->packetsReceived - metrics->receiveCalls));
+    fprintf(file, "  \"event_loop\": {\"wakeups\": %lu, \"events\": %lu},\n", (u_long)metrics->wakeups, (u_long)metrics->events);
+
+    if (shardCount) {
+        fprintf(file, "  \"shard_completion_ms\": {");
+        for (i = 0, j = 0; i < shardCount; i++) {
+            if (shardCompletion[i] >= 0) {
+                fprintf(file, "%s\"%d\": %ld", j++ ? ", " : "", i, shardCompletion[i] / 1000);
+            }
+        }
+        fprintf(file, "},\n");
+    }
+
+    fprintf(file, "  \"rtt_us\": {\n");
+    for (i = 0; i < FINISH; i++) {
+        rtt = &metrics->rtt[i];
+        fprintf(file, "    \"%s\": {\"count\": %lu, \"mean\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}%s\n",
+                segmentNames[i], (u_long)rtt->count, (u_long)(rtt->count ? rtt->sum / rtt->count : 0),
+                (u_long)histogramQuantile(rtt, 0.5), (u_long)histogramQuantile(rtt, 0.9), (u_long)histogramQuantile(rtt, 0.99),
+                (u_long)histogramQuantile(rtt, 0.999), (u_long)rtt->max, i < FINISH - 1 ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+}
+
+/*****************************************************************************/
+/*
+ * Export the metrics at the end of a cycle: the counters of all cycles as
+ * <prefix>.prom and the summary of the cycle as <prefix>.json. Both files
+ * are written to a temporary file and renamed, so that the collectors never
+ * read a half written file.
+ *
+ * metrics_t *metrics - the counters of the cycle
+ * phases_t *phases - durations of the cycle
+ *
+ * returns void
+ */
+void exportMetrics(metrics_t *metrics, phases_t *phases)
+{
+    int i;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    static const char *suffixes[] = { "prom", "json" };
+    FILE *file;
+
+    addMetrics(&totalMetrics, metrics);
+    cycles++;
+
+    for (i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s.%s", metricsPrefix, suffixes[i]);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        if (! (file = fopen(tmp, "w"))) {
+            perror(tmp);
+            continue;
+        }
+
+        if (i) {
+            writeJson(file, metrics, phases);
+        } else {
+            writePrometheus(file, &totalMetrics, phases);
+        }
+
+        if (fclose(file) || rename(tmp, path)) {
+            perror(path);
+        }
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Order of 32 bit integers for qsort
+ *
+ * const void *a - first integer
+ * const void *b - second integer
+ *
+ * returns int
+ */
+int compareInt32(const void *a, const void *b)
+{
+    return (*(const int32_t *)a > *(const int32_t *)b) - (*(const int32_t *)a < *(const int32_t *)b);
+}
 
-        if (! (hostContext->session = snmp_open(&session))) {
-            snmp_perror("snmp_open");
+/*****************************************************************************/
+/*
+ * Order of the samples by their frequency for qsort_r
+ *
+ * const void *a - index of the first sample
+ * const void *b - index of the second sample
+ * void *frequency - frequency column of the samples
+ *
+ * returns int
+ */
+int compareFrequency(const void *a, const void *b, void *frequency)
+{
+    return compareInt32((int32_t *)frequency + *(const size_t *)a, (int32_t *)frequency + *(const size_t *)b);
+}
+
+/*****************************************************************************/
+/*
+ * Move the samples of a worker to the end of the columns of the cycle
+ *
+ * channelSamples_t *into - columns of the cycle
+ * channelSamples_t *from - columns of the worker, which are emptied
+ *
+ * returns void
+ */
+void mergeSamples(channelSamples_t *into, channelSamples_t *from)
+{
+    int i;
+    size_t count = from->count;
+
+    reserveSamples(into, into->count + count);
+    memcpy(into->frequency + into->count, from->frequency, count * sizeof(int32_t));
+    memcpy(into->power + into->count, from->power, count * sizeof(int32_t));
+    memcpy(into->snr + into->count, from->snr, count * sizeof(int32_t));
+    memcpy(into->microreflections + into->count, from->microreflections, count * sizeof(int32_t));
+    for (i = 0; i < 3; i++) {
+        memcpy(into->codewords[i] + into->count, from->codewords[i], count * sizeof(int64_t));
+    }
+    into->count += count;
+    from->count = 0;
+}
+
+/*****************************************************************************/
+/*
+ * Copy the values of a column of the given samples into a contiguous
+ * buffer, leaving out the values the modems did not report. The loop has no
+ * branches, so that the compiler can vectorize it.
+ *
+ * int32_t *column - the column
+ * size_t *order - indexes of the samples
+ * size_t count - number of samples
+ * int32_t *values - buffer of count values
+ *
+ * returns size_t - number of values
+ */
+size_t gatherColumn(int32_t *column, size_t *order, size_t count, int32_t *values)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        values[n] = column[order[i]];
+        n += values[n] != NO_SAMPLE;
+    }
+
+    return n;
+}
+
+/*****************************************************************************/
+/*
+ * Write the distribution of the values of a channel: minimum, percentiles,
+ * maximum, mean and a histogram of SUMMARY_BINS bins, whose first and last
+ * bin include the values beyond the range
+ *
+ * FILE *file - the summary
+ * const char *name - name of the value
+ * int32_t *values - the values, which are sorted
+ * size_t count - number of values
+ * int lower - lower bound of the histogram
+ * int width - width of a bin
+ *
+ * returns void
+ */
+void writeDistribution(FILE *file, const char *name, int32_t *values, size_t count, int lower, int width)
+{
+    size_t i;
+    int bin;
+    int64_t sum = 0;
+    uint32_t bins[SUMMARY_BINS] = { 0 };
+
+    if (! count) {
+        fprintf(file, ", \"%s\": null", name);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    for (i = 0; i < count; i++) {
+        bin = (values[i] - lower) / width;
+        bins[bin < 0 ? 0 : bin < SUMMARY_BINS ? bin : SUMMARY_BINS - 1]++;
+    }
+    qsort(values, count, sizeof(int32_t), compareInt32);
+
+    fprintf(file, ", \"%s\": {\"min\": %d, \"p10\": %d, \"p50\": %d, \"p90\": %d, \"max\": %d, \"mean\": %.1f, \"histogram\": {\"lower\": %d, \"width\": %d, \"counts\": [",
+            name, values[0], values[count / 10], values[count / 2], values[count * 9 / 10], values[count - 1], (double)sum / count, lower, width);
+    for (i = 0; i < SUMMARY_BINS; i++) {
+        fprintf(file, "%s%u", i ? ", " : "", bins[i]);
+    }
+    fprintf(file, "]}}");
+}
+
+/*****************************************************************************/
+/*
+ * Write the summary of the channels per frequency. The samples are ordered
+ * by frequency and the values of each frequency gathered column by column.
+ * The codeword error ratios are the sums of the counter differences of all
+ * channels of the frequency.
+ *
+ * FILE *file - the summary
+ * channelSamples_t *samples - the channels of all hosts
+ * int upstream - the samples are upstream channels
+ *
+ * returns void
+ */
+void writeChannels(FILE *file, channelSamples_t *samples, int upstream)
+{
+    size_t i, j, start, count;
+    size_t *order = malloc((samples->count + 1) * sizeof(size_t));
+    int32_t *values = malloc((samples->count + 1) * sizeof(int32_t));
+    int64_t total, corrected, uncorrectable;
+
+    for (i = 0; i < samples->count; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, samples->count, sizeof(size_t), compareFrequency, samples->frequency);
+
+    for (start = 0; start < samples->count; start += count) {
+        for (count = 1; start + count < samples->count && samples->frequency[order[start + count]] == samples->frequency[order[start]]; count++);
+
+        fprintf(file, "%s    {\"frequency\": %d, \"channels\": %zu", start ? ",\n" : "", samples->frequency[order[start]], count);
+        if (upstream) {
+            writeDistribution(file, "power", values, gatherColumn(samples->power, order + start, count, values), 300, 10);
+            fprintf(file, "}");
             continue;
         }
-        hostContext->outputFile = (oids == oids_single) ? stdout : fopen(PQgetvalue(result, i, 2), "w");
-        fprintf(hostContext->outputFile, "ipv4:%s\n", PQgetvalue(result, i, 0));
 
-        for (j = NON_REP; j < FINISH; j++) {
-            if (! request[j]) {
-                hostContext->requestIds[j] = 0;
-                continue;
-            }
+        writeDistribution(file, "power", values, gatherColumn(samples->power, order + start, count, values), -200, 10);
+        writeDistribution(file, "snr", values, gatherColumn(samples->snr, order + start, count, values), 200, 10);
+        writeDistribution(file, "microreflections", values, gatherColumn(samples->microreflections, order + start, count, values), 0, 1);
 
-            if (snmp_send(hostContext->session, newRequest = snmp_clone_pdu(request[j]))) {
-                hostContext->requestIds[j] = newRequest->reqid;
-                if (j == NON_REP) {
-                    activeHosts++;
-                }
-            } else {
-                snmp_perror("snmp_send");
-                snmp_free_pdu(newRequest);
+        total = corrected = uncorrectable = 0;
+        for (i = start; i < start + count; i++) {
+            if ((j = order[i], samples->codewords[0][j] >= 0)) {
+                total += samples->codewords[0][j] + samples->codewords[1][j] + samples->codewords[2][j];
+                corrected += samples->codewords[1][j];
+                uncorrectable += samples->codewords[2][j];
             }
         }
+        fprintf(file, ", \"codewords\": {\"total\": %ld, \"corrected_ratio\": %g, \"uncorrectable_ratio\": %g}}",
+                (long)total, total ? (double)corrected / total : 0, total ? (double)uncorrectable / total : 0);
     }
-    PQclear(result);
+    fprintf(file, "%s", samples->count ? "\n" : "");
 
-    int numfds, block;
-    struct timeval timeout;
-    netsnmp_large_fd_set fdset;
-    netsnmp_large_fd_set_init(&fdset, FD_SETSIZE);
+    free(order);
+    free(values);
+}
+
+/*****************************************************************************/
+/*
+ * Write the plant summary of the cycle: the downstream and upstream channels
+ * of all modems per frequency. It is written to a temporary file and renamed,
+ * so that dashboards never read a half written file.
+ *
+ * worker_t *workers - the workers, whose samples are consumed
+ *
+ * returns void
+ */
+void writeSummary(worker_t *workers)
+{
+    int i;
+    char tmp[PATH_MAX];
+    FILE *file;
+    channelSamples_t downstream = { 0 }, upstream = { 0 };
 
-    time_t endwait = time(NULL) + (RETRIES + 2) * TIMEOUT;
+    for (i = 0; i < threadCount; i++) {
+        mergeSamples(&downstream, &workers[i].downstream);
+        mergeSamples(&upstream, &workers[i].upstream);
+    }
 
-    /* async event loop - loops while any active hosts or until timeout */
-    while (activeHosts > 0 && time(NULL) < endwait) {
-        numfds = 0;
-        NETSNMP_LARGE_FD_ZERO(&fdset);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        block = 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", summaryPath);
+    if ((file = fopen(tmp, "w"))) {
+        fprintf(file, "{\n  \"start\": %ld,\n  \"downstream\": [\n", (long)cycleStart.tv_sec);
+        writeChannels(file, &downstream, 0);
+        fprintf(file, "  ],\n  \"upstream\": [\n");
+        writeChannels(file, &upstream, 1);
+        fprintf(file, "  ]\n}\n");
+        if (fclose(file) || rename(tmp, summaryPath)) {
+            perror(summaryPath);
+        }
+    } else {
+        perror(tmp);
+    }
 
-        snmp_sess_select_info2(NULL, &numfds, &fdset, &timeout, &block);
-        numfds = netsnmp_large_fd_set_select(numfds, &fdset, NULL, NULL, &timeout);
+    freeSamples(&downstream);
+    freeSamples(&upstream);
+}
 
-        if (numfds < 0) {
-            perror("select failed");
+/*****************************************************************************/
+/*
+ * Run a single polling cycle. The rows of the query are fetched one by one
+ * (single row mode) and handed over to the workers round robin as they
+ * arrive, so that the first requests are sent before the query is complete.
+ * Host names are handed over by the resolver thread, once they are resolved.
+ *
+ * PGconn *conn - SQL connection
+ * char *query - SQL query
+ * worker_t *workers - the workers
+ *
+ * returns void
+ */
+void pollCycle(PGconn *conn, char *query, worker_t *workers)
+{
+    int i, j;
+    long hostCount = 0;
+    arena_t hosts = { NULL };                           /* host contexts and their strings */
+    PGresult *result;
+    FILE *list = NULL;
+    char line[4096], *fields[5];
+    struct timeval started, stopped;
+    struct rusage before, after;
+    phases_t phases = { 0 };
+    metrics_t metrics;
+
+    gettimeofday(&started, NULL);
+    getrusage(RUSAGE_SELF, &before);
+
+    if (hostList && ! (list = fopen(hostList, "r"))) {
+        perror(hostList);
+        if (! interval) {
             exit(1);
         }
+        return;
+    }
 
-        if (numfds) {
-            snmp_read2(&fdset);
-        } else {
-            snmp_timeout();
+    /* the shards are leased before each cycle, the query selects the modems of the leased shards */
+    if (shardCount && shardIndex < 0) {
+        leaseShards(conn);
+    }
+    if (! hostList && (! PQsendQuery(conn, query) || ! PQsetSingleRowMode(conn))) {
+        fprintf(stderr, "No data retrieved: %s", PQerrorMessage(conn));
+        if (! interval) {
+            exit(1);
+        }
+
+        /* the daemon tries again with a new connection in the next cycle */
+        PQreset(conn);
+        PQclear(PQexec(conn, "SET search_path TO nmsprime"));
+        return;
+    }
+
+    for (i = 0; i < threadCount; i++) {
+        workers[i].fed = 0;
+        workers[i].feeding = 1;
+        memset(&workers[i].metrics, 0, sizeof(metrics_t));
+        for (j = 0; j < shardCount; j++) {
+            workers[i].shardDone[j] = -1;
+        }
+    }
+
+    /* the text output of the finished hosts is written by its own thread */
+    if (! recordResults) {
+        startWriter(&writer, writeOutputs);
+    }
+    if (copyConn) {
+        startWriter(&sink, copyResults);
+    }
+
+    for (i = 0; i < threadCount; i++) {
+        if (pthread_create(&workers[i].thread, NULL, pollShard, &workers[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    resolver.stop = 0;
+    if (pthread_create(&resolver.thread, NULL, resolveHosts, NULL)) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    /* startup the hosts as the rows arrive, the states are only looked up here */
+    while (list && fgets(line, sizeof(line), list)) {
+        /* without the database the shard is selected here */
+        if (parseHostLine(line, fields) && (! shardCount || strtoul(fields[4], NULL, 10) % shardCount == (u_long)shardIndex)) {
+            if (! hostCount) {
+                phases.queryFirstRow = usSince(&started);
+            }
+            feedHost(&workers[hostCount++ % threadCount], &hosts, fields);
+        }
+    }
+    if (list) {
+        fclose(list);
+    }
+
+    while (! list && (result = PQgetResult(conn))) {
+        if (PQresultStatus(result) == PGRES_SINGLE_TUPLE) {
+            if (! hostCount) {
+                phases.queryFirstRow = usSince(&started);
+            }
+            for (i = 0; i < 5; i++) {
+                fields[i] = PQgetvalue(result, 0, i);
+            }
+            feedHost(&workers[hostCount++ % threadCount], &hosts, fields);
+        } else if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            fprintf(stderr, "No data retrieved: %s", PQerrorMessage(conn));
+            if (! interval) {
+                exit(1);
+            }
+        }
+        PQclear(result);
+    }
+    phases.query = usSince(&started);
+
+    /* the hosts are only complete, once the resolver handed over the last of them */
+    pthread_mutex_lock(&resolver.lock);
+    resolver.stop = 1;
+    pthread_cond_signal(&resolver.wake);
+    pthread_mutex_unlock(&resolver.lock);
+    pthread_join(resolver.thread, NULL);
+
+    for (i = 0; i < threadCount; i++) {
+        closeFeed(&workers[i]);
+    }
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    phases.poll = usSince(&started);
+
+    gettimeofday(&stopped, NULL);
+    if (! recordResults) {
+        stopWriter(&writer);
+    }
+    if (copyConn) {
+        stopWriter(&sink);
+    }
+    phases.output = usSince(&stopped);
+    phases.cycle = usSince(&started);
+    getrusage(RUSAGE_SELF, &after);
+    phases.userCpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000L + after.ru_utime.tv_usec - before.ru_utime.tv_usec;
+    phases.systemCpu = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000L + after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+    phases.maxRss = after.ru_maxrss;
+
+    memset(&metrics, 0, sizeof(metrics));
+    for (i = 0; i < threadCount; i++) {
+        addMetrics(&metrics, &workers[i].metrics);
+    }
+    /* the sink was joined, so it does not count any more */
+    metrics.copyFailures = copyFailedHosts;
+    copyFailedHosts = 0;
+    for (i = 0; i < shardCount; i++) {
+        for (j = 0, shardCompletion[i] = -1; j < threadCount; j++) {
+            if (workers[j].shardDone[i] > shardCompletion[i]) {
+                shardCompletion[i] = workers[j].shardDone[i];
+            }
+        }
+    }
+    if (shardCount && shardIndex < 0) {
+        reportShards(conn);
+    }
+    phases.sessionOpen = metrics.sessionOpen;
+    if (metricsPrefix) {
+        exportMetrics(&metrics, &phases);
+    }
+    if (summaryPath) {
+        writeSummary(workers);
+    }
+
+    arenaFree(&hosts);
+}
+
+/*****************************************************************************/
+/*
+ * Wait for the start of the next cycle of the daemon mode. SIGINT and SIGTERM
+ * are blocked in all threads and only accepted here, so that the current
+ * cycle is always completed and its results and states are written.
+ *
+ * sigset_t *signals - the blocked signals
+ *
+ * returns int - 0 if the daemon should stop
+ */
+int waitForCycle(sigset_t *signals)
+{
+    struct timeval now;
+    struct timespec remaining = { 0, 0 };
+    long usec;
+
+    gettimeofday(&now, NULL);
+    usec = (cycleStart.tv_sec + interval - now.tv_sec) * 1000000L + cycleStart.tv_usec - now.tv_usec;
+    if (usec < 0) {
+        fprintf(stderr, "Polling cycle took %ld ms longer than the interval\n", -usec / 1000);
+    } else {
+        remaining.tv_sec = usec / 1000000;
+        remaining.tv_nsec = usec % 1000000 * 1000;
+    }
+
+    while (sigtimedwait(signals, NULL, &remaining) < 0) {
+        if (errno == EAGAIN) {
+            return 1;
         }
+        if (errno != EINTR) {
+            perror("sigtimedwait");
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/*****************************************************************************/
+/*
+ * Initiates the asynchronous SNMP transfer. The hosts are split round robin
+ * into one shard per worker. Each worker owns the sessions, event loop and
+ * contexts of its hosts, so the workers do not share any mutable state while
+ * polling. In daemon mode the cycles are repeated every interval, keeping the
+ * workers, their socket pools, the learned host states and the connection.
+ *
+ * PGconn *conn - SQL connection
+ * char *query - SQL query
+ *
+ * returns void
+ */
+void asynchronous(PGconn *conn, char *query)
+{
+    int i;
+    worker_t workers[threadCount];
+    sigset_t signals;
+
+    /* the signals are inherited by the workers and only accepted between the cycles */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (interval) {
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
     }
 
+    for (i = 0; i < threadCount; i++) {
+        openWorker(&workers[i]);
+    }
+    if (servicePath) {
+        startService();
+    }
+
+    do {
+        gettimeofday(&cycleStart, NULL);
+        /* the first cycle with a new cache and every n-th cycle output all values */
+        if (cache) {
+            deltaCycle = cache->cycle++ % snapshotCycles != 0;
+        }
+        if (resultPath) {
+            openResults(resultPath);
+        }
+
+        pollCycle(conn, query, workers);
+
+        /* the cache updates of the result file refer to the entries before the cache grows */
+        if (resultPath) {
+            closeResults(resultPath);
+        }
+        if (cache && cache->count > cache->size / 2) {
+            growCache(cachePath);
+        }
+        if (stateFile) {
+            saveStates(stateFile);
+        }
+    } while (interval && waitForCycle(&signals));
+
     /* cleanup */
-    for (i = NON_REP; i < FINISH; i++) {
-        snmp_free_pdu(request[i]);
+    if (servicePath) {
+        stopService();
+    }
+    for (i = 0; i < threadCount; i++) {
+        closeWorker(&workers[i]);
+    }
+    freeProfile(polledProfile);
+    if (servicePath && polledProfile != &singleProfile) {
+        freeProfile(&singleProfile);
     }
 
     snmp_shutdown("asynchapp");
@@ -563,33 +7368,123 @@ void asynchronous(PGconn *conn, char *query)
 int main(int argc, char **argv)
 {
     int c, analysis = 0;
-    const char *database = NULL, *hostname = NULL, *modem = NULL, *password = NULL, *username = NULL;
-    static char usage[] = "usage: %s [-a (to be used for single modem analysis view)] [-d nmsprime_db_name] [-h hostname] [-m modem-id] [-p nmsprime_db_password] [-u nmsprime_db_username]\n";
-    char query[512];
-    PGconn *conn;
+    const char *database = NULL, *group = "''", *hostname = NULL, *modem = NULL, *output = NULL, *password = NULL, *username = NULL;
+    static char usage[] = "usage: %s [-a (to be used for single modem analysis view)] [-A auth_passphrase] [-b response_size_budget] [-B packets_per_syscall] [-c result_table] [-C change_cache_file] [-d nmsprime_db_name] [-D (write output files with O_DIRECT)] [-e (use epoll event loop)] [-f host_list_file] [-F (fdatasync output files)] [-g group_column] [-h hostname] [-H stub_hosts_file] [-i polling_interval] [-k shard_index/shard_count] [-l outstanding_requests_per_group] [-m modem-id] [-M metrics_prefix] [-N cycles_between_snapshots] [-o binary_result_file] [-p nmsprime_db_password] [-P plant_summary_file] [-q query_service_socket] [-r requests_per_second] [-s number_of_shared_sockets] [-S state_file] [-t number_of_threads] [-u nmsprime_db_username] [-U security_name] [-w outstanding_requests] [-x (send pre-encoded requests, bypassing netsnmp)] [-X priv_passphrase] [-z (decode responses without netsnmp, implies -x)]\n";
+    char query[1024], shards[256] = "";
+    PGconn *conn = NULL;
 
-    while ((c = getopt(argc, argv, "ad:h:m:p:u:")) != -1) {
+    while ((c = getopt(argc, argv, "aA:b:B:c:C:d:Def:Fg:h:H:i:k:l:m:M:N:o:p:P:q:r:s:S:t:u:U:w:xX:z")) != -1) {
         switch (c) {
         case 'a':
             analysis = 1;
             break;
+        case 'A':
+            authPassphrase = optarg;
+            break;
+        case 'b':
+            responseBudget = atol(optarg) > 0 ? atol(optarg) : RESPONSE_BUDGET;
+            break;
+        case 'B':
+            batchSize = atoi(optarg) > 0 ? atoi(optarg) : BATCH_SIZE;
+            batchSize = batchSize > MAX_BATCH_SIZE ? MAX_BATCH_SIZE : batchSize;
+            break;
+        case 'c':
+            copyTable = optarg;
+            break;
+        case 'C':
+            cachePath = optarg;
+            break;
         case 'd':
             database = optarg;
             break;
+        case 'D':
+            directIo = 1;
+            break;
+        case 'e':
+            useEpoll = 1;
+            break;
+        case 'F':
+            syncOutput = 1;
+            break;
+        case 'g':
+            if (! isColumnName(optarg)) {
+                fprintf(stderr, "The group has to be a column, optionally qualified by its table: %s\n", optarg);
+                exit(1);
+            }
+            group = optarg;
+            break;
         case 'h':
             hostname = optarg;
             break;
+        case 'H':
+            loadStubHosts(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'f':
+            hostList = optarg;
+            break;
+        case 'k':
+            parseShards(optarg);
+            break;
+        case 'l':
+            groupLimit = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'M':
+            metricsPrefix = optarg;
+            break;
         case 'm':
             modem = optarg;
             break;
+        case 'N':
+            snapshotCycles = atoi(optarg) > 0 ? atoi(optarg) : SNAPSHOT_CYCLES;
+            break;
+        case 'o':
+            output = optarg;
+            break;
         case 'p':
             password = optarg;
             break;
+        case 'P':
+            summaryPath = optarg;
+            break;
+        case 'q':
+            servicePath = optarg;
+            break;
+        case 'r':
+            rate = atof(optarg) > 0 ? atof(optarg) : 0;
+            break;
+        case 's':
+            poolSize = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'S':
+            stateFile = optarg;
+            break;
+        case 't':
+            threadCount = atoi(optarg) > 1 ? atoi(optarg) : 1;
+            break;
         case 'u':
             username = optarg;
             break;
+        case 'U':
+            securityName = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'x':
+            rawTransport = 1;
+            break;
+        case 'X':
+            privPassphrase = optarg;
+            break;
+        case 'z':
+            rawTransport = 1;
+            builtinDecoder = 1;
+            break;
         case '?':
-            if (optopt == 'd' || optopt == 'h' || optopt == 'm' || optopt == 'p' || optopt == 'u') {
+            if (optopt && strchr("AbBcCdfghHiklmMNopPqrsStuUwX", optopt)) {
                 fprintf(stderr, "Option -%c requires an argument.\n", optopt);
             } else if (isprint(optopt)) {
                 fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -604,19 +7499,95 @@ int main(int argc, char **argv)
         }
     }
 
-    oids = analysis ? oids_single : oids_multiple;
+    polledProfile = analysis ? &singleProfile : &bulkProfile;
+
+    if (securityName && (! authPassphrase || rawTransport)) {
+        fprintf(stderr, "SNMPv3 requires an authentication passphrase (-A) and cannot be used with -x or -z.\n");
+        return 1;
+    }
+
+    if (shardCount && shardIndex < 0 && (! interval || hostList || modem)) {
+        fprintf(stderr, "Leasing the shards (-k shard_count) needs the daemon mode (-i) and the database.\n");
+        return 1;
+    }
+
+    if (servicePath && ! interval) {
+        fprintf(stderr, "The query service (-q) is only available in daemon mode (-i).\n");
+        return 1;
+    }
+
+    /* the select loop handles all sessions of netsnmp at once, workers need their own event loop */
+    if (threadCount > 1 || servicePath) {
+        useEpoll = 1;
+    }
+
+    /* the raw transport sends on the socket pool and is driven by the epoll loop */
+    if (rawTransport) {
+        useEpoll = 1;
+        poolSize = poolSize ? poolSize : 1;
+    }
+
+    /*
+     * the daemon keeps the sockets of the pool open across the cycles and
+     * spreads the starts of the hosts over the first three quarters of the
+     * interval, the rest is left for the last hosts to complete
+     */
+    if (interval) {
+        poolSize = poolSize ? poolSize : 1;
+        spread = interval * 750000L;
+    }
 
     if (modem) {
         uint32_t modemId = strtoul(modem, NULL, 10);
-        snprintf(query, sizeof(query), "SET search_path TO nmsprime; SELECT CONCAT(modem.hostname, '.', provbase.domain_name), provbase.ro_community, CONCAT(modem.hostname, '.', provbase.domain_name) FROM modem, provbase WHERE modem.deleted_at IS NULL AND provbase.deleted_at IS NULL AND modem.hostname = 'cm-%u';", modemId);
+        snprintf(query, sizeof(query), "SELECT CONCAT(modem.hostname, '.', provbase.domain_name), provbase.ro_community, CONCAT(modem.hostname, '.', provbase.domain_name), COALESCE(CAST(%s AS TEXT), ''), modem.id FROM modem, provbase WHERE modem.deleted_at IS NULL AND provbase.deleted_at IS NULL AND modem.hostname = 'cm-%u';", group, modemId);
     } else {
-        snprintf(query, sizeof(query), "SET search_path TO nmsprime; SELECT COALESCE(host(modem.ipv4), CONCAT(modem.hostname, '.', provbase.domain_name)), provbase.ro_community, CONCAT(modem.hostname, '.', provbase.domain_name) FROM modem, provbase WHERE modem.deleted_at IS NULL AND provbase.deleted_at IS NULL AND modem.hostname LIKE 'cm-%%';");
+        /* each node only loads the modems of its shards */
+        if (shardCount && shardIndex >= 0) {
+            snprintf(shards, sizeof(shards), " AND modem.id %% %d = %d", shardCount, shardIndex);
+        } else if (shardCount) {
+            snprintf(shards, sizeof(shards), " AND modem.id %% %d IN (SELECT shard FROM modempoller_lease WHERE node = '%s' AND expires > now())", shardCount, nodeName);
+        }
+        snprintf(query, sizeof(query), "SELECT COALESCE(host(modem.ipv4), CONCAT(modem.hostname, '.', provbase.domain_name)), provbase.ro_community, CONCAT(modem.hostname, '.', provbase.domain_name), COALESCE(CAST(%s AS TEXT), ''), modem.id FROM modem, provbase WHERE modem.deleted_at IS NULL AND provbase.deleted_at IS NULL AND modem.hostname LIKE 'cm-%%'%s;", group, shards);
     }
 
     initialize();
-    conn = connectToSql(hostname, username, password, database);
+    if (securityName) {
+        initUsm();
+    }
+    if (stateFile) {
+        loadStates(stateFile);
+    }
+    if (cachePath) {
+        openCache(cachePath);
+    }
+    resultPath = output;
+    recordResults = output || copyTable;
+    if (! hostList) {
+        conn = connectToSql(hostname, username, password, database);
+        PQclear(PQexec(conn, "SET search_path TO nmsprime"));
+    }
+    if (shardCount && shardIndex < 0) {
+        initLeases(conn);
+    }
+    if (copyTable) {
+        copyConn = connectToSql(hostname, username, password, database);
+        PQclear(PQexec(copyConn, "SET search_path TO nmsprime"));
+        copyTarget = quoteIdentifier(copyConn, copyTable);
+    }
+    if (servicePath && ! hostList) {
+        service.conn = connectToSql(hostname, username, password, database);
+        PQclear(PQexec(service.conn, "SET search_path TO nmsprime"));
+        snprintf(service.query, sizeof(service.query), "SELECT CONCAT(modem.hostname, '.', provbase.domain_name), provbase.ro_community, CONCAT(modem.hostname, '.', provbase.domain_name), COALESCE(CAST(%s AS TEXT), ''), modem.id FROM modem, provbase WHERE modem.deleted_at IS NULL AND provbase.deleted_at IS NULL AND modem.hostname = $1;", group);
+    }
     asynchronous(conn, query);
     PQfinish(conn);
+    if (copyConn) {
+        PQfinish(copyConn);
+        free(copyTarget);
+    }
+    if (service.conn) {
+        PQfinish(service.conn);
+    }
     fcloseall();
 
     return 0;
@@ -0,0 +1,1417 @@
+/*
+ * Simulator of DOCSIS cable modems for benchmarks of the NMS Prime modem
+ * poller. A single process answers the SNMP requests for thousands of modems
+ * on the loopback network: each modem has its own address (127.1.0.1 and
+ * following by default) and the tables of oids_single and oids_multiple of the
+ * poller. The modems are DOCSIS 3.0 or 3.1 with configurable channel counts,
+ * latency, loss and vendor quirks. The values are derived from the number of
+ * the modem, so that each run sees the same plant.
+ *
+ * The simulator does not depend on netsnmp, it decodes the requests and
+ * encodes the responses itself.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_OID_LEN 128                                 /* sub-identifiers of an oid */
+#define MAX_REQUEST_VARBINDS 128                        /* varbinds of a request, which are answered */
+#define MAX_REPETITIONS 1024                            /* max-repetitions are capped to this value */
+#define BATCH_SIZE 32                                   /* packets per recvmmsg / sendmmsg call */
+#define PACKET_SIZE 65536                               /* size of a receive buffer */
+#define MAX_RESPONSE 65507                              /* largest UDP payload */
+#define TOO_BIG_LIMIT 1472                              /* responses above this size are refused by modems with the tooBig quirk */
+#define HEADROOM 512                                    /* room for the message header in front of the varbinds */
+#define SOCKET_BUFFER (8 * 1024 * 1024)                 /* receive and send buffer of the sockets */
+#define BANDS 6                                         /* bands of the power table of an OFDM channel */
+#define PROFILES 4                                      /* profiles of an OFDM channel */
+
+/* BER types of SNMP */
+#define ASN_INTEGER 0x02
+#define ASN_OCTET_STR 0x04
+#define ASN_NULL 0x05
+#define ASN_OBJECT_ID 0x06
+#define ASN_SEQUENCE 0x30
+#define ASN_COUNTER 0x41
+#define ASN_GAUGE 0x42
+#define ASN_TIMETICKS 0x43
+#define ASN_COUNTER64 0x46
+#define SNMP_NOSUCHINSTANCE 0x81
+#define SNMP_ENDOFMIBVIEW 0x82
+#define SNMP_MSG_GET 0xa0
+#define SNMP_MSG_GETNEXT 0xa1
+#define SNMP_MSG_RESPONSE 0xa2
+#define SNMP_MSG_GETBULK 0xa5
+#define SNMP_ERR_TOOBIG 1
+
+/* how the objects are instantiated */
+typedef enum table {
+    SCALAR,                                             /* a single instance .0 */
+    CM_STATUS,                                          /* row of the cable mac interface */
+    INTERFACES,                                         /* ethernet and cable mac interface */
+    DOWNSTREAM,                                         /* one row per SC-QAM downstream channel */
+    UPSTREAM,                                           /* one row per SC-QAM upstream channel */
+    OFDM,                                               /* one row per OFDM downstream channel, DOCSIS 3.1 only */
+    OFDMA,                                              /* one row per OFDMA upstream channel, DOCSIS 3.1 only */
+    OFDM_BANDS,                                         /* OFDM channel and band */
+    OFDM_PROFILES,                                      /* OFDM channel and profile */
+} table_t;
+
+typedef struct object {                                 /* an object of the simulated MIB */
+    const char *name;
+    table_t table;
+    u_char type;
+    long base;                                          /* value of the first row */
+    long step;                                          /* added for each further row */
+    long spread;                                        /* range of the variation between the modems */
+    long rate;                                          /* added per second, for counters */
+    long docsis31;                                      /* added for DOCSIS 3.1 modems */
+    const char *text;                                   /* value of strings */
+    uint32_t oid[MAX_OID_LEN];
+    size_t oidLen;
+} object_t;
+
+/* the objects polled by oids_single and oids_multiple */
+object_t objects[] = {
+    { "1.3.6.1.2.1.1.1", SCALAR, ASN_OCTET_STR, .text = "<<HW_REV: 1.0; VENDOR: NMS Prime; BOOTR: 1.0; SW_REV: 1.0.0; MODEL: Simulated cable modem>>" },
+    { "1.3.6.1.2.1.1.3", SCALAR, ASN_TIMETICKS, 0, 0, 8640000, 100 },                 /* sysUpTime */
+    { "1.3.6.1.2.1.10.127.1.1.5", SCALAR, ASN_INTEGER, 4, .docsis31 = 1 },             /* docsIfDocsisBaseCapability */
+    { "1.3.6.1.2.1.10.127.1.1.1.1.2", DOWNSTREAM, ASN_INTEGER, 114000000, 8000000 },   /* frequency */
+    { "1.3.6.1.2.1.10.127.1.1.1.1.4", DOWNSTREAM, ASN_INTEGER, 4 },                    /* modulation */
+    { "1.3.6.1.2.1.10.127.1.1.1.1.6", DOWNSTREAM, ASN_INTEGER, -50, 0, 100 },          /* power */
+    { "1.3.6.1.2.1.10.127.1.1.2.1.2", UPSTREAM, ASN_INTEGER, 20000000, 6400000 },      /* frequency */
+    { "1.3.6.1.2.1.10.127.1.1.2.1.3", UPSTREAM, ASN_INTEGER, 6400000 },                /* width */
+    { "1.3.6.1.2.1.10.127.1.1.4.1.2", DOWNSTREAM, ASN_COUNTER, 0, 0, 1000000000, 100000 },/* unerrored */
+    { "1.3.6.1.2.1.10.127.1.1.4.1.3", DOWNSTREAM, ASN_COUNTER, 0, 0, 100000, 10 },     /* corrected */
+    { "1.3.6.1.2.1.10.127.1.1.4.1.4", DOWNSTREAM, ASN_COUNTER, 0, 0, 1000 },           /* uncorrectable */
+    { "1.3.6.1.2.1.10.127.1.1.4.1.5", DOWNSTREAM, ASN_INTEGER, 360, 0, 60 },           /* SNR */
+    { "1.3.6.1.2.1.10.127.1.1.4.1.6", DOWNSTREAM, ASN_INTEGER, 20, 0, 20 },            /* microreflections */
+    { "1.3.6.1.2.1.10.127.1.2.2.1.2", CM_STATUS, ASN_INTEGER, 12 },                    /* status code */
+    { "1.3.6.1.2.1.10.127.1.2.2.1.3", CM_STATUS, ASN_INTEGER, 400, 0, 120 },           /* US power */
+    { "1.3.6.1.2.1.10.127.1.2.2.1.12", CM_STATUS, ASN_COUNTER, 0, 0, 20 },             /* T3 timeouts */
+    { "1.3.6.1.2.1.10.127.1.2.2.1.13", CM_STATUS, ASN_COUNTER, 0, 0, 3 },              /* T4 timeouts */
+    { "1.3.6.1.2.1.10.127.1.2.2.1.17", CM_STATUS, ASN_OCTET_STR, .text = "\x08\x01\x18\x01" },/* PreEq */
+    { "1.3.6.1.2.1.31.1.1.1.6", INTERFACES, ASN_COUNTER64, 0, 0, 1000000000, 125000 }, /* ifHCInOctets */
+    { "1.3.6.1.2.1.31.1.1.1.10", INTERFACES, ASN_COUNTER64, 0, 0, 100000000, 12500 },  /* ifHCOutOctets */
+    { "1.3.6.1.2.1.69.1.3.5", SCALAR, ASN_OCTET_STR, .text = "1.0.0-sim" },            /* firmware */
+    { "1.3.6.1.4.1.4491.2.1.20.1.2.1.1", UPSTREAM, ASN_INTEGER, 400, 0, 120 },         /* US power (3.0) */
+    { "1.3.6.1.4.1.4491.2.1.20.1.2.1.9", UPSTREAM, ASN_INTEGER, 4 },                   /* ranging status */
+    { "1.3.6.1.4.1.4491.2.1.20.1.24.1.1", DOWNSTREAM, ASN_INTEGER, 360, 0, 60 },       /* SNR (3.0) */
+    { "1.3.6.1.4.1.4491.2.1.27.1.2.5.1.3", OFDM, ASN_GAUGE, 3800, 0, 600 },            /* average RxMER */
+    { "1.3.6.1.4.1.4491.2.1.27.1.2.5.1.4", OFDM, ASN_GAUGE, 100, 0, 100 },             /* RxMER std dev */
+    { "1.3.6.1.4.1.4491.2.1.28.1.9.1.3", OFDM, ASN_INTEGER, 33, 1 },                   /* channel id */
+    { "1.3.6.1.4.1.4491.2.1.28.1.9.1.4", OFDM, ASN_GAUGE, 600000000, 192000000 },      /* subcarrier zero frequency */
+    { "1.3.6.1.4.1.4491.2.1.28.1.9.1.5", OFDM, ASN_GAUGE, 148 },                       /* first active subcarrier */
+    { "1.3.6.1.4.1.4491.2.1.28.1.9.1.7", OFDM, ASN_GAUGE, 3700, 0, 100 },              /* active subcarriers */
+    { "1.3.6.1.4.1.4491.2.1.28.1.10.1.3", OFDM_PROFILES, ASN_COUNTER64, 0, 0, 1000000000, 50000 },/* total codewords */
+    { "1.3.6.1.4.1.4491.2.1.28.1.10.1.4", OFDM_PROFILES, ASN_COUNTER64, 0, 0, 100000, 10 },/* corrected codewords */
+    { "1.3.6.1.4.1.4491.2.1.28.1.10.1.5", OFDM_PROFILES, ASN_COUNTER64, 0, 0, 1000 },   /* uncorrectable codewords */
+    { "1.3.6.1.4.1.4491.2.1.28.1.10.1.6", OFDM_PROFILES, ASN_COUNTER64, 0, 0, 1000000000, 100000 },/* received bytes */
+    { "1.3.6.1.4.1.4491.2.1.28.1.10.1.7", OFDM_PROFILES, ASN_COUNTER64, 0, 0, 1000000000, 90000 },/* received unicast bytes */
+    { "1.3.6.1.4.1.4491.2.1.28.1.11.1.2", OFDM_BANDS, ASN_GAUGE, 600000000, 32000000 }, /* center frequency */
+    { "1.3.6.1.4.1.4491.2.1.28.1.11.1.3", OFDM_BANDS, ASN_INTEGER, -40, 0, 80 },      /* power */
+    { "1.3.6.1.4.1.4491.2.1.28.1.13.1.2", OFDMA, ASN_INTEGER, 41, 1 },                 /* channel id */
+    { "1.3.6.1.4.1.4491.2.1.28.1.13.1.3", OFDMA, ASN_GAUGE, 5000000 },                 /* subcarrier zero frequency */
+    { "1.3.6.1.4.1.4491.2.1.28.1.13.1.4", OFDMA, ASN_GAUGE, 74 },                      /* first active subcarrier */
+    { "1.3.6.1.4.1.4491.2.1.28.1.13.1.6", OFDMA, ASN_GAUGE, 1800, 0, 100 },            /* active subcarriers */
+    { "1.3.6.1.4.1.4491.2.1.28.1.13.1.10", OFDMA, ASN_INTEGER, 420, 0, 80 },           /* transmit power */
+    { NULL }
+};
+
+typedef struct instance {                               /* an instance of an object in the MIB of a class of modems */
+    uint32_t oid[MAX_OID_LEN];
+    size_t oidLen;
+    object_t *object;
+    long row;                                           /* position of the row within the table */
+} instance_t;
+
+typedef struct mib {                                    /* instances of a class of modems, sorted by oid */
+    instance_t *instances;
+    long count;
+} mib_t;
+
+typedef struct modem {                                  /* properties of a modem, derived from its number */
+    long number;
+    int docsis31;
+    int early;                                          /* ends each table with endOfMibView */
+    int tooBig;                                         /* answers tooBig, if the response exceeds TOO_BIG_LIMIT */
+} modem_t;
+
+typedef struct pending {                                /* a response waiting for its latency */
+    uint64_t due;                                       /* monotonic time in microseconds */
+    struct sockaddr_in peer;                            /* the poller */
+    struct in_addr local;                               /* address of the modem, the source of the response */
+    size_t len;
+    u_char data[];
+} pending_t;
+
+typedef struct agent {                                  /* a thread answering the requests of its socket */
+    pthread_t thread;
+    int fd;
+    uint64_t random;                                    /* state of the random generator */
+    pending_t **heap;                                   /* min heap of the delayed responses */
+    long count;
+    long size;
+    pending_t *outgoing[BATCH_SIZE];                    /* responses of the next sendmmsg call */
+    int queued;
+    long requests;
+    long responses;
+    long dropped;
+} agent_t;
+
+mib_t mibs[2];                                          /* DOCSIS 3.0 and 3.1 modems */
+struct in_addr firstAddress;                            /* address of the first modem */
+long modems = 1000;
+const char *community = "public";
+int downstreams = 32;
+int upstreams = 8;
+int ofdmChannels = 2;
+int ofdmaChannels = 1;
+int docsis31Percent = 50;
+int earlyPercent = 0;
+int tooBigPercent = 0;
+int offlinePercent = 0;
+int lossPercent = 0;
+long latency = 0;                                       /* microseconds */
+long jitter = 0;                                        /* microseconds */
+long maxResponse = MAX_RESPONSE;
+uint64_t seed = 0;
+uint64_t started;                                       /* monotonic start time in microseconds */
+volatile sig_atomic_t stopped = 0;
+
+/*****************************************************************************/
+/*
+ * Monotonic clock in microseconds
+ *
+ * returns uint64_t
+ */
+uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*****************************************************************************/
+/*
+ * Scramble the bits of a number (finalizer of splitmix64)
+ *
+ * uint64_t x - the number
+ *
+ * returns uint64_t
+ */
+uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+/*****************************************************************************/
+/*
+ * Pseudo random number of a modem, which is the same in every run with the
+ * same seed
+ *
+ * long modem - number of the modem
+ * long salt - distinguishes the numbers of a modem
+ * long row - row of a table
+ *
+ * returns uint64_t
+ */
+uint64_t modemHash(long modem, long salt, long row)
+{
+    return mix(seed ^ mix(((uint64_t)modem << 24) ^ ((uint64_t)salt << 12) ^ row));
+}
+
+/*****************************************************************************/
+/*
+ * Next number of the random generator of an agent (xorshift64)
+ *
+ * agent_t *agent - the agent
+ *
+ * returns uint64_t
+ */
+uint64_t nextRandom(agent_t *agent)
+{
+    agent->random ^= agent->random << 13;
+    agent->random ^= agent->random >> 7;
+    agent->random ^= agent->random << 17;
+
+    return agent->random;
+}
+
+/*****************************************************************************/
+/*
+ * Parse a numeric oid in dotted notation
+ *
+ * const char *name - the oid
+ * uint32_t *oid - the sub-identifiers
+ * size_t *oidLen - number of sub-identifiers
+ *
+ * returns int - 0 if the oid is invalid
+ */
+int parseName(const char *name, uint32_t *oid, size_t *oidLen)
+{
+    char *end;
+
+    for (*oidLen = 0; *name && *oidLen < MAX_OID_LEN; (*oidLen)++) {
+        oid[*oidLen] = strtoul(name, &end, 10);
+        if (end == name || (*end && *end != '.')) {
+            return 0;
+        }
+        name = *end ? end + 1 : end;
+    }
+
+    return *oidLen >= 2 && ! *name;
+}
+
+/*****************************************************************************/
+/*
+ * Compare two oids lexicographically
+ *
+ * const uint32_t *a, size_t aLen - first oid
+ * const uint32_t *b, size_t bLen - second oid
+ *
+ * returns int
+ */
+int compareOids(const uint32_t *a, size_t aLen, const uint32_t *b, size_t bLen)
+{
+    size_t i;
+
+    for (i = 0; i < aLen && i < bLen; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+
+    return aLen < bLen ? -1 : aLen > bLen;
+}
+
+/*****************************************************************************/
+/*
+ * qsort callback ordering the instances of a MIB by oid
+ *
+ * returns int
+ */
+int compareInstances(const void *a, const void *b)
+{
+    const instance_t *x = a, *y = b;
+
+    return compareOids(x->oid, x->oidLen, y->oid, y->oidLen);
+}
+
+/*****************************************************************************/
+/*
+ * Add an instance of an object to a MIB
+ *
+ * mib_t *mib - the MIB
+ * object_t *object - the object
+ * long row - position of the row within the table
+ * long index - first sub-identifier of the index
+ * long subindex - second sub-identifier of the index, -1 if the index has only one
+ *
+ * returns void
+ */
+void addInstance(mib_t *mib, object_t *object, long row, long index, long subindex)
+{
+    instance_t *instance;
+
+    mib->instances = realloc(mib->instances, (mib->count + 1) * sizeof(instance_t));
+    instance = &mib->instances[mib->count++];
+    memcpy(instance->oid, object->oid, object->oidLen * sizeof(uint32_t));
+    instance->oidLen = object->oidLen;
+    instance->oid[instance->oidLen++] = index;
+    if (subindex >= 0) {
+        instance->oid[instance->oidLen++] = subindex;
+    }
+    instance->object = object;
+    instance->row = row;
+}
+
+/*****************************************************************************/
+/*
+ * Build the MIB of a class of modems: the tables get one row per channel,
+ * indexed by the ifIndex of the channel like real modems do. DOCSIS 3.0
+ * modems do not have the objects of the DOCSIS 3.1 MIB.
+ *
+ * mib_t *mib - the MIB
+ * int docsis31 - whether the modems support DOCSIS 3.1
+ *
+ * returns void
+ */
+void buildMib(mib_t *mib, int docsis31)
+{
+    long i, j;
+    object_t *object;
+
+    for (object = objects; object->name; object++) {
+        switch (object->table) {
+        case SCALAR:
+            addInstance(mib, object, 0, 0, -1);
+            break;
+        case CM_STATUS:
+            addInstance(mib, object, 0, 2, -1);
+            break;
+        case INTERFACES:
+            addInstance(mib, object, 0, 1, -1);
+            addInstance(mib, object, 1, 2, -1);
+            break;
+        case DOWNSTREAM:
+            for (i = 0; i < downstreams; i++) {
+                addInstance(mib, object, i, i ? 47 + i : 3, -1);
+            }
+            break;
+        case UPSTREAM:
+            for (i = 0; i < upstreams; i++) {
+                addInstance(mib, object, i, i ? 79 + i : 4, -1);
+            }
+            break;
+        case OFDM:
+            for (i = 0; docsis31 && i < ofdmChannels; i++) {
+                addInstance(mib, object, i, 160 + i, -1);
+            }
+            break;
+        case OFDMA:
+            for (i = 0; docsis31 && i < ofdmaChannels; i++) {
+                addInstance(mib, object, i, 200 + i, -1);
+            }
+            break;
+        case OFDM_BANDS:
+            for (i = 0; docsis31 && i < ofdmChannels; i++) {
+                for (j = 0; j < BANDS; j++) {
+                    addInstance(mib, object, i * BANDS + j, 160 + i, j + 1);
+                }
+            }
+            break;
+        case OFDM_PROFILES:
+            for (i = 0; docsis31 && i < ofdmChannels; i++) {
+                for (j = 0; j < PROFILES; j++) {
+                    addInstance(mib, object, i * PROFILES + j, 160 + i, j);
+                }
+            }
+            break;
+        }
+    }
+
+    qsort(mib->instances, mib->count, sizeof(instance_t), compareInstances);
+}
+
+/*****************************************************************************/
+/*
+ * Derive the properties of a modem from its address
+ *
+ * struct in_addr address - address of the modem
+ * modem_t *modem - the properties
+ *
+ * returns int - 0 if there is no modem with the address or it is offline
+ */
+int getModem(struct in_addr address, modem_t *modem)
+{
+    modem->number = (long)ntohl(address.s_addr) - (long)ntohl(firstAddress.s_addr);
+    if (modem->number < 0 || modem->number >= modems) {
+        return 0;
+    }
+
+    modem->docsis31 = modemHash(modem->number, 1, 0) % 100 < (uint64_t)docsis31Percent;
+    modem->early = modemHash(modem->number, 2, 0) % 100 < (uint64_t)earlyPercent;
+    modem->tooBig = modemHash(modem->number, 3, 0) % 100 < (uint64_t)tooBigPercent;
+
+    return modemHash(modem->number, 4, 0) % 100 >= (uint64_t)offlinePercent;
+}
+
+/*****************************************************************************/
+/*
+ * Find the instance following an oid in the MIB of a modem, like a getNext
+ * request does. Modems with the early end quirk answer endOfMibView instead
+ * of continuing with the next object, once a table is complete.
+ *
+ * mib_t *mib - MIB of the modem
+ * modem_t *modem - the modem
+ * const uint32_t *oid, size_t oidLen - the oid
+ * long after - the instance of the oid, if it was returned by the previous repetition, otherwise -1
+ *
+ * returns long - the instance, -1 for endOfMibView
+ */
+long nextInstance(mib_t *mib, modem_t *modem, const uint32_t *oid, size_t oidLen, long after)
+{
+    long low = 0, high = mib->count, middle;
+    object_t *previous = NULL;
+
+    if (after >= 0) {
+        low = after + 1;
+        previous = mib->instances[after].object;
+    } else {
+        while (low < high) {
+            middle = (low + high) / 2;
+            if (compareOids(mib->instances[middle].oid, mib->instances[middle].oidLen, oid, oidLen) <= 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        /* the oid is within the column of the instance in front */
+        if (low && oidLen >= mib->instances[low - 1].object->oidLen &&
+            ! memcmp(oid, mib->instances[low - 1].object->oid, mib->instances[low - 1].object->oidLen * sizeof(uint32_t))) {
+            previous = mib->instances[low - 1].object;
+        }
+    }
+
+    if (low >= mib->count) {
+        return -1;
+    }
+    if (modem->early && previous && previous->table != SCALAR && mib->instances[low].object != previous) {
+        return -1;
+    }
+
+    return low;
+}
+
+/*****************************************************************************/
+/*
+ * Find an instance by its oid, like a get request does
+ *
+ * mib_t *mib - MIB of the modem
+ * const uint32_t *oid, size_t oidLen - the oid
+ *
+ * returns long - the instance, -1 if there is no such instance
+ */
+long findInstance(mib_t *mib, const uint32_t *oid, size_t oidLen)
+{
+    long low = 0, high = mib->count - 1, middle;
+    int order;
+
+    while (low <= high) {
+        middle = (low + high) / 2;
+        if (! (order = compareOids(mib->instances[middle].oid, mib->instances[middle].oidLen, oid, oidLen))) {
+            return middle;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return -1;
+}
+
+/*****************************************************************************/
+/*
+ * Write a BER length
+ *
+ * u_char *out - the buffer, NULL to only compute the size
+ * size_t len - the length
+ *
+ * returns size_t - bytes written
+ */
+size_t encodeLength(u_char *out, size_t len)
+{
+    size_t bytes, i;
+
+    if (len < 0x80) {
+        if (out) {
+            out[0] = len;
+        }
+        return 1;
+    }
+
+    for (bytes = 1; bytes < sizeof(size_t) && len >> (8 * bytes); bytes++);
+    if (out) {
+        out[0] = 0x80 | bytes;
+        for (i = 0; i < bytes; i++) {
+            out[1 + i] = len >> (8 * (bytes - 1 - i));
+        }
+    }
+
+    return 1 + bytes;
+}
+
+/*****************************************************************************/
+/*
+ * Write an integer of any of the integer types. Signed integers are encoded
+ * in two's complement, the unsigned types get a leading zero, if their
+ * highest bit is set.
+ *
+ * u_char *out - the buffer
+ * u_char type - ASN type
+ * int64_t value - the value
+ *
+ * returns size_t - bytes written
+ */
+size_t encodeInteger(u_char *out, u_char type, int64_t value)
+{
+    u_char bytes[9];
+    int len = 0, i;
+    uint64_t bits = value;
+
+    if (type == ASN_INTEGER) {
+        do {
+            bytes[len++] = bits;
+            value >>= 8;
+            bits = value;
+        } while (! ((value == 0 && ! (bytes[len - 1] & 0x80)) || (value == -1 && (bytes[len - 1] & 0x80))));
+    } else {
+        do {
+            bytes[len++] = bits;
+            bits >>= 8;
+        } while (bits);
+        if (bytes[len - 1] & 0x80) {
+            bytes[len++] = 0;
+        }
+    }
+
+    out[0] = type;
+    out[1] = len;
+    for (i = 0; i < len; i++) {
+        out[2 + i] = bytes[len - 1 - i];
+    }
+
+    return 2 + len;
+}
+
+/*****************************************************************************/
+/*
+ * Write an oid
+ *
+ * u_char *out - the buffer
+ * const uint32_t *oid, size_t oidLen - the oid
+ *
+ * returns size_t - bytes written
+ */
+size_t encodeOid(u_char *out, const uint32_t *oid, size_t oidLen)
+{
+    u_char content[MAX_OID_LEN * 5];
+    size_t len = 0, i, header;
+    uint32_t subid;
+    int bytes;
+
+    for (i = 1; i < oidLen; i++) {
+        subid = i == 1 ? oid[0] * 40 + oid[1] : oid[i];
+        for (bytes = 1; bytes < 5 && subid >> (7 * bytes); bytes++);
+        while (bytes--) {
+            content[len++] = ((subid >> (7 * bytes)) & 0x7f) | (bytes ? 0x80 : 0);
+        }
+    }
+
+    out[0] = ASN_OBJECT_ID;
+    header = 1 + encodeLength(out + 1, len);
+    memcpy(out + header, content, len);
+
+    return header + len;
+}
+
+/*****************************************************************************/
+/*
+ * Write the value of an instance for a modem: the base value of the object,
+ * its step per row, a per modem variation and for counters and timeticks the
+ * increase since the start of the simulator
+ *
+ * u_char *out - the buffer
+ * instance_t *instance - the instance
+ * modem_t *modem - the modem
+ *
+ * returns size_t - bytes written
+ */
+size_t encodeValue(u_char *out, instance_t *instance, modem_t *modem)
+{
+    object_t *object = instance->object;
+    size_t len, header;
+    int64_t value;
+
+    if (object->type == ASN_OCTET_STR) {
+        len = strlen(object->text);
+        out[0] = ASN_OCTET_STR;
+        header = 1 + encodeLength(out + 1, len);
+        memcpy(out + header, object->text, len);
+        return header + len;
+    }
+
+    value = object->base + object->step * instance->row + (modem->docsis31 ? object->docsis31 : 0);
+    if (object->spread) {
+        value += modemHash(modem->number, object - objects + 16, instance->row) % object->spread;
+    }
+    value += object->rate * (int64_t)((now() - started) / 1000000);
+    if (object->type == ASN_COUNTER || object->type == ASN_GAUGE || object->type == ASN_TIMETICKS) {
+        value &= 0xffffffff;
+    }
+
+    return encodeInteger(out, object->type, value);
+}
+
+/*****************************************************************************/
+/*
+ * Append a varbind to the varbind list of a response
+ *
+ * u_char *out - end of the varbind list
+ * const uint32_t *oid, size_t oidLen - name of the varbind
+ * const u_char *value, size_t valueLen - the encoded value
+ *
+ * returns size_t - bytes written
+ */
+size_t appendVarbind(u_char *out, const uint32_t *oid, size_t oidLen, const u_char *value, size_t valueLen)
+{
+    u_char name[MAX_OID_LEN * 5 + 8];
+    size_t nameLen = encodeOid(name, oid, oidLen), header;
+
+    out[0] = ASN_SEQUENCE;
+    header = 1 + encodeLength(out + 1, nameLen + valueLen);
+    memcpy(out + header, name, nameLen);
+    memcpy(out + header + nameLen, value, valueLen);
+
+    return header + nameLen + valueLen;
+}
+
+/*****************************************************************************/
+/*
+ * Put a BER header in front of the content at *start
+ *
+ * u_char **start - start of the content, moved to the header
+ * u_char type - ASN type
+ * size_t len - length of the content
+ *
+ * returns void
+ */
+void prependHeader(u_char **start, u_char type, size_t len)
+{
+    size_t bytes = encodeLength(NULL, len);
+
+    *start -= 1 + bytes;
+    (*start)[0] = type;
+    encodeLength(*start + 1, len);
+}
+
+/*****************************************************************************/
+/*
+ * Put an element in front of the content at *start
+ *
+ * u_char **start - start of the content, moved to the element
+ * const u_char *element - the encoded element
+ * size_t len - its length
+ *
+ * returns void
+ */
+void prependElement(u_char **start, const u_char *element, size_t len)
+{
+    *start -= len;
+    memcpy(*start, element, len);
+}
+
+/*****************************************************************************/
+/*
+ * Read a BER header
+ *
+ * u_char **p - position, moved behind the header
+ * u_char *end - end of the data
+ * u_char *type - the type
+ * size_t *len - length of the content, which is checked against the end
+ *
+ * returns int - 0 if the header is invalid
+ */
+int parseHeader(u_char **p, u_char *end, u_char *type, size_t *len)
+{
+    int bytes;
+
+    if (end - *p < 2) {
+        return 0;
+    }
+    *type = *(*p)++;
+    *len = *(*p)++;
+
+    if (*len & 0x80) {
+        bytes = *len & 0x7f;
+        if (! bytes || bytes > 4 || end - *p < bytes) {
+            return 0;
+        }
+        for (*len = 0; bytes--; (*p)++) {
+            *len = (*len << 8) | **p;
+        }
+    }
+
+    return *len <= (size_t)(end - *p);
+}
+
+/*****************************************************************************/
+/*
+ * Read an integer
+ *
+ * u_char **p - position, moved behind the integer
+ * u_char *end - end of the data
+ * long *value - the value
+ *
+ * returns int - 0 if the element is not a valid integer
+ */
+int parseInteger(u_char **p, u_char *end, long *value)
+{
+    u_char type;
+    size_t len, i;
+
+    if (! parseHeader(p, end, &type, &len) || type != ASN_INTEGER || ! len || len > sizeof(long)) {
+        return 0;
+    }
+
+    *value = (signed char)**p;
+    for (i = 1; i < len; i++) {
+        *value = (*value << 8) | (*p)[i];
+    }
+    *p += len;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Read the name of a varbind
+ *
+ * u_char *data, size_t len - contents of the oid
+ * uint32_t *oid, size_t *oidLen - the sub-identifiers
+ *
+ * returns int - 0 if the oid is invalid
+ */
+int parseOid(u_char *data, size_t len, uint32_t *oid, size_t *oidLen)
+{
+    size_t i;
+    uint32_t subid = 0;
+
+    if (! len) {
+        return 0;
+    }
+
+    for (*oidLen = 0, i = 0; i < len; i++) {
+        subid = (subid << 7) | (data[i] & 0x7f);
+        if (data[i] & 0x80) {
+            continue;
+        }
+        if (! *oidLen) {
+            oid[0] = subid < 80 ? subid / 40 : 2;
+            oid[1] = subid - oid[0] * 40;
+            *oidLen = 2;
+        } else if (*oidLen < MAX_OID_LEN) {
+            oid[(*oidLen)++] = subid;
+        } else {
+            return 0;
+        }
+        subid = 0;
+    }
+
+    return ! (data[len - 1] & 0x80);
+}
+
+/*****************************************************************************/
+/*
+ * Answer a request to a modem. Get, getNext and getBulk requests of SNMPv1
+ * and SNMPv2c are answered, requests with another community are ignored like
+ * real modems do. The repetitions of a getBulk request are cut off before the
+ * response exceeds the maximum response size, modems with the tooBig quirk
+ * answer tooBig instead once it exceeds TOO_BIG_LIMIT.
+ *
+ * u_char *request, size_t requestLen - the request
+ * modem_t *modem - the modem
+ * u_char *buffer - buffer of HEADROOM + MAX_RESPONSE bytes for the response
+ * u_char **response, size_t *responseLen - the response within the buffer
+ *
+ * returns int - 0 if the request is not answered
+ */
+int answerRequest(u_char *request, size_t requestLen, modem_t *modem, u_char *buffer, u_char **response, size_t *responseLen)
+{
+    u_char *p = request, *end = request + requestLen, *start, type, command, element[16];
+    u_char value[512], *list = buffer + HEADROOM;
+    size_t len, listLen = 0, limit, added;
+    long version, reqid, nonRepeaters, repetitions, cursors[MAX_REQUEST_VARBINDS], instance;
+    uint32_t names[MAX_REQUEST_VARBINDS][MAX_OID_LEN];
+    size_t nameLens[MAX_REQUEST_VARBINDS];
+    int count = 0, i, r, ended, errorStatus = 0;
+    mib_t *mib = &mibs[modem->docsis31];
+
+    /* message, version and community */
+    if (! parseHeader(&p, end, &type, &len) || type != ASN_SEQUENCE || ! parseInteger(&p, end, &version) || version > 1 ||
+        ! parseHeader(&p, end, &type, &len) || type != ASN_OCTET_STR || len != strlen(community) || memcmp(p, community, len)) {
+        return 0;
+    }
+    p += len;
+
+    /* pdu */
+    if (! parseHeader(&p, end, &command, &len) || ! parseInteger(&p, end, &reqid) ||
+        ! parseInteger(&p, end, &nonRepeaters) || ! parseInteger(&p, end, &repetitions) ||
+        ! parseHeader(&p, end, &type, &len) || type != ASN_SEQUENCE) {
+        return 0;
+    }
+    if (command != SNMP_MSG_GETBULK) {
+        nonRepeaters = MAX_REQUEST_VARBINDS;
+        repetitions = 0;
+    } else if (! version) {
+        return 0;
+    }
+
+    while (p < end && count < MAX_REQUEST_VARBINDS) {
+        if (! parseHeader(&p, end, &type, &len) || type != ASN_SEQUENCE ||
+            ! parseHeader(&p, end, &type, &len) || type != ASN_OBJECT_ID ||
+            ! parseOid(p, len, names[count], &nameLens[count])) {
+            return 0;
+        }
+        p += len;
+        if (! parseHeader(&p, end, &type, &len)) {
+            return 0;
+        }
+        p += len;
+        cursors[count++] = -1;
+    }
+
+    nonRepeaters = nonRepeaters < 0 ? 0 : nonRepeaters > count ? count : nonRepeaters;
+    repetitions = repetitions < 0 ? 0 : repetitions > MAX_REPETITIONS ? MAX_REPETITIONS : repetitions;
+    limit = (modem->tooBig ? TOO_BIG_LIMIT : maxResponse) - 64 - strlen(community);
+
+    /* the non-repeaters have to fit as a whole, otherwise the response is tooBig */
+    for (i = 0; i < nonRepeaters; i++) {
+        instance = command == SNMP_MSG_GET ? findInstance(mib, names[i], nameLens[i]) : nextInstance(mib, modem, names[i], nameLens[i], -1);
+        if (instance < 0) {
+            value[0] = command == SNMP_MSG_GET ? SNMP_NOSUCHINSTANCE : SNMP_ENDOFMIBVIEW;
+            value[1] = 0;
+            added = appendVarbind(list + listLen, names[i], nameLens[i], value, 2);
+        } else {
+            added = appendVarbind(list + listLen, mib->instances[instance].oid, mib->instances[instance].oidLen,
+                                  value, encodeValue(value, &mib->instances[instance], modem));
+        }
+        if (listLen + added > limit) {
+            errorStatus = SNMP_ERR_TOOBIG;
+            break;
+        }
+        listLen += added;
+    }
+
+    for (r = 0; r < repetitions && ! errorStatus && count > nonRepeaters; r++) {
+        for (i = nonRepeaters, ended = 1; i < count; i++) {
+            if (cursors[i] != -2) {
+                cursors[i] = nextInstance(mib, modem, names[i], nameLens[i], cursors[i]);
+                cursors[i] = cursors[i] < 0 ? -2 : cursors[i];
+            }
+
+            if (cursors[i] == -2) {
+                value[0] = SNMP_ENDOFMIBVIEW;
+                value[1] = 0;
+                added = appendVarbind(list + listLen, names[i], nameLens[i], value, 2);
+            } else {
+                added = appendVarbind(list + listLen, mib->instances[cursors[i]].oid, mib->instances[cursors[i]].oidLen,
+                                      value, encodeValue(value, &mib->instances[cursors[i]], modem));
+                ended = 0;
+            }
+
+            if (listLen + added > limit) {
+                errorStatus = modem->tooBig ? SNMP_ERR_TOOBIG : 0;
+                repetitions = 0;
+                break;
+            }
+            listLen += added;
+        }
+        if (ended) {
+            break;
+        }
+    }
+
+    /* a tooBig response carries no varbinds */
+    if (errorStatus) {
+        listLen = 0;
+    }
+
+    start = list;
+    prependHeader(&start, ASN_SEQUENCE, listLen);
+    prependElement(&start, element, encodeInteger(element, ASN_INTEGER, 0));
+    prependElement(&start, element, encodeInteger(element, ASN_INTEGER, errorStatus));
+    prependElement(&start, element, encodeInteger(element, ASN_INTEGER, reqid));
+    prependHeader(&start, SNMP_MSG_RESPONSE, list + listLen - start);
+    prependElement(&start, (const u_char *)community, strlen(community));
+    prependHeader(&start, ASN_OCTET_STR, strlen(community));
+    prependElement(&start, element, encodeInteger(element, ASN_INTEGER, version));
+    prependHeader(&start, ASN_SEQUENCE, list + listLen - start);
+
+    *response = start;
+    *responseLen = list + listLen - start;
+
+    return 1;
+}
+
+/*****************************************************************************/
+/*
+ * Add a response to the delayed responses of an agent
+ *
+ * agent_t *agent - the agent
+ * pending_t *pending - the response
+ *
+ * returns void
+ */
+void pushPending(agent_t *agent, pending_t *pending)
+{
+    long i = agent->count++, parent;
+
+    if (agent->count > agent->size) {
+        agent->size = agent->size ? agent->size * 2 : 1024;
+        agent->heap = realloc(agent->heap, agent->size * sizeof(pending_t *));
+    }
+
+    for (; i && agent->heap[parent = (i - 1) / 2]->due > pending->due; i = parent) {
+        agent->heap[i] = agent->heap[parent];
+    }
+    agent->heap[i] = pending;
+}
+
+/*****************************************************************************/
+/*
+ * Remove the earliest of the delayed responses of an agent
+ *
+ * agent_t *agent - the agent
+ *
+ * returns pending_t*
+ */
+pending_t *popPending(agent_t *agent)
+{
+    pending_t *first = agent->heap[0], *last = agent->heap[--agent->count];
+    long i = 0, child;
+
+    while ((child = 2 * i + 1) < agent->count) {
+        if (child + 1 < agent->count && agent->heap[child + 1]->due < agent->heap[child]->due) {
+            child++;
+        }
+        if (last->due <= agent->heap[child]->due) {
+            break;
+        }
+        agent->heap[i] = agent->heap[child];
+        i = child;
+    }
+    if (agent->count) {
+        agent->heap[i] = last;
+    }
+
+    return first;
+}
+
+/*****************************************************************************/
+/*
+ * Send the queued responses of an agent with one sendmmsg call. The source
+ * address of each response is the address of its modem, so that the poller
+ * accepts it.
+ *
+ * agent_t *agent - the agent
+ *
+ * returns void
+ */
+void flushResponses(agent_t *agent)
+{
+    struct mmsghdr headers[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    char control[BATCH_SIZE][CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct cmsghdr *cmsg;
+    struct in_pktinfo *info;
+    int i, sent, offset = 0;
+
+    memset(headers, 0, sizeof(headers));
+    memset(control, 0, sizeof(control));
+    for (i = 0; i < agent->queued; i++) {
+        iov[i].iov_base = agent->outgoing[i]->data;
+        iov[i].iov_len = agent->outgoing[i]->len;
+        headers[i].msg_hdr.msg_name = &agent->outgoing[i]->peer;
+        headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        headers[i].msg_hdr.msg_iov = &iov[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_control = control[i];
+        headers[i].msg_hdr.msg_controllen = sizeof(control[i]);
+
+        cmsg = CMSG_FIRSTHDR(&headers[i].msg_hdr);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+        info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+        info->ipi_spec_dst = agent->outgoing[i]->local;
+    }
+
+    while (offset < agent->queued) {
+        if ((sent = sendmmsg(agent->fd, headers + offset, agent->queued - offset, 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* a full send buffer drops the rest, like a congested modem */
+            agent->dropped += agent->queued - offset;
+            break;
+        }
+        agent->responses += sent;
+        offset += sent;
+    }
+
+    for (i = 0; i < agent->queued; i++) {
+        free(agent->outgoing[i]);
+    }
+    agent->queued = 0;
+}
+
+/*****************************************************************************/
+/*
+ * Queue a response for the next sendmmsg call of the agent
+ *
+ * agent_t *agent - the agent
+ * pending_t *pending - the response
+ *
+ * returns void
+ */
+void queueResponse(agent_t *agent, pending_t *pending)
+{
+    agent->outgoing[agent->queued++] = pending;
+    if (agent->queued == BATCH_SIZE) {
+        flushResponses(agent);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Handle a received request: drop it, if the modem is unknown, offline or
+ * the packet is lost, otherwise answer it at once or after the latency
+ *
+ * agent_t *agent - the agent
+ * u_char *packet, size_t len - the request
+ * struct sockaddr_in *peer - sender of the request
+ * struct in_addr local - destination of the request, the address of the modem
+ * u_char *buffer - buffer for the response
+ *
+ * returns void
+ */
+void handleRequest(agent_t *agent, u_char *packet, size_t len, struct sockaddr_in *peer, struct in_addr local, u_char *buffer)
+{
+    modem_t modem;
+    u_char *response;
+    size_t responseLen;
+    pending_t *pending;
+
+    agent->requests++;
+    if (! getModem(local, &modem) || (lossPercent && nextRandom(agent) % 100 < (uint64_t)lossPercent) ||
+        ! answerRequest(packet, len, &modem, buffer, &response, &responseLen)) {
+        agent->dropped++;
+        return;
+    }
+
+    pending = malloc(sizeof(pending_t) + responseLen);
+    pending->due = now() + latency + (jitter ? nextRandom(agent) % jitter : 0);
+    pending->peer = *peer;
+    pending->local = local;
+    pending->len = responseLen;
+    memcpy(pending->data, response, responseLen);
+
+    if (latency || jitter) {
+        pushPending(agent, pending);
+    } else {
+        queueResponse(agent, pending);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Thread of an agent: read the requests in batches with recvmmsg, answer them
+ * and send the responses, which are due, in batches with sendmmsg
+ *
+ * void *arg - the agent
+ *
+ * returns void*
+ */
+void *runAgent(void *arg)
+{
+    agent_t *agent = arg;
+    struct mmsghdr headers[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    struct sockaddr_in peers[BATCH_SIZE];
+    char control[BATCH_SIZE][CMSG_SPACE(sizeof(struct in_pktinfo))];
+    u_char *buffers = malloc(BATCH_SIZE * PACKET_SIZE), *response = malloc(HEADROOM + MAX_RESPONSE);
+    struct cmsghdr *cmsg;
+    struct in_addr local;
+    struct pollfd pfd = { agent->fd, POLLIN, 0 };
+    uint64_t current;
+    int i, received, timeout;
+
+    while (! stopped) {
+        timeout = 100;
+        if (agent->count) {
+            current = now();
+            timeout = agent->heap[0]->due > current ? (agent->heap[0]->due - current + 999) / 1000 : 0;
+            timeout = timeout > 100 ? 100 : timeout;
+        }
+
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        do {
+            for (i = 0; i < BATCH_SIZE; i++) {
+                iov[i].iov_base = buffers + i * PACKET_SIZE;
+                iov[i].iov_len = PACKET_SIZE;
+                memset(&headers[i], 0, sizeof(headers[i]));
+                headers[i].msg_hdr.msg_name = &peers[i];
+                headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+                headers[i].msg_hdr.msg_iov = &iov[i];
+                headers[i].msg_hdr.msg_iovlen = 1;
+                headers[i].msg_hdr.msg_control = control[i];
+                headers[i].msg_hdr.msg_controllen = sizeof(control[i]);
+            }
+
+            if ((received = recvmmsg(agent->fd, headers, BATCH_SIZE, MSG_DONTWAIT, NULL)) < 0) {
+                break;
+            }
+
+            for (i = 0; i < received; i++) {
+                local.s_addr = 0;
+                for (cmsg = CMSG_FIRSTHDR(&headers[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&headers[i].msg_hdr, cmsg)) {
+                    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+                        local = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_addr;
+                    }
+                }
+                handleRequest(agent, iov[i].iov_base, headers[i].msg_len, &peers[i], local, response);
+            }
+        } while (received == BATCH_SIZE);
+
+        for (current = now(); agent->count && agent->heap[0]->due <= current;) {
+            queueResponse(agent, popPending(agent));
+        }
+        flushResponses(agent);
+    }
+
+    free(buffers);
+    free(response);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/*
+ * Open the socket of an agent. All agents bind the same port with
+ * SO_REUSEPORT, the kernel spreads the requests between them.
+ *
+ * agent_t *agent - the agent
+ * int port - UDP port
+ *
+ * returns void
+ */
+void openAgent(agent_t *agent, int port)
+{
+    int on = 1, size = SOCKET_BUFFER;
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+
+    if ((agent->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    setsockopt(agent->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    setsockopt(agent->fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+    if (setsockopt(agent->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))) {
+        setsockopt(agent->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (setsockopt(agent->fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size))) {
+        setsockopt(agent->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+
+    if (bind(agent->fd, (struct sockaddr *)&address, sizeof(address))) {
+        perror("bind");
+        exit(1);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Write the host list of the simulated modems for the -f option of the
+ * poller. The list is written to a temporary file and renamed, so that its
+ * existence tells that the simulator is ready.
+ *
+ * const char *path - the host list
+ *
+ * returns void
+ */
+void writeHostList(const char *path)
+{
+    long i;
+    char tmp[4096];
+    struct in_addr address;
+    FILE *file;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (! (file = fopen(tmp, "w"))) {
+        perror(tmp);
+        exit(1);
+    }
+
+    for (i = 0; i < modems; i++) {
+        address.s_addr = htonl(ntohl(firstAddress.s_addr) + i);
+        fprintf(file, "%s\t%s\tcm-%ld.sim\tcmts-%ld\t%ld\n", inet_ntoa(address), community, i + 1, i / 1000, i + 1);
+    }
+
+    if (fclose(file) || rename(tmp, path)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/*****************************************************************************/
+/*
+ * Stop the agents
+ *
+ * int signal - the signal
+ *
+ * returns void
+ */
+void stop(int signal)
+{
+    (void)signal;
+    stopped = 1;
+}
+
+/*****************************************************************************/
+/*
+ * main function
+ *
+ * returns int
+ */
+int main(int argc, char **argv)
+{
+    int c, i, threads = 1, port = 161;
+    long requests = 0, responses = 0, dropped = 0;
+    const char *hostList = NULL;
+    object_t *object;
+    agent_t *agents;
+    struct sigaction action = { .sa_handler = stop };
+    static char usage[] = "usage: %s [-3 percent_docsis31] [-a ofdma_channels] [-A first_address] [-c community] [-d downstream_channels] [-E percent_early_end_of_table] [-f host_list_file] [-j jitter_ms] [-l latency_ms] [-L percent_loss] [-m max_response_size] [-n modems] [-o ofdm_channels] [-O percent_offline] [-p port] [-s seed] [-t threads] [-T percent_too_big] [-u upstream_channels]\n";
+
+    inet_pton(AF_INET, "127.1.0.1", &firstAddress);
+
+    while ((c = getopt(argc, argv, "3:a:A:c:d:E:f:j:l:L:m:n:o:O:p:s:t:T:u:")) != -1) {
+        switch (c) {
+        case '3':
+            docsis31Percent = atoi(optarg);
+            break;
+        case 'a':
+            ofdmaChannels = atoi(optarg);
+            break;
+        case 'A':
+            if (inet_pton(AF_INET, optarg, &firstAddress) != 1) {
+                fprintf(stderr, "Invalid address %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            community = optarg;
+            break;
+        case 'd':
+            downstreams = atoi(optarg);
+            break;
+        case 'E':
+            earlyPercent = atoi(optarg);
+            break;
+        case 'f':
+            hostList = optarg;
+            break;
+        case 'j':
+            jitter = atol(optarg) * 1000;
+            break;
+        case 'l':
+            latency = atol(optarg) * 1000;
+            break;
+        case 'L':
+            lossPercent = atoi(optarg);
+            break;
+        case 'm':
+            maxResponse = atol(optarg) > 484 && atol(optarg) <= MAX_RESPONSE ? atol(optarg) : MAX_RESPONSE;
+            break;
+        case 'n':
+            modems = atol(optarg) > 0 ? atol(optarg) : 1;
+            break;
+        case 'o':
+            ofdmChannels = atoi(optarg);
+            break;
+        case 'O':
+            offlinePercent = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            threads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'T':
+            tooBigPercent = atoi(optarg);
+            break;
+        case 'u':
+            upstreams = atoi(optarg);
+            break;
+        case '?':
+            if (optopt && strchr("3aAcdEfjlLmnoOpstTu", optopt)) {
+                fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+            } else if (isprint(optopt)) {
+                fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+            } else {
+                fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+            }
+
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        default:
+            abort();
+        }
+    }
+
+    for (object = objects; object->name; object++) {
+        if (! parseName(object->name, object->oid, &object->oidLen)) {
+            fprintf(stderr, "Invalid oid %s\n", object->name);
+            return 1;
+        }
+    }
+    buildMib(&mibs[0], 0);
+    buildMib(&mibs[1], 1);
+    started = now();
+
+    agents = calloc(threads, sizeof(agent_t));
+    for (i = 0; i < threads; i++) {
+        agents[i].random = mix(seed + i + 1);
+        openAgent(&agents[i], port);
+    }
+    if (hostList) {
+        writeHostList(hostList);
+    }
+
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "Simulating %ld modems from %s on port %d\n", modems, inet_ntoa(firstAddress), port);
+
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&agents[i].thread, NULL, runAgent, &agents[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    runAgent(&agents[0]);
+
+    for (i = 0; i < threads; i++) {
+        if (i) {
+            pthread_join(agents[i].thread, NULL);
+        }
+        requests += agents[i].requests;
+        responses += agents[i].responses;
+        dropped += agents[i].dropped;
+        close(agents[i].fd);
+    }
+    fprintf(stderr, "Received %ld requests, sent %ld responses, dropped %ld\n", requests, responses, dropped);
+
+    return 0;
+}